@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/**
+ * @file bvh.hpp
+ * @brief
+ * Bounding volume hierarchy over the surfaces of a room, to test whether a
+ * segment of a reflection path is blocked by another surface (only concave
+ * rooms need it).
+ **/
+
+#ifndef BVH_HPP_
+#define BVH_HPP_
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include "surface.hpp"
+#include "utils/vec3.hpp"
+
+namespace avrs
+{
+
+class Bvh
+{
+public:
+	typedef boost::shared_ptr<Bvh> ptr_t;
+
+	static ptr_t create(const std::vector<Surface::ptr_t> &surfaces);
+	virtual ~Bvh();
+
+	bool is_occluded(const vec3_t &p0, const vec3_t &p1) const;
+	unsigned int n_nodes() const;
+
+private:
+	Bvh(const std::vector<Surface::ptr_t> &surfaces);
+
+	// Node of the tree. The leaves have count > 0 and the surfaces
+	// _index[first .. first + count - 1], the inner nodes have their children
+	// at first and first + 1.
+	typedef struct Node
+	{
+		vec3_t lo;  // bounding box
+		vec3_t hi;
+		unsigned int first;
+		unsigned int count;
+	} node_t;
+
+	// Orders surfaces by the centroid along an axis (to split a node)
+	typedef struct CentroidLess
+	{
+		const std::vector<vec3_t> *centroids;
+		unsigned int axis;
+
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			return (*centroids)[a](axis) < (*centroids)[b](axis);
+		}
+	} centroidless_t;
+
+	std::vector<node_t> _nodes;
+	std::vector<unsigned int> _index;  // surfaces, in the order of the leaves
+	std::vector<const Surface *> _surfaces;
+	std::vector<vec3_t> _centroids;
+
+	void _build(unsigned int node, unsigned int first, unsigned int count);
+	bool _hit_box(const node_t &node, const vec3_t &origin, const vec3_t &inv_dir) const;
+	bool _hit_surface(const Surface *s, const vec3_t &p0, const vec3_t &dir, float t_min, float t_max) const;
+};
+
+inline unsigned int Bvh::n_nodes() const
+{
+	return (unsigned int) _nodes.size();
+}
+
+}  // namespace avrs
+
+#endif /* BVH_HPP_ */
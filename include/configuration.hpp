@@ -32,6 +32,21 @@
 namespace avrs
 {
 
+// How the ISM keeps the VSs
+typedef enum
+{
+	ISM_MODE_TREE,  ///< full tree of VSs
+	ISM_MODE_STREAM,  ///< depth-first with a bounded stack, only audible VSs are kept
+	ISM_MODE_BEST_FIRST  ///< most important candidates first, until a budget is reached
+} ism_mode_t;
+
+// Order of the candidates in best-first mode
+typedef enum
+{
+	ISM_PRIORITY_TIME,  ///< earlier arrival first
+	ISM_PRIORITY_ENERGY  ///< higher level first
+} ism_priority_t;
+
 // Simulation configuration
 typedef struct Configuration
 {
@@ -42,8 +57,11 @@ typedef struct Configuration
 	float temperature;
 	float speed_of_sound;
 	float angle_threshold;
+	float position_threshold;  ///< listener translation (in meters) that updates the VSs, 0 disables it
+	float listener_margin;  ///< listener translation (in meters) from the calculation of the VSs that calculates them again
 	float bir_length_sec; ///< binaural impulse response (BIR) length in seconds
 	unsigned long bir_length_samples;
+	unsigned int render_threads;  ///< threads that render the VSs (0 = one per core)
 	std::string air_absorption_file;
 
 	// Room
@@ -55,20 +73,42 @@ typedef struct Configuration
 	double rt60_pi;
 	std::vector< std::vector<double> > b_coeff;  // surface material
 	std::vector< std::vector<double> > a_coeff;  // surface material
+	bool merge_surfaces;  ///< merge adjacent coplanar surfaces with the same material
+	std::vector<unsigned int> dynamic_surfaces;  ///< surfaces that can be moved (index in the DXF file)
+	bool zones;  ///< use the ZONE_ and PORTAL_ layers of the DXF file to cull surfaces
+	unsigned int portal_depth;  ///< zones visible from a zone (number of portals crossed)
 
 	// ISM parameters
 	float max_distance;
 	unsigned int max_order;
 	float transition_time;
+	bool ism_pruning;  ///< cut VS subtrees below min_level_db
+	float min_level_db;  ///< level floor relative to the direct sound
+	bool ism_masking;  ///< discard VSs masked by the direct sound
+	float masking_threshold_db;  ///< masking threshold relative to the direct sound
+	float masking_time_ms;  ///< length of the masking window after the direct sound
+	bool ism_dedup;  ///< merge coincident VSs
+	float dedup_tolerance;  ///< grid size for coincident VSs (in meters)
+	ism_mode_t ism_mode;
+	float memory_budget_mb;  ///< limit for audible VSs in stream mode (0 = unlimited)
+	ism_priority_t ism_priority;
+	float time_budget_ms;  ///< time limit in best-first mode (0 = unlimited)
+	unsigned long max_vs;  ///< VS limit in best-first mode (0 = unlimited)
+	bool ism_lattice;  ///< lattice of VSs for shoebox rooms
+	bool ism_moving_source;  ///< keep the reflection transform of each VS (the source can be moved)
+	float source_margin;  ///< distance the source is moved before the ISM is calculated again (in meters)
+	bool ism_occlusion;  ///< reject the paths blocked by other surfaces (concave rooms)
+	std::string ism_cache_dir;  ///< directory for the ISM cache (empty = disabled)
 
 	// FDN
 	std::string fdn_b_coeff;
 	std::string fdn_a_coeff;
 
-	// Sound Source
-	std::string ir_file;
-	std::string directivity_file;
-	SoundSource::ptr_t sound_source;
+	// Sound Sources
+	unsigned int n_sources;
+	std::vector<std::string> ir_files;
+	std::vector<std::string> directivity_files;
+	std::vector<SoundSource::ptr_t> sound_sources;
 
 	// Listener
 	std::string hrtf_file;
@@ -77,8 +117,8 @@ typedef struct Configuration
 	// Output
 	float master_gain_db; ///< correction factor in dB
 
-	// Input
-	std::string anechoic_file;
+	// Input (one file for each source)
+	std::vector<std::string> anechoic_files;
 
 	// Tracker
 	std::string tracker_sim_file;
@@ -101,6 +141,7 @@ private:
 	std::string _path;
 
 	std::string full_path(const std::string relative_path);
+	std::string source_key(const std::string key, unsigned int source);
 	bool load_surface_filters(std::string filename);
 };
 
@@ -29,7 +29,6 @@
 #include <list>
 #include <stdexcept>
 #include <fftw3.h>
-#include <utility>    // for std::pair
 #include <inttypes.h> // for uint32_t
 #include <boost/shared_ptr.hpp>
 
@@ -60,16 +59,33 @@ class Convolver
     void set_filter_f(data_t& filter);
     void set_neutral_filter();
 
+    // filter updates from another (writer) thread, see filter_buffer()
+    data_t& filter_buffer();
+    void publish_filter();
+    void update_filter();
+
     static void prepare_impulse_response(data_t& container, const float *filter
         , const unsigned int filter_size, const unsigned int partition_size);
 
     static void sort_coefficients(data_t& coefficients
         , const unsigned int partition_size);
+    static void sort_coefficients(const float *coefficients, float *buffer
+        , const unsigned int partition_size);
 
     float* convolve_signal(float *signal, float weighting_factor = 1.0f);
 
   private:
-    typedef std::list< std::pair<data_t, unsigned int> > waiting_queue_t;
+    /// number of filters that can be waiting, published or being written
+    /// at the same time
+    static const unsigned int _filter_slots = 8;
+
+    /// a filter whose partitions are being exchanged: its slot and the
+    /// number of cycles it has already waited
+    typedef struct
+    {
+      unsigned int slot;
+      unsigned int age;
+    } waiting_filter_t;
 
     Convolver(const nframes_t nframes, const crossfade_t crossfade_type)
       throw (std::bad_alloc, std::runtime_error);
@@ -84,10 +100,22 @@ class Convolver
 
     float _old_weighting_factor;
 
-    /// this is a list holding the filters that are supposed 
+    /// preallocated filters in the frequency domain, they are written by
+    /// the writer thread and only handed over to the convolution by index
+    data_t _filters[_filter_slots];
+
+    /// slots that are published or waiting (they are released by the side
+    /// that drops them)
+    volatile int _filter_used[_filter_slots];
+
+    volatile int _published_filter; ///< slot to be taken by update_filter() (-1: none)
+    int _writing_filter; ///< slot returned by filter_buffer() (-1: none)
+
+    /// this is a queue holding the filters that are supposed
     /// to be used for the convolution; it also holds the number of cycles
-    /// that they have already waited 
-    waiting_queue_t _waiting_queue;
+    /// that they have already waited (at most _filter_slots - 2)
+    waiting_filter_t _waiting_queue[_filter_slots];
+    unsigned int _waiting_count;
 
     /// list holding the spectrum of the different double-frames 
     /// of input signal to be convolved
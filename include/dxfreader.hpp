@@ -26,6 +26,7 @@
 #include <dxflib/dl_creationadapter.h>
 #include <boost/shared_ptr.hpp>
 #include <vector>
+#include <string>
 
 #include "surface.hpp"
 
@@ -54,10 +55,12 @@ public:
     virtual void add3dFace(const DL_3dFaceData& data);
 
     std::vector<Surface::ptr_t> get_surfaces();
+    std::vector<std::string> get_layers();
     void print_attributes();
 
 private:
     std::vector<Surface::ptr_t> _surfaces;
+    std::vector<std::string> _layers;  // layer of each surface (same order)
 };
 
 }  // namespace avrs
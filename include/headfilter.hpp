@@ -30,6 +30,8 @@
 
 namespace avrs {
 
+#define HRTF_LUT_STEP 1.0  // in degrees
+
 typedef struct HrtfCoeff
 {
 	std::vector<double> b_left;
@@ -50,6 +52,14 @@ typedef struct HrtfCoeff
 	}
 } hrtfcoeff_t;
 
+/// HRTFs around a direction (vertices of its triangle) and their weights
+typedef struct HrtfWeights
+{
+	uint index[3];
+	float weight[3];  // barycentric, sorted from the largest one (they sum 1)
+	uint n;  // HRTFs with a non-zero weight
+} hrtfweights_t;
+
 /**
  * HRTF coefficients set for listener model
  * For use with IIR filters (Steiglitz-McBride method)
@@ -67,11 +77,22 @@ public:
 	//void get_HRTF_coeff(hrtfcoeff_t *val, float az, float el);
 	void get_HRTF_coeff(hrtfcoeff_t *val, point3_t point_L);
 
+	/// Cell of the lookup table of a direction (it does not allocate)
+	uint find_direction(const point3_t &point_L) const;
+	/// HRTFs to interpolate for a cell found by find_direction()
+	const hrtfweights_t &get_HRTF_weights(uint cell) const;
+	/// Coefficients of a HRTF (it can be used from any thread)
+	void get_HRTF_coeff(hrtfcoeff_t *val, uint index) const;
+
 private:
 	HrtfCoeffSet(std::string filename);
 
 	bool _load();
 	void _build_kd_tree();
+	void _triangulate();
+	void _build_lut();
+	uint _search_kd_tree(double *point);
+	bool _weights_in_triangle(uint t, const double *u, hrtfweights_t *w) const;
 	void _allocate_memory();
 	void _deallocate_memory();
 
@@ -100,6 +121,19 @@ private:
 
 	// kd-tree for nearest neighbor search
 	ANNkd_tree* _kd_tree;
+
+	// Spherical Delaunay triangulation of the measured directions (their
+	// convex hull), 3 HRTFs for each triangle, counterclockwise seen from
+	// outside
+	std::vector<uint> _triangles;
+	std::vector< std::vector<uint> > _vertex_triangles;  // triangles of each HRTF
+
+	// Interpolation weights of each direction, in cells of HRTF_LUT_STEP
+	// degrees of azimuth and elevation. The kd-tree search allocates memory
+	// and it is not thread-safe, so it is only used to build the table.
+	std::vector<hrtfweights_t> _lut;
+	uint _lut_n_az;
+	uint _lut_n_el;
 };
 
 }  // namespace avrs
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef IIRBANK_HPP_
+#define IIRBANK_HPP_
+
+#include <vector>
+
+#include "common.hpp"
+
+#ifndef IIR_LANES
+#define IIR_LANES 8  // 4, 8 or 16
+#endif
+
+namespace avrs
+{
+
+/**
+ * Bank of IIR filters (direct form II transposed) computed together in the
+ * SIMD lanes of a vector, as many as IIR_LANES. Each lane has its own
+ * coefficients and state (in float), so the renderer filters several
+ * reflections, or both ears of them, with one instruction. The signals are
+ * interleaved: sample i of lane k is at [i * LANES + k].
+ */
+class IirBank
+{
+public:
+	static const unsigned int LANES = IIR_LANES;
+
+	/**
+	 * @param length number of coefficients of the longest filter
+	 * @param samples maximum number of samples of a block
+	 */
+	IirBank(unsigned int length = 0, unsigned int samples = VS_SAMPLES);
+	~IirBank();
+
+	/**
+	 * Set the coefficients of a lane and clear its state
+	 * @param lane lane of the filter (< LANES)
+	 * @param b numerator coefficients
+	 * @param n_b number of numerator coefficients
+	 * @param a denominator coefficients (a[0] != 0)
+	 * @param n_a number of denominator coefficients
+	 */
+	void set_lane(unsigned int lane, const double *b, unsigned int n_b, const double *a, unsigned int n_a);
+	void set_lane(unsigned int lane, const std::vector<double> &b, const std::vector<double> &a);
+	/// Clear the state of a lane (with a zero input, its output is zero)
+	void clear_lane(unsigned int lane);
+
+	/// Interleaved input of the next block
+	float *input();
+	/// Interleaved output of the last block
+	const float *output() const;
+
+	/// Filter n samples of all the lanes (n <= samples)
+	void filter(unsigned int n);
+
+private:
+	IirBank(const IirBank &);  ///< Prevent copy-construction
+	IirBank &operator=(const IirBank &);  ///< Prevent assignment
+
+	typedef float lanes_t __attribute__ ((vector_size(IIR_LANES * sizeof(float))));
+
+	void _allocate(unsigned int length);
+
+	lanes_t *_b;  // one vector for each coefficient
+	lanes_t *_a;
+	lanes_t *_z;  // state
+	lanes_t *_input;  // one vector for each sample
+	lanes_t *_output;
+	unsigned int _length;
+	unsigned int _samples;
+};
+
+inline float *IirBank::input()
+{
+	return reinterpret_cast<float*> (_input);
+}
+
+inline const float *IirBank::output() const
+{
+	return reinterpret_cast<const float*> (_output);
+}
+
+}  // namespace avrs
+
+#endif  // IIRBANK_HPP_
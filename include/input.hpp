@@ -94,7 +94,7 @@ inline void InputWave::tick(sample_t *val, uint n)
 class InputWaveLoop: public InputBase
 {
 public:
-	typedef std::auto_ptr<InputWaveLoop> ptr_t;
+	typedef boost::shared_ptr<InputWaveLoop> ptr_t;
 
 	virtual ~InputWaveLoop();
 	/// Static factory function for InputWaveLoop objects
@@ -20,28 +20,57 @@
 #define ISM_HPP_
 
 #include <vector>
+#include <string>
 #include <algorithm>
+#include <stdint.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "utils/tree.hpp"
 #include "common.hpp"
 #include "room.hpp"
+#include "soundsource.hpp"
 #include "virtualsource.hpp"
 #include "configuration.hpp"
 
 namespace avrs
 {
 
+#define CACHE_MAGIC "AVRS"
+#define CACHE_VERSION 1
+
 class Ism
 {
 public:
 	typedef boost::shared_ptr<Ism> ptr_t;
 	typedef tree<VirtualSource::ptr_t> tree_vs_t;
 
-	Ism(configuration_t::ptr_t config, const Room::ptr_t &r);
+	// published list of audible VSs, sorted by arrival time (the direct sound
+	// first), with the paths in the same order
+	typedef struct ReflectionList
+	{
+		std::vector<reflection_t> reflections;
+		std::vector<unsigned int> paths;
+		std::vector<Surface::ptr_t> surfaces;  // surfaces of the room when it was published
+		float dist_source_listener;
+		unsigned long generation;  // number of the publication
+	} reflectionlist_t;
+
+	// CPU time of the stages of the last calculate() (in ms)
+	typedef struct Times
+	{
+		float propagate_ms;  // generation of the VSs and audibility tests
+		float flatten_ms;  // array copy and index of the dynamic surfaces
+		float publish_ms;  // swap of the published list
+	} times_t;
+
+	Ism(configuration_t::ptr_t config, const Room::ptr_t &r, const SoundSource::ptr_t &source);
 	virtual ~Ism();
 
 	void calculate(bool discard_nodes);
+	void revalidate(const vec3_t &pos_listener);
+	void update_surface(unsigned int i);
+	void move_source(const vec3_t &pos_source);
 //	void update_vs_audibility();
 	void update_vs_orientations(const orientationangles_t &listener_orientation);
 
@@ -51,6 +80,28 @@ public:
 	unsigned long get_count_visible_vs();
 	unsigned long get_bytes_vs();
 	unsigned long get_bytes_visible_vs();
+	unsigned long get_count_pruned_vs();
+	unsigned long get_count_masked_vs();
+	unsigned long get_count_merged_vs();
+	unsigned long get_bytes_reflections();
+	unsigned long get_count_expanded_vs();
+	unsigned long get_count_pending_vs();
+	float get_horizon_ms();
+	const times_t &get_times() const;
+
+	// disk cache of the compact list
+	std::string cache_filename();
+	bool load_cache(const std::string &filename);
+	void save_cache(const std::string &filename);
+	bool has_tree() const;
+	bool is_from_cache() const;
+
+	bool is_truncated() const;
+
+	// lock-free access to the published list of audible VSs (also filled in
+	// tree mode), it can be held by several threads
+	const reflectionlist_t &acquire_reflections();
+	void release_reflections(const reflectionlist_t &list);
 
 	void print_list();
 	void print_summary();
@@ -63,20 +114,187 @@ public:
 
 private:
 	configuration_t::ptr_t _config;
-	Room::ptr_t _room;
+	Room::ptr_t _room;  // shared by the ISMs of all the sources (read-only)
+	SoundSource::ptr_t _source;
 	float _time_ref_ms;
 	float _dist_source_listener;  // distance from source to listener (in meters)
+	vec3_t _pos_listener;  // listener position used by the current calculation
+	vec3_t _pos_tree;  // listener position used to generate tree_vs
+	vec3_t _pos_source_tree;  // source position used to generate tree_vs
+	vec3_t _pos_listener_tree;  // listener position used to generate tree_vs (_pos_tree follows the updates)
+	int _source_zone;  // zone of the room that contains the source (-1: unknown)
+	times_t _times;
 
 	unsigned long _count_vs;
+	unsigned long _count_pruned;  // subtrees cut by the level floor (convex rooms)
+	unsigned long _count_masked;  // VSs masked by the direct sound
+	unsigned long _count_merged;  // VSs merged with a coincident one
+	unsigned long _count_expanded;  // candidates taken in best-first mode
+	unsigned long _count_pending;  // candidates left when a budget is reached
+	float _horizon_ms;  // relative time of the first pending candidate
+	float _elapsed_ms;
+
+	// key of a VS for the search of coincident VSs
+	typedef struct VSKey
+	{
+		long x, y, z;  // quantized position
+		short order;
+		uint64_t signature;
+
+		bool operator==(const VSKey &k) const
+		{
+			return (x == k.x && y == k.y && z == k.z && order == k.order && signature == k.signature);
+		}
+	} vskey_t;
+
+	typedef struct VSKeyHash
+	{
+		std::size_t operator()(const vskey_t &k) const
+		{
+			std::size_t seed = 0;
+			boost::hash_combine(seed, k.x);
+			boost::hash_combine(seed, k.y);
+			boost::hash_combine(seed, k.z);
+			boost::hash_combine(seed, k.order);
+			boost::hash_combine(seed, k.signature);
+			return seed;
+		}
+	} vskeyhash_t;
+
+	typedef boost::unordered_map<vskey_t, tree_vs_t::iterator, vskeyhash_t> vs_map_t;
+	vs_map_t _map_vs;  // first VS found at each position
 
 	// audible VSs
 	std::vector<VirtualSource::ptr_t> _aud;
 	typedef std::vector<VirtualSource::ptr_t>::iterator aud_it_t;
 
+	// audible VSs as reflections (the direct sound is the first one), they
+	// are built here and then published in the back list
+	std::vector<reflection_t> _reflections;
+	std::vector<unsigned int> _paths;  // surface indexes of all reflection paths
+	reflectionlist_t _lists[2];
+	volatile int _front;  // published list
+	volatile int _readers[2];  // threads that hold each list
+
+	// copy of the tree as arrays (pre-order, so a parent is always before
+	// its children) for the revalidation of the VSs
+	typedef struct FlatVS
+	{
+		std::vector<float> x, y, z;
+		std::vector<float> gain;
+		std::vector<unsigned short> order;
+		std::vector<int> parent;  // -1 for the real source
+		std::vector<int> next_alias;  // -1 if there is no alias
+		std::vector<char> merged;
+		std::vector<const Surface *> surface;
+		std::vector<unsigned int> surface_index;
+		std::vector<float> dist_listener;  // updated by revalidate()
+		std::vector<char> audible;  // updated by revalidate()
+		std::vector<char> valid;  // updated by move_source()
+		std::vector<float> m[9];  // reflection transforms (see _flatten())
+		std::vector<float> t[3];
+
+		unsigned long size() const { return x.size(); }
+	} flatvs_t;
+
+	flatvs_t _flat;
+
+	// nodes of tree_vs reflected on each dynamic surface (pre-order)
+	std::vector< std::vector<tree_vs_t::iterator> > _dynamic_nodes;
+	bool _truncated;  // memory budget exceeded
+	bool _has_tree;  // tree_vs is complete
+	bool _discard_nodes;  // argument of the last calculate()
+	bool _from_cache;
+
+	// disk cache file: header, reflections and paths (all of them POD)
+	typedef struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;  // hash of the scene
+		uint32_t n_reflections;
+		uint32_t n_paths;
+		uint64_t count_vs;
+		float dist_source_listener;
+		float time_ref_ms;
+		uint32_t truncated;
+		uint32_t reserved;
+	} cacheheader_t;
+
+	typedef struct CacheReflection
+	{
+		float pos_R[3];
+		float dist_listener;
+		float time_rel_ms;
+		float gain;
+		uint32_t order;
+		uint32_t path;
+	} cachereflection_t;
+
+	// image along one axis of a shoebox room
+	typedef struct LatticeImage
+	{
+		float coord;  // position along the axis
+		float delta;  // distance to the listener along the axis
+		int count_lo;  // reflections on the lower wall
+		int count_hi;  // reflections on the upper wall
+		int order;
+		float gain;
+	} latticeimage_t;
+
+	typedef struct CompareLatticeDelta
+	{
+		bool operator()(const latticeimage_t &i, const latticeimage_t &j) const
+		{
+			return (i.delta < j.delta);
+		}
+	} comparelatticedelta_t;
+
+	// frame of the stack for the stream mode
+	typedef struct Frame
+	{
+		VirtualSource::ptr_t vs;
+		const std::vector<unsigned int> *candidates;  // surfaces reached from its zone
+		unsigned int next_surface;  // next candidate to reflect on
+	} frame_t;
+
+	void _calculate(bool discard_nodes, const vec3_t &pos_listener);
+	void _set_listener(const vec3_t &pos_listener);
+	void _index_dynamic();
+	void _publish();
+	void _sort_reflections();
+	void _flatten();
+	void _emit_flat();
+	void _validate_flat();
+	void _begin_list();
+	bool _flat_check(int i, const vec3_t &pos_listener);
+	bool _flat_check_2(int i_parent, const vec3_t &pos_vl, unsigned int &alias_checks);
 	void _propagate(VirtualSource::ptr_t vs, const tree_vs_t::iterator node_parent,
 			const unsigned int order, const bool discard_nodes);
+	void _propagate_surface(VirtualSource::ptr_t vs, const tree_vs_t::iterator node_parent,
+			const unsigned int i, const unsigned int order, const bool discard_nodes);
+	void _propagate_stream(VirtualSource::ptr_t vs_root);
+	VirtualSource::ptr_t _reflect(const VirtualSource::ptr_t &vs_parent,
+			const unsigned int i, const unsigned int order);
+	bool _test_audibility(const VirtualSource::ptr_t &vs);
+	int _zone(const VirtualSource::ptr_t &vs) const;
+	reflection_t _make_reflection(const VirtualSource::ptr_t &vs, unsigned long path);
+	void _export_reflections();
+	void _emit_reflection(const VirtualSource::ptr_t &vs);
+	void _propagate_best_first(VirtualSource::ptr_t vs_root);
+	void _propagate_lattice();
+	uint64_t _scene_key();
+	uint64_t _hash_bytes(uint64_t h, const void *data, size_t n);
 	bool _check_audibility_1(const VirtualSource::ptr_t &vs);
-	bool _check_audibility_2(const VirtualSource::ptr_t &vs, const tree_vs_t::iterator node);
+	bool _check_audibility_2(const VirtualSource::ptr_t &vs_parent, const vec3_t &pos_vl,
+			unsigned int &alias_checks);
+	bool _check_audibility(const VirtualSource::ptr_t &vs);
+	bool _is_occluded(const vec3_t &p0, const vec3_t &p1) const;
+	bool _merge_coincident(const tree_vs_t::iterator node);
+	void _recheck_merged();
+	uint64_t _surface_signature(const Surface::ptr_t &s);
+	float _relative_level_db(float gain, float dist_listener);
+	bool _is_masked(float level_db, float time_rel_ms);
 	void _calc_vs_orientation(const VirtualSource::ptr_t &vs);
 	void _sort_aud();
 
@@ -87,8 +305,42 @@ private:
 			return (i->dist_listener < j->dist_listener);
 		}
 	} comparevsdistance_t;
+
+	typedef struct CompareReflectionTime
+	{
+		bool operator()(const reflection_t &i, const reflection_t &j) const
+		{
+			return (i.time_rel_ms < j.time_rel_ms);
+		}
+	} comparereflectiontime_t;
+
+	// order of the candidates in best-first mode (the top is the greatest)
+	typedef struct CompareVSPriority
+	{
+		ism_priority_t priority;
+
+		CompareVSPriority(ism_priority_t p) : priority(p) { ; }
+
+		bool operator()(const VirtualSource::ptr_t &i, const VirtualSource::ptr_t &j) const
+		{
+			if (priority == ISM_PRIORITY_ENERGY)
+				return (i->gain / i->dist_listener < j->gain / j->dist_listener);  // louder first
+
+			return (i->dist_listener > j->dist_listener);  // earlier first
+		}
+	} comparevspriority_t;
 };
 
+inline bool Ism::is_truncated() const
+{
+	return _truncated;
+}
+
+inline const Ism::times_t &Ism::get_times() const
+{
+	return _times;
+}
+
 }  // namespace avrs
 
 #endif /* ISM_HPP_ */
@@ -29,6 +29,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include "utils/math.hpp"
+#include "utils/vec3.hpp"
 #include "common.hpp"
 
 namespace avrs
@@ -49,6 +50,7 @@ public:
     void translate(const point3_t &p);  // from reference position
 
     point3_t &get_position();
+    const vec3_t &get_position_v() const;
     matrix33_t &get_rotation();
 
     orientationangles_t &get_orientation();
@@ -60,6 +62,7 @@ private:
 
 	point3_t _pos0;  // Initial position (in room reference system)
 	point3_t _pos;   // Current position (in room reference system)
+	vec3_t _pos_v;  // same as _pos (for the ISM)
 
 	matrix33_t _R0;  // Initial Rotation matrix
 	matrix33_t _R;   // Current Rotation matrix
@@ -81,6 +84,7 @@ inline void Listener::rotate(const orientationangles_t &o)
 inline void Listener::translate(const point3_t &p)
 {
 	_pos = p + _pos0;
+	_pos_v = to_vec3(_pos);
 }
 
 inline avrs::orientationangles_t &Listener::get_orientation()
@@ -93,6 +97,11 @@ inline avrs::point3_t &Listener::get_position()
 	return _pos;
 }
 
+inline const vec3_t &Listener::get_position_v() const
+{
+	return _pos_v;
+}
+
 inline matrix33_t &Listener::get_rotation()
 {
 	return _R;
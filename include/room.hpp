@@ -19,31 +19,83 @@
 #ifndef ROOM_HPP_
 #define ROOM_HPP_
 
+#include <algorithm>
 #include <exception>
+#include <map>
+#include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <dxflib/dl_dxf.h>
 
 #include "surface.hpp"
+#include "bvh.hpp"
 #include "dxfreader.hpp"
 #include "configuration.hpp"
 
 namespace avrs
 {
 
+// Axis-aligned box of a shoebox room
+typedef struct RoomBox
+{
+	float lo[3];  // lower corner
+	float hi[3];  // upper corner
+	unsigned int lo_surface[3];  // index of the wall at the lower corner (per axis)
+	unsigned int hi_surface[3];  // index of the wall at the upper corner (per axis)
+} roombox_t;
+
+// Layers of the DXF file for multi-room geometries
+#define ZONE_LAYER_PREFIX "ZONE_"  // ZONE_<name>: surfaces of a zone
+#define PORTAL_LAYER_PREFIX "PORTAL_"  // PORTAL_<name1>_<name2>: opening between two zones
+
+// Zone of a multi-room geometry (e.g. each room of a house)
+typedef struct Zone
+{
+	std::string name;
+	float lo[3];  // bounding box of the surfaces of the zone
+	float hi[3];
+	std::vector<unsigned int> adjacent;  // zones connected through a portal
+	std::vector<unsigned int> candidates;  // surfaces that can be reached from the zone
+	std::vector<char> mask;  // the same, indexed by surface
+} zone_t;
+
 class Room
 {
 public:
 	typedef boost::shared_ptr<Room> ptr_t;
 
 	Room(configuration_t::ptr_t config);
+	Room(configuration_t::ptr_t config, const std::vector<Surface::ptr_t> &surfaces);
 	virtual ~Room();
 
 	float total_area() const;
 	float volume() const;
 	unsigned int n_surfaces() const;
-	void add_surface(Surface::ptr_t s);
+
+	// Dynamic geometry, the surfaces are identified by their ids (the number
+	// in the DXF file, or the one given to an added surface), which do not
+	// change when the portals are removed or the surfaces are merged
+	int find_surface(unsigned int id) const;
+	unsigned int new_surface_id();
+	void add_surface(Surface::ptr_t s, unsigned int id);
+	void move_surface(unsigned int id, const vec3_t &offset);
+	void remove_surface(unsigned int id);
+	bool has_dynamic_surfaces() const;
 	void load_dxf();
 	Surface::ptr_t get_surface(int i);
+	bool is_convex() const;
+	bool is_shoebox() const;
+	const roombox_t &get_box() const;
+
+	// Portal culling (a zone < 0 means unknown, all the surfaces are candidates)
+	bool has_zones() const;
+	unsigned int n_zones() const;
+	int find_zone(const vec3_t &point) const;
+	const std::vector<unsigned int> &get_candidates(int zone) const;
+	bool is_candidate(int zone, unsigned int i) const;
+
+	// Segment blocked by some surface (never in convex rooms)
+	bool is_occluded(const vec3_t &p0, const vec3_t &p1) const;
 
 private:
 	typedef std::vector<Surface::ptr_t>::iterator surfaces_it_t;
@@ -53,11 +105,92 @@ private:
 	bool _new_surface;  // flag that indicates new surface data
 	float _area;
 	float _volume;
+	bool _convex;
+	bool _shoebox;
+	bool _dynamic;  // some surface can be moved, added or removed
+	std::map<unsigned int, unsigned int> _ids;  // id of a surface -> index in _surfaces
+	unsigned int _next_id;  // id of the next added surface
+	roombox_t _box;  // only valid for shoebox rooms
+	std::vector<zone_t> _zones;
+	std::vector<unsigned int> _all_surfaces;  // candidates when there are no zones
+	Bvh::ptr_t _bvh;  // only for concave rooms
 
+	void _init_surfaces(const std::vector<std::string> &layers);
+	void _index_surfaces();
 	void _update_data();
+	void _update_zones();
+	void _init_zones(const std::vector<std::string> &layers);
+	int _zone_index(const std::string &name) const;
 	void _update_area();
+	void _update_shape();
+	void _assign_materials();
+	// Edge between two vertices in any direction (see _merge_coplanar())
+	typedef struct EdgeKey
+	{
+		long v[6];
+
+		bool operator<(const EdgeKey &e) const
+		{
+			return std::lexicographical_compare(v, v + 6, e.v, e.v + 6);
+		}
+	} edgekey_t;
+
+	void _merge_coplanar();
+	edgekey_t _edge_key(const Surface::ptr_t &s, unsigned int k, float cell);
+	Surface::ptr_t _merge_surfaces(const Surface::ptr_t &s1, const Surface::ptr_t &s2);
 };
 
+inline bool Room::is_convex() const
+{
+	return _convex;
+}
+
+inline bool Room::is_shoebox() const
+{
+	return _shoebox;
+}
+
+inline const roombox_t &Room::get_box() const
+{
+	return _box;
+}
+
+inline bool Room::has_dynamic_surfaces() const
+{
+	return _dynamic;
+}
+
+inline bool Room::has_zones() const
+{
+	return !_zones.empty();
+}
+
+inline unsigned int Room::n_zones() const
+{
+	return (unsigned int) _zones.size();
+}
+
+inline const std::vector<unsigned int> &Room::get_candidates(int zone) const
+{
+	if (zone < 0 || zone >= (int) _zones.size())
+		return _all_surfaces;
+
+	return _zones[zone].candidates;
+}
+
+inline bool Room::is_occluded(const vec3_t &p0, const vec3_t &p1) const
+{
+	return _bvh.get() != NULL && _bvh->is_occluded(p0, p1);
+}
+
+inline bool Room::is_candidate(int zone, unsigned int i) const
+{
+	if (zone < 0 || zone >= (int) _zones.size())
+		return true;
+
+	return _zones[zone].mask[i] != 0;
+}
+
 }  // namespace avrs
 
 #endif /* ROOM_HPP_ */
@@ -26,6 +26,20 @@
 namespace avrs
 {
 
+// Position of a moving source (sent to the source mailbox)
+typedef struct SourceData
+{
+	unsigned int source;  // index of the source
+	position_t pos;
+	unsigned long timestamp;
+
+	SourceData()
+	{
+		source = 0;
+		timestamp = 0;
+	}
+} sourcedata_t;
+
 class SoundSource
 {
 public:
@@ -34,7 +48,7 @@ public:
 	virtual ~SoundSource();
     static ptr_t create(std::string filename);
 
-	avrs::data_t get_IR(avrs::point3_t &p);
+	const avrs::data_t &get_IR(const avrs::point3_t &p) const;
 	avrs::point3_t pos;
 
 private:
@@ -45,7 +59,7 @@ private:
 	avrs::data_t _ir;
 };
 
-inline avrs::data_t SoundSource::get_IR(avrs::point3_t &p)
+inline const avrs::data_t &SoundSource::get_IR(const avrs::point3_t &p) const
 {
 	return _ir;
 }
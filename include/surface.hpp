@@ -22,9 +22,11 @@
 
 #include <memory>
 #include <map>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 
 #include "common.hpp"
+#include "utils/vec3.hpp"
 
 namespace avrs
 {
@@ -41,45 +43,73 @@ public:
 	virtual ~Surface();
 
 	unsigned int get_id() const;
+	void set_id(unsigned int id);
 	float get_area() const;
-	bool is_point_inside(avrs::point3_t point);
+	const arma::fmat &get_vertices() const;
+	bool is_point_inside(const avrs::vec3_t &point) const;
 	float get_dist_origin() const;
 	avrs::point3_t &get_normal();
 	arma::frowvec4 &get_plane_coeff();
+	const avrs::vec3_t &get_normal_v() const;
+	const avrs::plane_t &get_plane() const;
+
+	// Dynamic geometry (doors, movable panels)
+	void translate(const avrs::vec3_t &offset);
+	void set_dynamic(bool dynamic);
+	bool is_dynamic() const;
+	void set_active(bool active);
+	bool is_active() const;
+
+	// Multi-room geometries (zone index, -1 if the surface is not in a zone)
+	void set_zone(int zone);
+	int get_zone() const;
 
 	// Wall absorption
 	void set_b_filter_coeff(std::vector<double> &b_coeff);
 	std::vector<double> &get_b_filter_coeff();
 	void set_a_filter_coeff(std::vector<double> &a_coeff);
 	std::vector<double> &get_a_filter_coeff();
+	float get_reflection_gain() const;
 
 private:
 	void _init();
 
 	unsigned int _id;
-	arma::fmat _vert;  // 4x3 matrix (four xyz points for now)
+	arma::fmat _vert;  // nx3 matrix (n xyz points)
 	avrs::point3_t _center;  ///< Geometric center of the plane
 	avrs::point3_t _normal;  // normal to plane
 	float _dist_origin;  // distance to origin
 	float _area;
 	arma::frowvec4 _plane_coeff;  // (a, b, c, d) coefficients of plane equation [ax + by + cz + d = 0]
+	avrs::vec3_t _normal_v;  // same as _normal (for the ISM)
+	avrs::plane_t _plane;  // plane equation, normalized (for the ISM)
+	bool _dynamic;  // can be moved, added or removed while the simulation runs
+	bool _active;  // a removed surface is kept inactive (the indexes do not change)
+	int _zone;  // zone of the room that contains the surface (-1: none)
 
 	// material filter coefficients
 	std::vector<double> _b_filter_coeff;
 	std::vector<double> _a_filter_coeff;
+	float _reflection_gain;  // peak magnitude of the material filter (linear)
 
 	void _calc_center();
 	void _calc_plane_coeff();
 	void _calc_normal();
 	void _calc_dist_origin();
 	void _calc_area();
+	void _calc_reflection_gain();
 
 #ifndef BORISH
-	arma::fmat _vert_proj;  // 4x2 matrix with the projection to 2D points of _vert matrix
-	unsigned int _coord_to_remove;
-
-	arma::frowvec2 _project_to_2d(arma::frowvec3 p);
-	int _pnpoly(int nvert, float *vertx, float *verty, float testx, float testy);
+	// point-in-polygon test in 2D (the plane is projected along its
+	// dominant axis), edge functions A u + B v + C >= 0 inside
+	unsigned int _axis_u;
+	unsigned int _axis_v;
+	float _bbox[4];  // u min, u max, v min, v max
+	std::vector<float> _edges;  // (A, B, C) for each edge
+	unsigned int _group_size;  // edges per convex piece (all of them, or 3 for triangles)
+
+	void _calc_edges();
+	void _add_edge(float u0, float v0, float u1, float v1, float orientation);
 #endif
 };
 
@@ -88,11 +118,22 @@ inline unsigned int Surface::get_id() const
 	return _id;
 }
 
+inline void Surface::set_id(unsigned int id)
+{
+	_id = id;
+}
+
 inline float Surface::get_area() const
 {
 	return _area;
 }
 
+// One xyz point per row
+inline const arma::fmat &Surface::get_vertices() const
+{
+	return _vert;
+}
+
 inline float Surface::get_dist_origin() const
 {
 	return _dist_origin;
@@ -108,9 +149,50 @@ inline arma::frowvec4 &Surface::get_plane_coeff()
 	return _plane_coeff;
 }
 
+inline const avrs::vec3_t &Surface::get_normal_v() const
+{
+	return _normal_v;
+}
+
+inline const avrs::plane_t &Surface::get_plane() const
+{
+	return _plane;
+}
+
+inline void Surface::set_dynamic(bool dynamic)
+{
+	_dynamic = dynamic;
+}
+
+inline bool Surface::is_dynamic() const
+{
+	return _dynamic;
+}
+
+inline void Surface::set_active(bool active)
+{
+	_active = active;
+}
+
+inline bool Surface::is_active() const
+{
+	return _active;
+}
+
+inline void Surface::set_zone(int zone)
+{
+	_zone = zone;
+}
+
+inline int Surface::get_zone() const
+{
+	return _zone;
+}
+
 inline void Surface::set_b_filter_coeff(std::vector<double> &b_coeff)
 {
 	_b_filter_coeff = b_coeff;
+	_calc_reflection_gain();
 }
 
 inline std::vector<double> &Surface::get_b_filter_coeff()
@@ -121,6 +203,7 @@ inline std::vector<double> &Surface::get_b_filter_coeff()
 inline void Surface::set_a_filter_coeff(std::vector<double> &a_coeff)
 {
 	_a_filter_coeff = a_coeff;
+	_calc_reflection_gain();
 }
 
 inline std::vector<double> &Surface::get_a_filter_coeff()
@@ -128,6 +211,11 @@ inline std::vector<double> &Surface::get_a_filter_coeff()
 	return _a_filter_coeff;
 }
 
+inline float Surface::get_reflection_gain() const
+{
+	return _reflection_gain;
+}
+
 }  // namespace avrs
 
 #endif  // SURFACE_HPP_
@@ -78,19 +78,40 @@ private:
 
 	VirtualEnvironment::ptr_t _ve;
 
-	InputWaveLoop::ptr_t _in;
+	std::vector<InputWaveLoop::ptr_t> _in;  // one input for each source
 	Player::ptr_t _out;
 
-	data_t _input;
-	binauraldata_t _bir;
+	std::vector<data_t> _input;
 
-	Convolver::ptr_t _conv_l;
-	Convolver::ptr_t _conv_r;
+	// one pair of convolvers for each source, their outputs are added
+	std::vector<Convolver::ptr_t> _conv_l;
+	std::vector<Convolver::ptr_t> _conv_r;
 
 	TrackerBase::ptr_t _tracker;
 
+	// Handoff of the filters of all the convolvers, so the RT thread takes
+	// the ones of the same BIRs: the render thread only writes them from
+	// NONE or READY, and the RT thread only takes them from READY
+	enum
+	{
+		FILTERS_NONE,  // no new filters
+		FILTERS_WRITING,  // the render thread publishes them
+		FILTERS_READY,  // all of them published
+		FILTERS_TAKING  // the RT thread takes them
+	};
+
+	volatile int _new_filters;
+
     // thread related stuff
     pthread_t _thread_id;
+    pthread_t _render_thread_id;
+    static void *_render_wrapper(void *arg);
+	/**
+	 * Soft real-time rendering of the BIRs, with lower priority than the RT
+	 * thread (it can take more than one period)
+	 * @param arg
+	 */
+    void *_render_thread(void *arg);
     static void *_rt_wrapper(void *arg);
 	/**
 	 * Hard real-time function in user space (RTAI-LXRT)
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/**
+ * @file alloccounter.hpp
+ * @brief
+ * Counter of heap allocations of each thread, to verify that the real-time
+ * paths do not allocate. The allocation functions of the C library (malloc,
+ * calloc, realloc, memalign and posix_memalign, so also operator new and
+ * fftwf_malloc) are only replaced if ALLOCATION_COUNTER is defined (see the
+ * CMake option), otherwise the counter is always zero. It needs glibc. The
+ * memory that is not taken from the heap (mmap, rt_malloc of RTAI) is not
+ * counted, and only the threads that call count() are checked (the
+ * renderer, not the HRT task).
+ **/
+
+#ifndef ALLOCCOUNTER_HPP_
+#define ALLOCCOUNTER_HPP_
+
+namespace avrs
+{
+
+namespace alloccounter
+{
+	/// Allocations made by the calling thread since it was started
+	unsigned long count();
+}
+
+}  // namespace avrs
+
+#endif  // ALLOCCOUNTER_HPP_
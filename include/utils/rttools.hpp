@@ -61,6 +61,9 @@ namespace rttools
 #define MBX_TRACKER_NAME	"MBXTRA"
 #define MBX_TRACKER_BLOCK	2  // 2 blocks of tracker data
 
+#define MBX_SOURCE_NAME		"MBXSRC"
+#define MBX_SOURCE_BLOCK	2  // 2 blocks of source data
+
 // for output FIFO
 #define RTF_OUT_NUM     	0
 #define RTF_OUT_DEV			"/dev/rtf0"
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef TIMERWALL_HPP_
+#define TIMERWALL_HPP_
+
+#include <ctime>
+
+#include "timerbase.hpp"
+
+namespace avrs
+{
+
+/**
+ * Wall-clock timer (monotonic). Unlike TimerCpu, the time does not add up
+ * the CPU time of all the threads of the process.
+ */
+class TimerWall : public TimerBase
+{
+public:
+	virtual void start();
+	virtual void stop();
+	virtual double elapsed_time(timer_unit_t u);
+
+private:
+	struct timespec _t0;
+	struct timespec _t1;
+};
+
+}  // namespace avrs
+
+#endif /* TIMERWALL_HPP_ */
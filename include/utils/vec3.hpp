@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/**
+ * @file vec3.hpp
+ * @brief
+ * Fixed-size 3D vectors and planes for the geometric hot loops (ISM and
+ * surfaces). They are POD, so they can be copied with memcpy and written to
+ * files, and they do not create expression temporaries like Armadillo.
+ * Conversions to Armadillo are only done at the edges.
+ **/
+
+#ifndef VEC3_HPP_
+#define VEC3_HPP_
+
+#include <cmath>
+
+#include "common.hpp"
+
+namespace avrs
+{
+
+/// 3D vector, padded to 16 bytes (one SIMD register)
+typedef struct Vec3
+{
+	float x;
+	float y;
+	float z;
+	float w;  // padding (always zero)
+
+	float &operator()(unsigned int i) { return (&x)[i]; }
+	const float &operator()(unsigned int i) const { return (&x)[i]; }
+} __attribute__((aligned(16))) vec3_t;
+
+/// Plane n . p + d = 0 (n is unitary, so the result is a signed distance)
+typedef struct Plane
+{
+	vec3_t n;
+	float d;
+} plane_t;
+
+inline vec3_t vec3(float x, float y, float z)
+{
+	vec3_t v = { x, y, z, 0.0f };
+	return v;
+}
+
+inline vec3_t operator+(const vec3_t &a, const vec3_t &b)
+{
+	return vec3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+inline vec3_t operator-(const vec3_t &a, const vec3_t &b)
+{
+	return vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+inline vec3_t operator*(const vec3_t &a, float k)
+{
+	return vec3(a.x * k, a.y * k, a.z * k);
+}
+
+inline vec3_t operator*(float k, const vec3_t &a)
+{
+	return vec3(a.x * k, a.y * k, a.z * k);
+}
+
+inline float dot(const vec3_t &a, const vec3_t &b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3_t cross(const vec3_t &a, const vec3_t &b)
+{
+	return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline float norm2(const vec3_t &a)
+{
+	return dot(a, a);
+}
+
+inline float norm(const vec3_t &a)
+{
+	return sqrtf(dot(a, a));
+}
+
+inline float dist(const vec3_t &a, const vec3_t &b)
+{
+	return norm(a - b);
+}
+
+inline float eval(const plane_t &p, const vec3_t &v)
+{
+	return dot(p.n, v) + p.d;
+}
+
+// Conversions from/to Armadillo
+
+inline vec3_t to_vec3(const point3_t &p)
+{
+	return vec3(p(X), p(Y), p(Z));
+}
+
+inline point3_t to_point3(const vec3_t &v)
+{
+	point3_t p;
+	p(X) = v.x;
+	p(Y) = v.y;
+	p(Z) = v.z;
+	return p;
+}
+
+}  // namespace avrs
+
+#endif /* VEC3_HPP_ */
@@ -26,6 +26,8 @@
 #include <sys/time.h>
 #include <cstdio>
 #include <stddef.h>
+#include <pthread.h>
+#include <fftw3.h>
 #include <stk/Iir.h>
 #include <stk/Fir.h>
 #include <stk/Delay.h>
@@ -52,6 +54,7 @@ extern "C" {
 #include "configuration.hpp"
 #include "airabsorption.hpp"
 #include "virtualsource.hpp"
+#include "iirbank.hpp"
 
 namespace avrs
 {
@@ -71,6 +74,7 @@ public:
 	// Info
 	float get_room_area() const;
 	unsigned int n_surfaces() const;
+	unsigned int n_sources() const;
 	unsigned int n_vs() const;
 	unsigned int n_visible_vs();
 
@@ -82,6 +86,16 @@ public:
 	/// Update current position/orientation value used for real-time process by mean of the tracker
 	bool update_listener_orientation();
 
+	/// Update the positions of moving sources from the source mailbox
+	bool update_source_position();
+
+	// Dynamic geometry, the VSs are updated in a background thread. The
+	// surfaces are identified by their ids (the number in the DXF file, as in
+	// ROOM_DYNAMIC_SURFACES, or the one returned by add_surface())
+	unsigned int add_surface(Surface::ptr_t s);
+	void move_surface(unsigned int id, const vec3_t &offset);
+	void remove_surface(unsigned int id);
+
 	// BIR methods
 
 	/// Render the binaural impulse response (BIR) in real-time process by using current tracker data
@@ -90,10 +104,19 @@ public:
 	unsigned long sample_mix_time();
 
 	/**
-	 * Get the current BIR
+	 * Get the current BIR of a source
+	 * @param source index of the source
 	 * @return the current BIR
 	 */
-	binauraldata_t &get_BIR();
+	binauraldata_t &get_BIR(unsigned int source);
+
+	/**
+	 * Get the current BIR of a source in the frequency domain, partitioned
+	 * for the convolvers (see Convolver::set_filter_f())
+	 * @param source index of the source
+	 * @return the partitions of both ears
+	 */
+	binauraldata_t &get_BIR_partitions(unsigned int source);
 
 	bool is_new_BIR() const;
 
@@ -104,8 +127,7 @@ private:
 
 	// Buffers
 	data_t _early_buffer;  // early reflections
-	data_t _late_buffer;  // diffusion + late reverberation
-	binauraldata_t _render_buffer;  // complete BIR
+	data_t _late_buffer;  // diffusion + late reverberation (the same for all the sources)
 
 	unsigned long _length_bir;
 	data_t _zeros;
@@ -117,43 +139,178 @@ private:
 	trackerdata_t _tracker_data;
 	trackerdata_t _prev_tracker_data;
 
+	// Moving sources
+	MBX *_mbx_source;
+
 	// Room
 	Room::ptr_t _room;
-	// Sound source
-	SoundSource::ptr_t _sound_source;
+	// Sound sources, each one with its early reflections and BIR
+	typedef struct SourceState
+	{
+		SoundSource::ptr_t source;
+		Ism::ptr_t ism;
+		binauraldata_t render_buffer;  // complete BIR
+		binauraldata_t partitions;  // spectra of the partitions of the BIR
+		unsigned long delay_samples;  // from the source to the listener in the last render
+		sourcedata_t data;  // last position received
+		bool moved;  // a new position must be sent to the update thread
+		bool pending;  // a new position was sent to the update thread
+		vec3_t pos;  // position sent to the update thread
+		data_t pre_hrtf;  // signal of each reflection before the HRTF (VS_SAMPLES each)
+		unsigned long pre_hrtf_generation;  // published list of pre_hrtf (0 = none)
+		std::vector<uint> hrtf;  // cell of the HRTFs and weights of each reflection in the last render (see HrtfCoeffSet::find_direction())
+		data_t contrib_l;  // HRTF output of each reflection (VS_SAMPLES each)
+		data_t contrib_r;
+		binauraldata_t early;  // sum of the contributions
+		unsigned long hrtf_generation;  // published list of the contributions (0 = none)
+		unsigned long max_reflections;  // largest list rendered (the buffers have room for it)
+		unsigned int incremental_updates;  // renders since the early part was summed
+	} sourcestate_t;
+
+	// Order of the reflections of a list by their paths (the prefixes are together)
+	typedef struct ComparePath
+	{
+		const Ism::reflectionlist_t *list;
+
+		bool operator()(unsigned long i, unsigned long j) const
+		{
+			const reflection_t &ri = list->reflections[i];
+			const reflection_t &rj = list->reflections[j];
+			std::vector<unsigned int>::const_iterator pi = list->paths.begin() + ri.path;
+			std::vector<unsigned int>::const_iterator pj = list->paths.begin() + rj.path;
+
+			return std::lexicographical_compare(pi, pi + ri.order, pj, pj + rj.order);
+		}
+	} comparepath_t;
+
+	std::vector<sourcestate_t> _sources;
 	// Listener
 	Listener::ptr_t _listener;
-	// Early reflections
-	Ism::ptr_t _ism;
 	// Late reverberation
 	Fdn::ptr_t _fdn;
 	// Air absorption
 	AirAbsorption::ptr_t _air_absorption;
 	// Surface material filters
-	stk::Iir _filter_surfaces;
+	IirBank _surface_bank;
+	std::vector<unsigned long> _pre_hrtf_order;  // reflections sorted by their paths
+
+	// Node of the prefix tree of the paths of a list (see _update_pre_hrtf())
+	typedef struct PathNode
+	{
+		unsigned long parent;
+		unsigned int surface;  // last surface of the path
+		unsigned short depth;  // order of the path
+	} pathnode_t;
+
+	std::vector<pathnode_t> _path_nodes;
+	std::vector<unsigned long> _path_stack;  // nodes of the path of the previous reflection
+	std::vector<unsigned long> _reflection_nodes;  // node of the path of each reflection
+	std::vector<sample_t> _node_signals;  // source signal filtered by the path of each node (VS_SAMPLES)
 	// Renderer
 	HrtfCoeffSet::ptr_t _hcdb;
-	hrtfcoeff_t _hc;
-	stk::Iir _filter_l;
-	stk::Iir _filter_r;
-	stk::Delay _delay;
+	unsigned long _n_partitions;  // of the BIR (BUFFER_SAMPLES each, as the convolvers)
+	data_t _fft_buffer;  // one partition
+	fftwf_plan _fft_plan;
+
+	// HRTF of a reflection in a pair of lanes of the bank of a worker (left
+	// and right ear). The pairs of a reflection can be in two batches, their
+	// outputs are mixed in a slot of the worker.
+	typedef struct HrtfPair
+	{
+		unsigned int slot;  // mix of the reflection
+		float weight;
+		bool last;  // the mix of the reflection is complete
+		unsigned long reflection;
+	} hrtfpair_t;
+
+	// Workers of the renderer, each one filters a contiguous chunk of the
+	// reflections with its own filters and adds them to its own buffer. The
+	// first one is the thread that calls renderize(), the others are pinned
+	// to the following cores.
+	typedef struct RenderWorker
+	{
+		VirtualEnvironment *ve;
+		unsigned int index;
+		pthread_t thread_id;
+		hrtfcoeff_t hc;
+		IirBank bank;  // HRTFs of the reflections of the last batch (both ears)
+		hrtfpair_t pairs[IirBank::LANES / 2];
+		binauraldata_t mix;  // interpolated HRTF outputs (LANES / 2 slots of VS_SAMPLES)
+		float itd[IirBank::LANES / 2];  // interpolated ITD of each slot
+		binauraldata_t accum;  // reflections of the last job
+		unsigned long lo;  // samples of accum written in the last job
+		unsigned long hi;
+		unsigned long allocations;  // heap allocations of its thread in the jobs (see alloccounter)
+	} renderworker_t;
+
+	std::vector< boost::shared_ptr<renderworker_t> > _workers;
+	pthread_mutex_t _render_mutex;
+	pthread_cond_t _render_start_cond;
+	pthread_cond_t _render_done_cond;
+	bool _render_running;
+	unsigned long _render_job;  // number of the current job
+	unsigned int _render_pending;  // workers that did not finish the current job
+	sourcestate_t *_render_state;  // source of the current job
+	const Ism::reflectionlist_t *_render_list;  // its reflections
+	std::vector<unsigned long> _render_dirty;  // reflections whose HRTF changed
+	bool _render_grew;  // some list was larger than the previous ones (the buffers grew)
+	bool _rendered;  // the first render was done (warm-up)
+
+	// Update of the VSs when the listener or a dynamic surface moves (in a
+	// background thread)
+	typedef enum
+	{
+		SURFACE_ADD,
+		SURFACE_MOVE,
+		SURFACE_REMOVE
+	} surfacechangetype_t;
+
+	typedef struct SurfaceChange
+	{
+		surfacechangetype_t type;
+		unsigned int id;  // id of the surface in the room
+		vec3_t offset;
+		Surface::ptr_t surface;
+	} surfacechange_t;
+
+	pthread_t _update_thread_id;
+	pthread_mutex_t _update_mutex;
+	pthread_cond_t _update_cond;
+	bool _update_running;
+	bool _revalidate_pending;
+	vec3_t _revalidate_pos;  // requested listener position
+	vec3_t _revalidate_last_pos;  // listener position of the last request
+	bool _source_pending;  // some source was moved
+	std::vector<surfacechange_t> _surface_changes;  // pending changes of the room
+	volatile int _ism_updated;  // a new list of VSs was published
 
 	// Private methods
 	void _calc_late_reverberation();
-	binauraldata_t _hrtf_iir_filter(data_t &input, const point3_t &vs_pos_R);
-	data_t _surfaces_filter(data_t &input, const Ism::tree_vs_t::iterator node);
+	void _hrtf_filter_batch(renderworker_t &w, unsigned long &i, unsigned int &t, unsigned long begin,
+			unsigned long end);
+	void _surface_filter_batch(const Ism::reflectionlist_t &list, const unsigned long *nodes, unsigned int n);
+	void _source_signal(const SoundSource::ptr_t &source, const point3_t &vs_pos_L, sample_t *output);
+	void _update_pre_hrtf(sourcestate_t &state, const Ism::reflectionlist_t &list);
+	void _add_reflection(renderworker_t &w, unsigned long r, unsigned long k);
+	bool _render_source(sourcestate_t &state);
+	bool _render_reflections(sourcestate_t &state, const Ism::reflectionlist_t &list,
+			unsigned long &lo, unsigned long &hi);
+	void _update_partitions(sourcestate_t &state, unsigned long lo, unsigned long hi);
+	void _sum_contributions(sourcestate_t &state, const Ism::reflectionlist_t &list);
+	void _render_chunk(renderworker_t &w);
+	void _reserve_buffers(sourcestate_t &state, unsigned long n);
+	void _start_workers();
+	void _stop_workers();
 	bool _listener_is_moved();
+	void _request_revalidation(const vec3_t &pos);
+	void _request_surface_change(surfacechange_t &change);
+	bool _request_source_move(sourcestate_t &state);
 
-    // Thread for VS chain filter
-    static void *_vs_filter_wrapper(void *arg);
-    void *_vs_filter_thread(Ism::tree_vs_t::iterator it, uint index);
-	std::vector<binauraldata_t> _outputs;  // keep the VS chain filter IR
+	static void *_update_wrapper(void *arg);
+	void *_update_thread();
 
-	typedef struct {
-		VirtualEnvironment *ve;
-		Ism::tree_vs_t::iterator it;
-		uint index;
-	} threaddata_t;
+	static void *_render_wrapper(void *arg);
+	void *_render_thread(renderworker_t &w);
 };
 
 
@@ -175,9 +332,14 @@ inline void VirtualEnvironment::calibrate_tracker()
 		_tracker->calibrate();
 }
 
-inline binauraldata_t &VirtualEnvironment::get_BIR()
+inline binauraldata_t &VirtualEnvironment::get_BIR(unsigned int source)
+{
+	return _sources[source].render_buffer;
+}
+
+inline binauraldata_t &VirtualEnvironment::get_BIR_partitions(unsigned int source)
 {
-	return _render_buffer;
+	return _sources[source].partitions;
 }
 
 inline bool VirtualEnvironment::is_new_BIR() const
@@ -195,14 +357,29 @@ inline unsigned int VirtualEnvironment::n_surfaces() const
 	return _room->n_surfaces();
 }
 
+inline unsigned int VirtualEnvironment::n_sources() const
+{
+	return _sources.size();
+}
+
 inline unsigned int VirtualEnvironment::n_vs() const
 {
-	return _ism->get_count_vs();
+	unsigned int count = 0;
+
+	for (unsigned int k = 0; k < _sources.size(); k++)
+		count += _sources[k].ism->get_count_vs();
+
+	return count;
 }
 
 inline unsigned int VirtualEnvironment::n_visible_vs()
 {
-	return _ism->get_count_visible_vs();
+	unsigned int count = 0;
+
+	for (unsigned int k = 0; k < _sources.size(); k++)
+		count += _sources[k].ism->get_count_visible_vs();
+
+	return count;
 }
 
 inline unsigned long VirtualEnvironment::sample_mix_time()
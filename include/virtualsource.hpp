@@ -19,8 +19,11 @@
 #ifndef VIRTUALSOURCE_HPP_
 #define VIRTUALSOURCE_HPP_
 
+#include <stdint.h>
+
 #include "surface.hpp"
 #include "common.hpp"
+#include "utils/vec3.hpp"
 
 namespace avrs
 {
@@ -31,24 +34,41 @@ typedef struct VirtualSource
 
 	unsigned long id;
 
-	point3_t pos_R;  // in Room coordinates system
-	point3_t pos_L;  // in Listener coordinates system
+	vec3_t pos_R;  // in Room coordinates system
+	vec3_t pos_L;  // in Listener coordinates system
 	matrix33_t rotation;
 
 	short order;
 	float dist_listener;
 	float time_abs_ms;
 	float time_rel_ms;
+	float gain;  // cumulative reflection gain along the path (linear)
 	Surface::ptr_t surface_ptr;
-	point3_t intersection_point;
+	unsigned int surface_index;  // index of the surface in the room
+	vec3_t intersection_point;
 	bool audible;
 	ptr_t parent_ptr;
+	ptr_t next_alias;  // next coincident VS merged into this one
+	bool merged;  // is an alias of a coincident VS (its subtree is not propagated)
+	uint64_t signature;  // order-independent signature of the surfaces in the path
+	bool dynamic;  // the path touches a dynamic surface (it is never merged)
 
 	orientationangles_t orientation_L; // referenced to Listener
 	orientationangles_t orientation_0; // initial orientation
 
 } virtualsource_t;
 
+// Audible VS without its tree, the surfaces of the path are kept apart
+typedef struct Reflection
+{
+	vec3_t pos_R;  // in Room coordinates system
+	float dist_listener;
+	float time_rel_ms;
+	float gain;
+	unsigned short order;  // length of the path
+	unsigned long path;  // position of the first surface in the paths pool
+} reflection_t;
+
 }  // namespace avrs
 
 #endif /* VIRTUALSOURCE_HPP_ */
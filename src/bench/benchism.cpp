@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/**
+ * @file benchism.cpp
+ * @brief
+ * Scalability benchmark of the ISM over synthetic rooms (shoebox, L-shape
+ * and shoebox with tiled walls), sweeping the maximum order and distance.
+ * The results are written as JSON. It does not need RTAI nor audio files.
+ **/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
+
+#include "common.hpp"
+#include "configuration.hpp"
+#include "room.hpp"
+#include "ism.hpp"
+#include "avrsexception.hpp"
+#include "utils/timercpu.hpp"
+
+using namespace avrs;
+
+typedef struct
+{
+	std::vector<std::string> rooms;
+	std::vector<unsigned int> orders;
+	std::vector<float> distances;
+	unsigned int tiles;
+	std::string mode;
+	bool lattice;
+	bool occlusion;
+	std::string output;
+} parameters_t;
+
+// Synthetic room, the surfaces and the positions of the source and the listener
+typedef struct
+{
+	std::string name;
+	std::vector<Surface::ptr_t> surfaces;
+	float volume;
+	point3_t pos_source;
+	point3_t pos_listener;
+} syntheticroom_t;
+
+// Prototypes
+void parse_program_options(int argc, char** argv, parameters_t *params);
+configuration_t::ptr_t make_configuration(const parameters_t &params);
+syntheticroom_t make_shoebox(unsigned int tiles);
+syntheticroom_t make_lshape(unsigned int tiles);
+void add_rectangle(std::vector<Surface::ptr_t> &surfaces, const vec3_t &corner,
+		const vec3_t &u, const vec3_t &v, unsigned int tiles);
+void add_walls(std::vector<Surface::ptr_t> &surfaces, const float *x, const float *y,
+		unsigned int n, float height, unsigned int tiles);
+double wall_time_ms();
+long peak_rss_kb();
+
+/**
+ * Main function of the ISM benchmark
+ *
+ * @param argc number of input arguments
+ * @param argv array of actual input arguments
+ * @return 0 on success, else 1
+ */
+int main(int argc, char *argv[])
+{
+	parameters_t params;
+	parse_program_options(argc, argv, &params);
+
+	FILE *out = stdout;
+
+	if (!params.output.empty() && (out = fopen(params.output.c_str(), "w")) == NULL)
+	{
+		ERROR("Cannot write %s", params.output.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	try
+	{
+		configuration_t::ptr_t config = make_configuration(params);
+		bool first = true;
+
+		fprintf(out, "[\n");
+
+		for (unsigned int r = 0; r < params.rooms.size(); r++)
+		{
+			syntheticroom_t room;
+
+			if (params.rooms[r] == "shoebox")
+				room = make_shoebox(1);
+			else if (params.rooms[r] == "lshape")
+				room = make_lshape(1);
+			else if (params.rooms[r] == "tiled")
+				room = make_shoebox(params.tiles);
+			else
+				throw AvrsException("Unknown room " + params.rooms[r] + " (shoebox, lshape or tiled)");
+
+			// one material for all the surfaces (they are not merged)
+			std::vector<double> b_coeff(1, 0.9);
+			std::vector<double> a_coeff(1, 1.0);
+			config->volume = room.volume;
+			config->n_surfaces = room.surfaces.size();
+			config->b_coeff.assign(room.surfaces.size(), b_coeff);
+			config->a_coeff.assign(room.surfaces.size(), a_coeff);
+			config->listener->set_initial_POV(orientationangles_t(), room.pos_listener);
+
+			double t0 = wall_time_ms();
+			Room::ptr_t r_ptr(new Room(config, room.surfaces));
+			double room_ms = wall_time_ms() - t0;
+
+			SoundSource::ptr_t source = SoundSource::create("");
+			source->pos = room.pos_source;
+
+			for (unsigned int i = 0; i < params.orders.size(); i++)
+			{
+				for (unsigned int j = 0; j < params.distances.size(); j++)
+				{
+					config->max_order = params.orders[i];
+					config->max_distance = params.distances[j];
+
+					Ism::ptr_t ism(new Ism(config, r_ptr, source));
+
+					t0 = wall_time_ms();
+					ism->calculate(false);
+					double calculate_ms = wall_time_ms() - t0;
+
+					// small movement of the listener (update of the audible VSs)
+					vec3_t pos_moved = config->listener->get_position_v() + vec3(0.1f, 0.05f, 0.0f);
+					t0 = wall_time_ms();
+					ism->revalidate(pos_moved);
+					double revalidate_ms = wall_time_ms() - t0;
+
+					const Ism::times_t &times = ism->get_times();
+					unsigned long count_vs = ism->get_count_vs();
+					unsigned long count_audible = ism->get_count_visible_vs();
+
+					fprintf(out, "%s  {\"room\": \"%s\", \"surfaces\": %u, \"convex\": %s, \"shoebox\": %s, "
+							"\"mode\": \"%s\", \"max_order\": %u, \"max_distance\": %.2f,\n",
+							first ? "" : ",\n", room.name.c_str(), r_ptr->n_surfaces(),
+							r_ptr->is_convex() ? "true" : "false", r_ptr->is_shoebox() ? "true" : "false",
+							params.mode.c_str(), config->max_order, config->max_distance);
+					fprintf(out, "   \"vs\": %lu, \"audible\": %lu, \"audible_ratio\": %.6f, \"vs_per_s\": %.1f,\n",
+							count_vs, count_audible,
+							count_vs > 0 ? (double) count_audible / count_vs : 0.0,
+							calculate_ms > 0.0 ? count_vs / (calculate_ms / 1000.0) : 0.0);
+					fprintf(out, "   \"bytes_vs\": %lu, \"bytes_reflections\": %lu, \"peak_rss_kb\": %ld,\n",
+							ism->get_bytes_vs(), ism->get_bytes_reflections(), peak_rss_kb());
+					fprintf(out, "   \"wall_ms\": {\"room\": %.3f, \"calculate\": %.3f, \"revalidate\": %.3f},\n",
+							room_ms, calculate_ms, revalidate_ms);
+					fprintf(out, "   \"cpu_ms\": {\"propagate\": %.3f, \"flatten\": %.3f, \"publish\": %.3f}}",
+							times.propagate_ms, times.flatten_ms, times.publish_ms);
+					fflush(out);
+					first = false;
+				}
+			}
+		}
+
+		fprintf(out, "\n]\n");
+	}
+	catch (const AvrsException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return EXIT_SUCCESS;
+}
+
+void parse_program_options(int argc, char** argv, parameters_t *params)
+{
+	namespace po = boost::program_options;
+
+	po::options_description desc("Options");
+	desc.add_options()
+			("help,h", "Print help messages.")
+			("room,r", po::value< std::vector<std::string> >(&params->rooms)->multitoken(),
+					"Rooms: shoebox, lshape, tiled (default: all).")
+			("order,n", po::value< std::vector<unsigned int> >(&params->orders)->multitoken(),
+					"Maximum orders (default: 1 2 3).")
+			("distance,d", po::value< std::vector<float> >(&params->distances)->multitoken(),
+					"Maximum distances in meters (default: 50 100).")
+			("tiles,t", po::value<unsigned int>(&params->tiles)->default_value(4),
+					"Tiles along each side of the walls of the tiled room.")
+			("mode,m", po::value<std::string>(&params->mode)->default_value("TREE"),
+					"ISM mode: TREE, STREAM or BEST_FIRST.")
+			("lattice", "Lattice of VSs for the shoebox room.")
+			("no-occlusion", "Do not test the occlusion of the paths.")
+			("output,o", po::value<std::string>(&params->output), "JSON file (default: standard output).");
+	po::variables_map vm;
+
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+
+		if (vm.count("help"))  // --help or -h option
+		{
+			std::cout << "Usage:\n\tavrs_bench_ism [options]\n";
+			std::cout << std::endl << desc << std::endl;
+			exit(EXIT_SUCCESS);
+		}
+
+		po::notify(vm);
+	}
+	catch(po::error& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+		std::cerr << desc << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (params->rooms.empty())
+	{
+		params->rooms.push_back("shoebox");
+		params->rooms.push_back("lshape");
+		params->rooms.push_back("tiled");
+	}
+
+	if (params->orders.empty())
+	{
+		params->orders.push_back(1);
+		params->orders.push_back(2);
+		params->orders.push_back(3);
+	}
+
+	if (params->distances.empty())
+	{
+		params->distances.push_back(50.0f);
+		params->distances.push_back(100.0f);
+	}
+
+	if (params->tiles < 1)
+		params->tiles = 1;
+
+	params->lattice = (vm.count("lattice") > 0);
+	params->occlusion = (vm.count("no-occlusion") == 0);
+}
+
+// Same defaults as a configuration file without the optional keys
+configuration_t::ptr_t make_configuration(const parameters_t &params)
+{
+	configuration_t::ptr_t config(new configuration_t);
+
+	config->name = "avrs_bench_ism";
+	config->temperature = 20.0f;
+	config->speed_of_sound = 343.0f;
+	config->angle_threshold = 0.0f;
+	config->position_threshold = 0.0f;
+	config->bir_length_sec = 1.0f;
+	config->bir_length_samples = SAMPLE_RATE;
+	config->rt60_0 = 1.0;
+	config->rt60_pi = 0.5;
+	config->merge_surfaces = false;  // the tiles are kept
+	config->zones = false;
+	config->portal_depth = 1;
+	config->transition_time = 0.0f;
+	config->ism_pruning = false;
+	config->min_level_db = 0.0f;
+	config->ism_masking = false;
+	config->masking_threshold_db = 0.0f;
+	config->masking_time_ms = 0.0f;
+	config->ism_dedup = false;
+	config->dedup_tolerance = 0.001f;
+	config->memory_budget_mb = 0.0f;
+	config->ism_priority = ISM_PRIORITY_TIME;
+	config->time_budget_ms = 0.0f;
+	config->max_vs = 0;
+	config->ism_lattice = params.lattice;
+	config->ism_moving_source = false;
+	config->ism_occlusion = params.occlusion;
+	config->n_sources = 1;
+	config->master_gain_db = 0.0f;
+	config->listener = Listener::create();
+
+	if (params.mode == "TREE")
+		config->ism_mode = ISM_MODE_TREE;
+	else if (params.mode == "STREAM")
+		config->ism_mode = ISM_MODE_STREAM;
+	else if (params.mode == "BEST_FIRST")
+		config->ism_mode = ISM_MODE_BEST_FIRST;
+	else
+		throw AvrsException("ISM mode must be TREE, STREAM or BEST_FIRST");
+
+	return config;
+}
+
+// 8 x 6 x 3 m, centered on the origin in the floor plane. The ISM takes the
+// distance of each plane to the origin without sign, so the origin must see
+// all the surfaces from inside (see Surface::_calc_dist_origin()).
+syntheticroom_t make_shoebox(unsigned int tiles)
+{
+	const float x[] = { -4.0f, 4.0f, 4.0f, -4.0f };
+	const float y[] = { -3.0f, -3.0f, 3.0f, 3.0f };
+	const float height = 3.0f;
+	syntheticroom_t room;
+
+	room.name = (tiles > 1) ? "tiled" : "shoebox";
+	room.volume = 8.0f * 6.0f * height;
+	add_walls(room.surfaces, x, y, 4, height, tiles);
+	add_rectangle(room.surfaces, vec3(-4.0f, -3.0f, 0.0f), vec3(8.0f, 0.0f, 0.0f), vec3(0.0f, 6.0f, 0.0f), tiles);
+	add_rectangle(room.surfaces, vec3(-4.0f, -3.0f, height), vec3(0.0f, 6.0f, 0.0f), vec3(8.0f, 0.0f, 0.0f), tiles);
+
+	room.pos_source << -2.0f << -1.0f << 1.5f;
+	room.pos_listener << 1.5f << 1.0f << 1.7f;
+	return room;
+}
+
+// Two 10 x 5 m wings at right angles, 3 m high, with the inner corner at the
+// origin. The listener cannot see the source (paths around the corner).
+syntheticroom_t make_lshape(unsigned int tiles)
+{
+	const float x[] = { -5.0f, 5.0f, 5.0f, 0.0f, 0.0f, -5.0f };
+	const float y[] = { -5.0f, -5.0f, 0.0f, 0.0f, 5.0f, 5.0f };
+	const float height = 3.0f;
+	syntheticroom_t room;
+
+	room.name = "lshape";
+	room.volume = 75.0f * height;
+	add_walls(room.surfaces, x, y, 6, height, tiles);
+
+	// floor and ceiling, one rectangle for each wing
+	add_rectangle(room.surfaces, vec3(-5.0f, -5.0f, 0.0f), vec3(10.0f, 0.0f, 0.0f), vec3(0.0f, 5.0f, 0.0f), tiles);
+	add_rectangle(room.surfaces, vec3(-5.0f, 0.0f, 0.0f), vec3(5.0f, 0.0f, 0.0f), vec3(0.0f, 5.0f, 0.0f), tiles);
+	add_rectangle(room.surfaces, vec3(-5.0f, -5.0f, height), vec3(0.0f, 5.0f, 0.0f), vec3(10.0f, 0.0f, 0.0f), tiles);
+	add_rectangle(room.surfaces, vec3(-5.0f, 0.0f, height), vec3(0.0f, 5.0f, 0.0f), vec3(5.0f, 0.0f, 0.0f), tiles);
+
+	room.pos_source << -2.5f << 2.5f << 1.5f;
+	room.pos_listener << 3.0f << -1.5f << 1.7f;
+	return room;
+}
+
+// Rectangle corner + a u + b v (a, b in [0, 1]) split in tiles x tiles faces,
+// u x v is the normal (it must point into the room)
+void add_rectangle(std::vector<Surface::ptr_t> &surfaces, const vec3_t &corner,
+		const vec3_t &u, const vec3_t &v, unsigned int tiles)
+{
+	const float step = 1.0f / tiles;
+
+	for (unsigned int i = 0; i < tiles; i++)
+	{
+		for (unsigned int j = 0; j < tiles; j++)
+		{
+			vec3_t p[4];
+			p[0] = corner + u * (i * step) + v * (j * step);
+			p[1] = p[0] + u * step;
+			p[2] = p[1] + v * step;
+			p[3] = p[0] + v * step;
+
+			float x[4], y[4], z[4];
+
+			for (unsigned int k = 0; k < 4; k++)
+			{
+				x[k] = p[k].x;
+				y[k] = p[k].y;
+				z[k] = p[k].z;
+			}
+
+			surfaces.push_back(Surface::ptr_t(new Surface(surfaces.size() + 1, x, y, z, 4)));
+		}
+	}
+}
+
+// Vertical walls over a floor plan (counterclockwise seen from above)
+void add_walls(std::vector<Surface::ptr_t> &surfaces, const float *x, const float *y,
+		unsigned int n, float height, unsigned int tiles)
+{
+	for (unsigned int k = 0; k < n; k++)
+	{
+		unsigned int next = (k + 1) % n;
+		vec3_t corner = vec3(x[k], y[k], 0.0f);
+		vec3_t along = vec3(x[next] - x[k], y[next] - y[k], 0.0f);
+
+		add_rectangle(surfaces, corner, vec3(0.0f, 0.0f, height), along, tiles);
+	}
+}
+
+double wall_time_ms()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Maximum resident set size of the process (it never decreases)
+long peak_rss_kb()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
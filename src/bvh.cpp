@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/**
+ * @file bvh.cpp
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "bvh.hpp"
+
+namespace avrs
+{
+
+namespace // anonymous
+{
+const unsigned int max_leaf_size = 4;  // surfaces
+const unsigned int max_depth = 64;  // size of the traversal stack
+const float end_tolerance = 1E-3f;  // in meters, the ends of a segment are on the reflecting surfaces
+
+#ifdef __SSE__
+// typedef needed by SIMD instructions
+typedef float v4sf __attribute__ ((vector_size(16)));
+
+union f4vector
+{
+	v4sf v;
+	float f[4];
+};
+#endif
+}
+
+Bvh::ptr_t Bvh::create(const std::vector<Surface::ptr_t> &surfaces)
+{
+	ptr_t p_tmp(new Bvh(surfaces));
+	return p_tmp;
+}
+
+Bvh::Bvh(const std::vector<Surface::ptr_t> &surfaces)
+{
+	const unsigned int n = surfaces.size();
+
+	_surfaces.resize(n);
+	_centroids.resize(n);
+	_index.resize(n);
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		const arma::fmat &vert = surfaces[i]->get_vertices();
+		vec3_t c = vec3(0.0f, 0.0f, 0.0f);
+
+		for (unsigned int v = 0; v < vert.n_rows; v++)
+			c = c + vec3(vert(v, X), vert(v, Y), vert(v, Z));
+
+		_surfaces[i] = surfaces[i].get();
+		_centroids[i] = c * (1.0f / vert.n_rows);
+		_index[i] = i;
+	}
+
+	if (n == 0)
+		return;
+
+	_nodes.reserve(2 * n);
+	_nodes.resize(1);
+	_build(0, 0, n);
+}
+
+Bvh::~Bvh()
+{
+	;
+}
+
+// Whether some active surface crosses the segment p0 -> p1 (the surfaces
+// that only touch its ends are not taken into account)
+bool Bvh::is_occluded(const vec3_t &p0, const vec3_t &p1) const
+{
+	if (_nodes.empty())
+		return false;
+
+	vec3_t dir = p1 - p0;
+	float length = norm(dir);
+
+	if (length <= 2.0f * end_tolerance)
+		return false;
+
+	// inverse direction for the slab test (no infinities, they make NaNs)
+	vec3_t inv_dir;
+
+	for (unsigned int k = 0; k < 3; k++)
+	{
+		float d = dir(k);
+
+		if (fabs(d) < PRECISION)
+			d = (d < 0.0f) ? -PRECISION : PRECISION;
+
+		inv_dir(k) = 1.0f / d;
+	}
+
+	inv_dir.w = 0.0f;
+
+	const float t_min = end_tolerance / length;
+	const float t_max = 1.0f - t_min;
+	unsigned int stack[max_depth];
+	unsigned int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const node_t &node = _nodes[stack[--top]];
+
+		if (!_hit_box(node, p0, inv_dir))
+			continue;
+
+		if (node.count > 0)
+		{
+			for (unsigned int k = 0; k < node.count; k++)
+			{
+				if (_hit_surface(_surfaces[_index[node.first + k]], p0, dir, t_min, t_max))
+					return true;
+			}
+		}
+		else if (top + 2 <= max_depth)
+		{
+			stack[top++] = node.first;
+			stack[top++] = node.first + 1;
+		}
+	}
+
+	return false;
+}
+
+// Private functions
+
+// Splits the surfaces at the median of their centroids along the longest axis
+void Bvh::_build(unsigned int node, unsigned int first, unsigned int count)
+{
+	vec3_t lo = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3_t hi = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	vec3_t c_lo = lo;
+	vec3_t c_hi = hi;
+	unsigned int i, k;
+
+	for (i = first; i < first + count; i++)
+	{
+		const arma::fmat &vert = _surfaces[_index[i]]->get_vertices();
+		const vec3_t &c = _centroids[_index[i]];
+
+		for (k = 0; k < 3; k++)
+		{
+			for (unsigned int v = 0; v < vert.n_rows; v++)
+			{
+				lo(k) = std::min(lo(k), vert(v, k));
+				hi(k) = std::max(hi(k), vert(v, k));
+			}
+
+			c_lo(k) = std::min(c_lo(k), c(k));
+			c_hi(k) = std::max(c_hi(k), c(k));
+		}
+	}
+
+	// the boxes of the surfaces that are moved are not updated, the tree is built again
+	_nodes[node].lo = lo;
+	_nodes[node].hi = hi;
+
+	if (count <= max_leaf_size)
+	{
+		_nodes[node].first = first;
+		_nodes[node].count = count;
+		return;
+	}
+
+	centroidless_t less;
+	less.centroids = &_centroids;
+	less.axis = 0;
+
+	for (k = 1; k < 3; k++)
+	{
+		if (c_hi(k) - c_lo(k) > c_hi(less.axis) - c_lo(less.axis))
+			less.axis = k;
+	}
+
+	unsigned int half = count / 2;
+	std::nth_element(_index.begin() + first, _index.begin() + first + half,
+			_index.begin() + first + count, less);
+
+	unsigned int child = _nodes.size();
+	_nodes.resize(child + 2);  // the references to the nodes are not valid anymore
+	_nodes[node].first = child;
+	_nodes[node].count = 0;
+
+	_build(child, first, half);
+	_build(child + 1, first + half, count - half);
+}
+
+// Slab test of the segment against the box of a node (the three axes at once)
+bool Bvh::_hit_box(const node_t &node, const vec3_t &origin, const vec3_t &inv_dir) const
+{
+	float t_near[3];
+	float t_far[3];
+
+#ifdef __SSE__
+	f4vector t0, t1, n, f;
+	v4sf o = __builtin_ia32_loadups(&origin.x);
+	v4sf inv = __builtin_ia32_loadups(&inv_dir.x);
+	t0.v = (__builtin_ia32_loadups(&node.lo.x) - o) * inv;
+	t1.v = (__builtin_ia32_loadups(&node.hi.x) - o) * inv;
+	n.v = __builtin_ia32_minps(t0.v, t1.v);
+	f.v = __builtin_ia32_maxps(t0.v, t1.v);
+
+	for (unsigned int k = 0; k < 3; k++)
+	{
+		t_near[k] = n.f[k];
+		t_far[k] = f.f[k];
+	}
+#else
+	for (unsigned int k = 0; k < 3; k++)
+	{
+		float t0 = (node.lo(k) - origin(k)) * inv_dir(k);
+		float t1 = (node.hi(k) - origin(k)) * inv_dir(k);
+		t_near[k] = std::min(t0, t1);
+		t_far[k] = std::max(t0, t1);
+	}
+#endif
+
+	float entry = std::max(std::max(t_near[X], t_near[Y]), std::max(t_near[Z], 0.0f));
+	float exit = std::min(std::min(t_far[X], t_far[Y]), std::min(t_far[Z], 1.0f));
+
+	return entry <= exit;
+}
+
+bool Bvh::_hit_surface(const Surface *s, const vec3_t &p0, const vec3_t &dir, float t_min, float t_max) const
+{
+	if (!s->is_active())
+		return false;  // removed surface
+
+	const plane_t &plane = s->get_plane();
+	float denom = dot(plane.n, dir);
+
+	if (fabs(denom) <= PRECISION)
+		return false;  // parallel
+
+	float t = -eval(plane, p0) / denom;
+
+	if (t <= t_min || t >= t_max)
+		return false;
+
+	return s->is_point_inside(p0 + dir * t);
+}
+
+}  // namespace avrs
@@ -21,6 +21,7 @@
  */
 
 #include <fstream>
+#include <sstream>
 #include <boost/filesystem.hpp>
 #include <boost/make_shared.hpp>
 
@@ -58,6 +59,20 @@ void ConfigurationManager::show_configuration()
 	printf("ROOM_DXF_FILE = %s\n", _conf->dxf_file.c_str());
 	printf("ROOM_VOLUME = %.2f\n", _conf->volume);
 	printf("ROOM_N_SURFACES = %d\n", _conf->n_surfaces);
+	printf("ROOM_MERGE_SURFACES = %s\n", _conf->merge_surfaces ? "true" : "false");
+
+	if (_conf->dynamic_surfaces.size() > 0)
+	{
+		printf("ROOM_DYNAMIC_SURFACES = ");
+
+		for (unsigned int i = 0; i < _conf->dynamic_surfaces.size(); i++)
+			printf("%d ", _conf->dynamic_surfaces[i] + 1);
+
+		printf("\n");
+	}
+
+	printf("ROOM_ZONES = %s\n", _conf->zones ? "true" : "false");
+	printf("ROOM_PORTAL_DEPTH = %d\n", _conf->portal_depth);
 	printf("ROOM_FILTER_SURFACES_FILE = %s\n", _conf->filter_surf_file.c_str());
 	printf("Coefficients:\n");
 
@@ -82,11 +97,61 @@ void ConfigurationManager::show_configuration()
 	printf("ISM_MAX_ORDER = %d\n", _conf->max_order);
 	printf("ISM_MAX_DISTANCE = %.2f\n", _conf->max_distance);
 
+	if (_conf->ism_pruning)
+		printf("ISM_MIN_LEVEL_DB = %.2f\n", _conf->min_level_db);
+
+	if (_conf->ism_masking)
+	{
+		printf("ISM_MASKING_THRESHOLD_DB = %.2f\n", _conf->masking_threshold_db);
+		printf("ISM_MASKING_TIME_MS = %.2f\n", _conf->masking_time_ms);
+	}
+
+	if (_conf->ism_dedup)
+		printf("ISM_DEDUP_TOLERANCE = %.4f\n", _conf->dedup_tolerance);
+
+	switch (_conf->ism_mode)
+	{
+	case ISM_MODE_STREAM:
+		printf("ISM_MODE = STREAM\n");
+
+		if (_conf->memory_budget_mb > 0.0f)
+			printf("ISM_MEMORY_BUDGET_MB = %.2f\n", _conf->memory_budget_mb);
+		break;
+
+	case ISM_MODE_BEST_FIRST:
+		printf("ISM_MODE = BEST_FIRST\n");
+		printf("ISM_PRIORITY = %s\n", (_conf->ism_priority == ISM_PRIORITY_ENERGY) ? "ENERGY" : "TIME");
+		printf("ISM_TIME_BUDGET_MS = %.2f\n", _conf->time_budget_ms);
+		printf("ISM_MAX_VS = %lu\n", _conf->max_vs);
+		break;
+
+	default:
+		printf("ISM_MODE = TREE\n");
+	}
+
+	printf("ISM_LATTICE = %s\n", _conf->ism_lattice ? "true" : "false");
+	printf("ISM_MOVING_SOURCE = %s\n", _conf->ism_moving_source ? "true" : "false");
+
+	if (_conf->ism_moving_source)
+		printf("ISM_SOURCE_MARGIN = %.2f\n", _conf->source_margin);
+
+	printf("ISM_OCCLUSION = %s\n", _conf->ism_occlusion ? "true" : "false");
+
+	if (!_conf->ism_cache_dir.empty())
+		printf("ISM_CACHE_DIR = %s\n", _conf->ism_cache_dir.c_str());
+
 	printf("\nSound source section\n\n");
-	printf("SOUND_SOURCE_IR_FILE = %s\n", _conf->ir_file.c_str());
-	printf("SOUND_SOURCE_DIRECTIVITY_FILE = %s\n", _conf->directivity_file.c_str());
-	printf("SOUND_SOURCE_POSITION = %.2f, %.2f, %.2f\n",
-			_conf->sound_source->pos[0], _conf->sound_source->pos[1], _conf->sound_source->pos[2]);
+	printf("SOUND_SOURCES = %d\n", _conf->n_sources);
+
+	for (unsigned int k = 0; k < _conf->n_sources; k++)
+	{
+		printf("%s = %s\n", source_key("SOUND_SOURCE_IR_FILE", k).c_str(), _conf->ir_files[k].c_str());
+		printf("%s = %s\n", source_key("SOUND_SOURCE_DIRECTIVITY_FILE", k).c_str(),
+				_conf->directivity_files[k].c_str());
+		printf("%s = %.2f, %.2f, %.2f\n", source_key("SOUND_SOURCE_POSITION", k).c_str(),
+				_conf->sound_sources[k]->pos[0], _conf->sound_sources[k]->pos[1], _conf->sound_sources[k]->pos[2]);
+	}
+
 	printf("SOUND_SOURCE_ORIENTATION = \n");
 
 	printf("\nListener section\n\n");
@@ -100,7 +165,9 @@ void ConfigurationManager::show_configuration()
 	printf("LISTENER_HRTF_FILE = %s\n", _conf->hrtf_file.c_str());
 
 	printf("\nInput section\n\n");
-	printf("ANECHOIC_FILE = %s\n", _conf->anechoic_file.c_str());
+
+	for (unsigned int k = 0; k < _conf->n_sources; k++)
+		printf("%s = %s\n", source_key("ANECHOIC_FILE", k).c_str(), _conf->anechoic_files[k].c_str());
 
 	printf("\nOutput section\n\n");
 	printf("MASTER_GAIN_DB = %.2f\n", _conf->master_gain_db);
@@ -108,7 +175,10 @@ void ConfigurationManager::show_configuration()
 	printf("\nGeneral section\n\n");
 	printf("TEMPERATURE = %.2f\n", _conf->temperature);
 	printf("ANGLE_THRESHOLD = %.2f\n", _conf->angle_threshold);
+	printf("LISTENER_POSITION_THRESHOLD = %.3f\n", _conf->position_threshold);
+	printf("LISTENER_POSITION_MARGIN = %.3f\n", _conf->listener_margin);
 	printf("BIR_LENGTH = %.2f\n", _conf->bir_length_sec);
+	printf("RENDER_THREADS = %d\n", _conf->render_threads);
 }
 
 void ConfigurationManager::load_configuration(const std::string filename)
@@ -136,6 +206,37 @@ void ConfigurationManager::load_configuration(const std::string filename)
 	if (!cfr.readInto(_conf->n_surfaces, "ROOM_N_SURFACES"))
 		throw AvrsException("Error in configuration file: ROOM_N_SURFACES is missing");
 
+	cfr.readInto(_conf->merge_surfaces, "ROOM_MERGE_SURFACES", true);
+
+	// optional, surfaces that can be moved (numbered from 1, in the order of the DXF file)
+	if (cfr.readInto(tmp, "ROOM_DYNAMIC_SURFACES"))
+	{
+		Tokenizer t0(tmp, delimiter);
+
+		while (t0.next_token())
+		{
+			int index = atoi(t0.get_token().c_str());
+
+			if (index < 1 || index > (int) _conf->n_surfaces)
+				throw AvrsException("Error in configuration file: ROOM_DYNAMIC_SURFACES is out of range");
+
+			_conf->dynamic_surfaces.push_back(index - 1);
+		}
+	}
+
+	// optional, multi-room geometries: a 3D face in the layer ZONE_<name> belongs to
+	// that zone, one in the layer PORTAL_<name1>_<name2> is an opening between two
+	// zones (it does not reflect)
+	cfr.readInto(_conf->zones, "ROOM_ZONES", false);
+
+	int portal_depth;
+	cfr.readInto(portal_depth, "ROOM_PORTAL_DEPTH", 1);
+
+	if (portal_depth < 0)
+		throw AvrsException("Error in configuration file: ROOM_PORTAL_DEPTH must be positive");
+
+	_conf->portal_depth = (unsigned int) portal_depth;
+
 	if (!cfr.readInto(tmp, "ROOM_FILTER_SURFACES_FILE"))
 		throw AvrsException("Error in configuration file: ROOM_FILTER_SURFACES_FILE is missing");
 
@@ -160,30 +261,91 @@ void ConfigurationManager::load_configuration(const std::string filename)
 	if (!cfr.readInto(_conf->transition_time, "ISM_TRANSITION_TIME"))
 		throw AvrsException("Error in configuration file: ISM_TRANSITION_TIME is missing");
 
-	// Sound Source
-	if (!cfr.readInto(tmp, "SOUND_SOURCE_IR_FILE"))
-		throw AvrsException("Error in configuration file: SOUND_SOURCE_IR_FILE is missing");
+	// optional, pruning and masking are disabled if they are missing
+	_conf->ism_pruning = cfr.readInto(_conf->min_level_db, "ISM_MIN_LEVEL_DB", 0.0f);
+	cfr.readInto(_conf->masking_threshold_db, "ISM_MASKING_THRESHOLD_DB", 0.0f);
+	cfr.readInto(_conf->masking_time_ms, "ISM_MASKING_TIME_MS", 0.0f);
+	_conf->ism_masking = (_conf->masking_time_ms > 0.0f);
+	cfr.readInto(_conf->ism_dedup, "ISM_DEDUP", false);
+	cfr.readInto(_conf->dedup_tolerance, "ISM_DEDUP_TOLERANCE", 0.001f);
+	if (_conf->ism_dedup && _conf->dedup_tolerance <= 0.0f)
+		throw AvrsException("Error in configuration file: ISM_DEDUP_TOLERANCE must be positive");
+
+	// optional, TREE (default), STREAM or BEST_FIRST
+	cfr.readInto(tmp, "ISM_MODE", std::string("TREE"));
+
+	if (tmp == "TREE")
+		_conf->ism_mode = ISM_MODE_TREE;
+	else if (tmp == "STREAM")
+		_conf->ism_mode = ISM_MODE_STREAM;
+	else if (tmp == "BEST_FIRST")
+		_conf->ism_mode = ISM_MODE_BEST_FIRST;
+	else
+		throw AvrsException("Error in configuration file: ISM_MODE must be TREE, STREAM or BEST_FIRST");
+
+	cfr.readInto(_conf->memory_budget_mb, "ISM_MEMORY_BUDGET_MB", 0.0f);
+
+	// optional, TIME (default) or ENERGY
+	cfr.readInto(tmp, "ISM_PRIORITY", std::string("TIME"));
+
+	if (tmp == "TIME")
+		_conf->ism_priority = ISM_PRIORITY_TIME;
+	else if (tmp == "ENERGY")
+		_conf->ism_priority = ISM_PRIORITY_ENERGY;
+	else
+		throw AvrsException("Error in configuration file: ISM_PRIORITY must be TIME or ENERGY");
+
+	cfr.readInto(_conf->time_budget_ms, "ISM_TIME_BUDGET_MS", 0.0f);
+	cfr.readInto(_conf->max_vs, "ISM_MAX_VS", 0UL);
+
+	cfr.readInto(_conf->ism_lattice, "ISM_LATTICE", true);
+	cfr.readInto(_conf->ism_moving_source, "ISM_MOVING_SOURCE", false);
+	cfr.readInto(_conf->source_margin, "ISM_SOURCE_MARGIN", 0.5f);
+	cfr.readInto(_conf->ism_occlusion, "ISM_OCCLUSION", true);
+
+	// optional, the cache is disabled if it is missing
+	if (cfr.readInto(tmp, "ISM_CACHE_DIR"))
+		_conf->ism_cache_dir = full_path(tmp);
+
+	// Sound Sources (the keys of the second one and so on end with its number,
+	// e.g. SOUND_SOURCE_POSITION_2)
+	cfr.readInto(_conf->n_sources, "SOUND_SOURCES", 1U);
+
+	if (_conf->n_sources < 1)
+		throw AvrsException("Error in configuration file: SOUND_SOURCES must be at least 1");
+
+	for (unsigned int k = 0; k < _conf->n_sources; k++)
+	{
+		std::string key = source_key("SOUND_SOURCE_IR_FILE", k);
 
-	_conf->ir_file = full_path(tmp);;
+		if (!cfr.readInto(tmp, key))
+			throw AvrsException("Error in configuration file: " + key + " is missing");
 
-	if (!cfr.readInto(tmp, "SOUND_SOURCE_DIRECTIVITY_FILE"))
-		throw AvrsException("Error in configuration file: SOUND_SOURCE_DIRECTIVITY_FILE is missing");
+		_conf->ir_files.push_back(full_path(tmp));
+		key = source_key("SOUND_SOURCE_DIRECTIVITY_FILE", k);
 
-	_conf->directivity_file = full_path(tmp);
+		if (!cfr.readInto(tmp, key))
+			throw AvrsException("Error in configuration file: " + key + " is missing");
 
-	_conf->sound_source = SoundSource::create(_conf->ir_file);
-	assert(_conf->sound_source.get() != NULL);
+		_conf->directivity_files.push_back(full_path(tmp));
 
-	if (!cfr.readInto(tmp, "SOUND_SOURCE_POSITION"))
-		throw AvrsException("Error in configuration file: SOUND_SOURCE_POSITION is missing");
+		SoundSource::ptr_t sound_source = SoundSource::create(_conf->ir_files[k]);
+		assert(sound_source.get() != NULL);
+		key = source_key("SOUND_SOURCE_POSITION", k);
 
-	Tokenizer t1(tmp, delimiter);
-	coord = 0;
+		if (!cfr.readInto(tmp, key))
+			throw AvrsException("Error in configuration file: " + key + " is missing");
 
-	while (t1.next_token())
-	{
-		assert(coord <= 3);
-		_conf->sound_source->pos.at(coord++) = (float) atof(t1.get_token().c_str());
+		Tokenizer t1(tmp, delimiter);
+		coord = 0;
+
+		while (t1.next_token())
+		{
+			assert(coord <= 3);
+			sound_source->pos.at(coord++) = (float) atof(t1.get_token().c_str());
+		}
+
+		_conf->sound_sources.push_back(sound_source);
 	}
 
 	// orientation of sound source is discarded (omnidirectional only)
@@ -234,10 +396,15 @@ void ConfigurationManager::load_configuration(const std::string filename)
 	_conf->hrtf_file = full_path(tmp);
 
 	// Input
-	if (!cfr.readInto(tmp, "ANECHOIC_FILE"))
-		throw AvrsException("Error in configuration file: ANECHOIC_FILE is missing");
+	for (unsigned int k = 0; k < _conf->n_sources; k++)
+	{
+		std::string key = source_key("ANECHOIC_FILE", k);
+
+		if (!cfr.readInto(tmp, key))
+			throw AvrsException("Error in configuration file: " + key + " is missing");
 
-	_conf->anechoic_file = full_path(tmp);
+		_conf->anechoic_files.push_back(full_path(tmp));
+	}
 
 	// Output
 	if (!cfr.readInto(_conf->master_gain_db, "MASTER_GAIN_DB"))
@@ -263,10 +430,32 @@ void ConfigurationManager::load_configuration(const std::string filename)
 	if (!cfr.readInto(_conf->angle_threshold, "ANGLE_THRESHOLD"))
 		throw AvrsException("Error in configuration file: ANGLE_THRESHOLD is missing");
 
+	cfr.readInto(_conf->position_threshold, "LISTENER_POSITION_THRESHOLD", 0.0f);
+
+	if (_conf->position_threshold < 0.0f)
+		throw AvrsException("Error in configuration file: LISTENER_POSITION_THRESHOLD must be non-negative");
+
+	// optional, the VSs updated for a new position of the listener are the
+	// ones generated at the position of the last calculation, beyond this
+	// distance they are calculated again (the culled ones can be audible)
+	cfr.readInto(_conf->listener_margin, "LISTENER_POSITION_MARGIN", 1.0f);
+
+	if (_conf->listener_margin < 0.0f)
+		throw AvrsException("Error in configuration file: LISTENER_POSITION_MARGIN must be non-negative");
+
 	if (!cfr.readInto(_conf->bir_length_sec, "BIR_LENGTH"))
 		throw AvrsException("Error in configuration file: BIR_LENGTH is missing");
 
 	_conf->bir_length_samples = (unsigned long) (_conf->bir_length_sec * SAMPLE_RATE);
+
+	// optional, one thread per core if it is missing
+	int render_threads;
+	cfr.readInto(render_threads, "RENDER_THREADS", 0);
+
+	if (render_threads < 0)
+		throw AvrsException("Error in configuration file: RENDER_THREADS must be non-negative");
+
+	_conf->render_threads = (unsigned int) render_threads;
 }
 
 std::string ConfigurationManager::full_path(const std::string relative_path)
@@ -276,6 +465,18 @@ std::string ConfigurationManager::full_path(const std::string relative_path)
 	return p_full.string();
 }
 
+// Key of a sound source, the first one has no number (e.g. ANECHOIC_FILE,
+// ANECHOIC_FILE_2, ...)
+std::string ConfigurationManager::source_key(const std::string key, unsigned int source)
+{
+	if (source == 0)
+		return key;
+
+	std::ostringstream numbered;
+	numbered << key << "_" << (source + 1);
+	return numbered.str();
+}
+
 bool ConfigurationManager::load_surface_filters(std::string filename)
 {
 	bool ok = true;
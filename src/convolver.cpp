@@ -21,6 +21,7 @@
  *
  */
 
+#include <cassert>
 #include <cmath>
 #include <fstream>
 #include <sys/types.h>
@@ -72,7 +73,13 @@ Convolver::Convolver(const nframes_t nframes, const crossfade_t crossfade_type)
 	}
 
 	_signal.clear();
-	_waiting_queue.clear();
+
+	for (unsigned int n = 0u; n < _filter_slots; n++)
+		_filter_used[n] = 0;
+
+	_published_filter = -1;
+	_writing_filter = -1;
+	_waiting_count = 0u;
 
 	// allocate memory and initialize to 0
 	_fft_buffer.resize(_partition_size, 0.0f);
@@ -152,6 +159,7 @@ Convolver::Convolver(const nframes_t nframes, const crossfade_t crossfade_type)
 
 	// set dirac as default filter
 	set_neutral_filter();
+	update_filter();
 }
 
 Convolver::~Convolver()
@@ -225,6 +233,8 @@ void Convolver::set_filter_t(const data_t& filter)
  * equal or higher than the number of partitions of the current filter! If you 
  * set a filter which has less partitions than the current one, some of the 
  * partitions of the old filter will remain in the chain. So don't do that.
+ * It is the same as filling filter_buffer() and calling publish_filter(), 
+ * the filter is used after the next update_filter().
  * @param filter vector holding the transfer functions of the zero padded 
  * filter partitions in halfcomplex format (see also fftw3 documentation).
  * First element of \b filter is the first partition etc.
@@ -234,14 +244,90 @@ void Convolver::set_filter_f(data_t& filter)
 	if (filter.empty())
 		return;
 
-	// if more filter updates than convolutions happen
-	if (!_waiting_queue.empty() && _waiting_queue.back().second == 0u)
+	filter_buffer() = filter;
+	publish_filter();
+}
+
+/** Buffer for the next filter, to be filled by the writer thread (e.g. a
+ * soft real-time task) in the format of set_filter_f(). It belongs to the
+ * convolver, so it only allocates when the filter gets longer than the
+ * previous ones written in the same slot. The same buffer is returned until
+ * publish_filter() is called.
+ * @return buffer of a free slot
+ */
+Convolver::data_t& Convolver::filter_buffer()
+{
+	// there is always a free slot: at most _filter_slots - 2 are waiting,
+	// one is published and this one is written
+	for (unsigned int n = 0u; n < _filter_slots && _writing_filter < 0; n++)
 	{
-		_waiting_queue.pop_back();
+		if (!__sync_fetch_and_add(&_filter_used[n], 0))
+			_writing_filter = n;
 	}
 
-	_waiting_queue.push_back(std::pair<data_t, unsigned int>(filter, 0u));
+	assert(_writing_filter >= 0);
+	return _filters[_writing_filter];
+}
+
+/** Hands the buffer of filter_buffer() over to the convolution thread, which
+ * takes it in update_filter(). If the previous one was not taken yet, it is
+ * replaced (only the last one matters). It never blocks.
+ */
+void Convolver::publish_filter()
+{
+	if (_writing_filter < 0)
+		return;
+
+	const int slot = _writing_filter;
+	_writing_filter = -1;
 
+	if (_filters[slot].empty())
+		return;
+
+	_filter_used[slot] = 1;
+
+	// full barrier, the filter is written before the swap
+	int old;
+
+	do
+	{
+		old = _published_filter;
+	} while (!__sync_bool_compare_and_swap(&_published_filter, old, slot));
+
+	// not taken by the convolution thread
+	if (old >= 0)
+		__sync_lock_release(&_filter_used[old]);
+}
+
+/** Takes the last published filter, to be called by the convolution thread
+ * (e.g. the hard real-time loop) before convolve_signal(). It only swaps the
+ * index of the slot: it does not copy the filter and never allocates or
+ * blocks. The partitions are then exchanged cycle by cycle.
+ */
+void Convolver::update_filter()
+{
+	int slot;
+
+	do
+	{
+		slot = _published_filter;
+	} while (slot >= 0 && !__sync_bool_compare_and_swap(&_published_filter, slot, -1));
+
+	if (slot < 0)
+		return;
+
+	// if more filter updates than convolutions happen (or the queue is
+	// full), the youngest filter is replaced
+	if (_waiting_count > 0u && (_waiting_queue[_waiting_count - 1].age == 0u
+			|| _waiting_count == _filter_slots - 2))
+	{
+		_waiting_count--;
+		__sync_lock_release(&_filter_used[_waiting_queue[_waiting_count].slot]);
+	}
+
+	_waiting_queue[_waiting_count].slot = slot;
+	_waiting_queue[_waiting_count].age = 0u;
+	_waiting_count++;
 }
 
 /** This function assures that the filter partitions are not 
@@ -252,34 +338,39 @@ void Convolver::set_filter_f(data_t& filter)
 void Convolver::_update_filter_partitions()
 {
 	// if nothing to update
-	if (_waiting_queue.empty())
+	if (!_waiting_count)
 		return;
 
 	unsigned int no_of_partitions = _filter_coefficients.size()
 			/ _partition_size;
+	unsigned int n_waiting = 0u;
 
 	// go through all filters that are waiting to check
 	// for how long they have waited
-	for (waiting_queue_t::iterator i = _waiting_queue.begin();
-			i != _waiting_queue.end();)
+	for (unsigned int i = 0u; i < _waiting_count; i++)
 	{
+		waiting_filter_t waiting = _waiting_queue[i];
+		const data_t& filter = _filters[waiting.slot];
+		bool done = false;
+
 		// exchange filter partition
-		if (i->second < no_of_partitions)
+		if (waiting.age < no_of_partitions)
 		{
-			std::copy(i->first.begin() + i->second * _partition_size,
-					i->first.begin() + (i->second + 1) * _partition_size,
-					_filter_coefficients.begin() + i->second * _partition_size);
+			std::copy(filter.begin() + waiting.age * _partition_size,
+					filter.begin() + (waiting.age + 1) * _partition_size,
+					_filter_coefficients.begin() + waiting.age * _partition_size);
 		}
 
-		// append partition to the filter
-		else if (i->second == no_of_partitions
-				&& i->first.size() > no_of_partitions * _partition_size)
+		// append partition to the filter (it only allocates when the
+		// filter gets longer)
+		else if (waiting.age == no_of_partitions
+				&& filter.size() > no_of_partitions * _partition_size)
 		{
 
 			for (unsigned int n = 0u; n < _partition_size; n++)
 			{
 				_filter_coefficients.push_back(
-						i->first[i->second * _partition_size + n]);
+						filter[waiting.age * _partition_size + n]);
 			}
 
 			no_of_partitions++;
@@ -288,29 +379,33 @@ void Convolver::_update_filter_partitions()
 		}
 
 		// this should not happen
-		else if (i->second > no_of_partitions)
+		else if (waiting.age > no_of_partitions)
 		{
 			ERROR("Something's wrong concerning the partition scheduling.");
 
 			// get rid of the problem
-			i = _waiting_queue.erase(i);
+			done = true;
 		}
 
 		// if all partitions of the filter are already in use
-		if (i->first.size() == (i->second + 1) * _partition_size)
+		if (filter.size() == (waiting.age + 1) * _partition_size)
+			done = true;
+
+		if (done)
 		{
-			// erase filter from waiting queue
-			i = _waiting_queue.erase(i);
+			// the slot can be written again
+			__sync_lock_release(&_filter_used[waiting.slot]);
 		}
 		else // if not
 		{
 			// increase the age of the filter by one cycle
-			(i->second)++;
-			// step one filter further
-			i++;
+			waiting.age++;
+			_waiting_queue[n_waiting++] = waiting;
 		}
 	}
 
+	_waiting_count = n_waiting;
+
 	//  TODO: Handle filters with different  //
 	//  numbers of partitions                //
 }
@@ -358,7 +453,7 @@ Convolver::convolve_signal(float *input_signal, float weighting_factor)
 	}
 	// if there is data in input signal
 	else
-		_no_of_partitions_to_process = _waiting_queue.size();
+		_no_of_partitions_to_process = _waiting_count;
 
 	//////////////////////////////////////////////
 	/////// processing has to be done ////////////
@@ -826,9 +921,21 @@ void Convolver::_unsort_coefficients()
 /** static version */
 void Convolver::sort_coefficients(data_t& coefficients,
 		const unsigned int partition_size)
+{
+	data_t buffer(partition_size);
+
+	sort_coefficients(&coefficients[0], &buffer[0], partition_size);
+
+	std::copy(buffer.begin(), buffer.end(), coefficients.begin());
+}
+
+/** static version without temporary buffer (\b coefficients and \b buffer
+ * must not overlap)
+ */
+void Convolver::sort_coefficients(const float *coefficients, float *buffer,
+		const unsigned int partition_size)
 {
 	const unsigned int buffer_size = partition_size;
-	data_t buffer(buffer_size);
 
 	int base = 8;
 
@@ -857,9 +964,6 @@ void Convolver::sort_coefficients(data_t& coefficients,
 
 		base += 8;
 	}
-
-	std::copy(buffer.begin(), buffer.end(), coefficients.begin());
-
 }
 
 void Convolver::_fft()
@@ -72,7 +72,11 @@ void DxfReader::addVertex(const DL_VertexData& data)
 void DxfReader::add3dFace(const DL_3dFaceData& data)
 {
 	static unsigned int id = 0;
-	_surfaces.push_back(boost::make_shared<Surface>(++id, data.x, data.y, data.z, 4));
+
+	// a triangle repeats the third vertex
+	int n_vert = (data.x[3] == data.x[2] && data.y[3] == data.y[2] && data.z[3] == data.z[2]) ? 3 : 4;
+	_surfaces.push_back(boost::make_shared<Surface>(++id, data.x, data.y, data.z, n_vert));
+	_layers.push_back(attributes.getLayer());
 }
 
 std::vector<Surface::ptr_t> DxfReader::get_surfaces()
@@ -80,6 +84,11 @@ std::vector<Surface::ptr_t> DxfReader::get_surfaces()
 	return _surfaces;
 }
 
+std::vector<std::string> DxfReader::get_layers()
+{
+	return _layers;
+}
+
 void DxfReader::print_attributes()
 {
 	printf("  Attributes: Layer: %s, ", attributes.getLayer().c_str());
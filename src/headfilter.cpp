@@ -17,6 +17,8 @@
  */
 
 #include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <fstream>
 
 #include "headfilter.hpp"
@@ -26,6 +28,86 @@
 namespace avrs
 {
 
+namespace
+{
+
+const double hull_eps = 1e-9;
+const float min_weight = 1e-3f;  // smaller weights are dropped
+const double max_edge_ratio = 1.5;  // longer edges (relative to the local ones) bridge a gap
+
+// Face of the convex hull, n . p = d is its plane (n points outside)
+typedef struct HullFace
+{
+	uint v[3];
+	double n[3];
+	double d;
+} hullface_t;
+
+inline double dot3(const double *a, const double *b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+inline void cross3(const double *a, const double *b, double *c)
+{
+	c[0] = a[1] * b[2] - a[2] * b[1];
+	c[1] = a[2] * b[0] - a[0] * b[2];
+	c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// det([a b c])
+inline double det3(const double *a, const double *b, const double *c)
+{
+	double bc[3];
+	cross3(b, c, bc);
+	return dot3(a, bc);
+}
+
+// Distance between the directions i and j of an array of unitary vectors
+inline double chord(const std::vector<double> &u, uint i, uint j)
+{
+	double d[3] = { u[3 * i] - u[3 * j], u[3 * i + 1] - u[3 * j + 1], u[3 * i + 2] - u[3 * j + 2] };
+	return sqrt(dot3(d, d));
+}
+
+// Face a, b, c with its normal away from an interior point
+hullface_t make_face(const std::vector<double> &u, uint a, uint b, uint c, const double *inside)
+{
+	hullface_t f;
+	double ab[3], ac[3];
+
+	for (uint k = 0; k < 3; k++)
+	{
+		ab[k] = u[3 * b + k] - u[3 * a + k];
+		ac[k] = u[3 * c + k] - u[3 * a + k];
+	}
+
+	cross3(ab, ac, f.n);
+	double norm = sqrt(dot3(f.n, f.n));
+
+	for (uint k = 0; k < 3; k++)
+		f.n[k] /= norm;
+
+	f.v[0] = a;
+	f.v[1] = b;
+	f.v[2] = c;
+	f.d = dot3(f.n, &u[3 * a]);
+
+	if (dot3(f.n, inside) > f.d)  // flipped
+	{
+		std::swap(f.v[1], f.v[2]);
+
+		for (uint k = 0; k < 3; k++)
+			f.n[k] = -f.n[k];
+
+		f.d = -f.d;
+	}
+
+	return f;
+}
+
+}  // namespace
+
 HrtfCoeffSet::HrtfCoeffSet(std::string filename)
 	: _filename(filename)
 {
@@ -48,24 +130,46 @@ HrtfCoeffSet::ptr_t HrtfCoeffSet::create(std::string filename)
 
 	// build kd-tree
 	p_tmp->_build_kd_tree();
+	p_tmp->_triangulate();
+	p_tmp->_build_lut();
 
 	return p_tmp;
 }
 
+// Coefficients of the HRTF with the largest weight (not interpolated)
 void HrtfCoeffSet::get_HRTF_coeff(hrtfcoeff_t *val, point3_t point_L)
 {
-	assert(val != NULL);
+	get_HRTF_coeff(val, get_HRTF_weights(find_direction(point_L)).index[0]);
+}
 
-	// vertical-polar to rectangular conversion
-	double point[3];
-	point[X] = point_L(X);
-	point[Y] = point_L(Y);
-	point[Z] = point_L(Z);
+uint HrtfCoeffSet::find_direction(const point3_t &point_L) const
+{
+	const double step = HRTF_LUT_STEP * M_PI / 180.0;
+	double x = point_L(X);
+	double y = point_L(Y);
+	double z = point_L(Z);
+
+	// nearest cell (see _build_lut())
+	double az = atan2(y, x);  // [-M_PI, M_PI]
+	double el = atan2(z, sqrt(x * x + y * y));  // [-M_PI/2, M_PI/2]
+	uint i = (uint) floor((az + M_PI) / step + 0.5) % _lut_n_az;
+	uint j = std::min((uint) floor((el + M_PI / 2.0) / step + 0.5), _lut_n_el - 1);
+
+	return j * _lut_n_az + i;
+}
 
+const hrtfweights_t &HrtfCoeffSet::get_HRTF_weights(uint cell) const
+{
+	assert(cell < _lut.size());
+	return _lut[cell];
+}
+
+uint HrtfCoeffSet::_search_kd_tree(double *point)
+{
 	// search in kd-tree
 	const int k = 1;
-	ANNidxArray nnIdx = new ANNidx[k];
-	ANNdistArray dists = new ANNdist[k];
+	ANNidx nnIdx[k];
+	ANNdist dists[k];
 
 	_kd_tree->annkSearch(
 			point,
@@ -73,7 +177,13 @@ void HrtfCoeffSet::get_HRTF_coeff(hrtfcoeff_t *val, point3_t point_L)
 			nnIdx,
 			dists);
 
-	int idx = nnIdx[0];  // index of nearest neighbor
+	return (uint) nnIdx[0];  // index of nearest neighbor
+}
+
+void HrtfCoeffSet::get_HRTF_coeff(hrtfcoeff_t *val, uint idx) const
+{
+	assert(val != NULL);
+	assert(idx < _n_hrtf);
 
 	// copy data
 	val->itd = _itd[idx];
@@ -198,6 +308,342 @@ void HrtfCoeffSet::_build_kd_tree()
 				3);				// dimensions of space
 }
 
+// Convex hull of the measured directions (incremental). They are on the unit
+// sphere, so it is their spherical Delaunay triangulation. The repeated
+// directions are skipped, and if all of them are in one plane (e.g. only the
+// horizontal one) there are no triangles and the HRTFs are not interpolated.
+void HrtfCoeffSet::_triangulate()
+{
+	std::vector<double> u(3 * _n_hrtf);
+	uint i, k;
+
+	for (i = 0; i < _n_hrtf; i++)
+	{
+		double norm = sqrt(dot3(_points[i], _points[i]));
+
+		for (k = 0; k < 3; k++)
+			u[3 * i + k] = (norm > 0.0) ? _points[i][k] / norm : 0.0;
+	}
+
+	// initial tetrahedron: the farthest direction from the first one, the
+	// farthest from their line and the farthest from their plane
+	uint a = 0, b = 0, c = 0, d = 0;
+	double best = 0.0;
+
+	for (i = 1; i < _n_hrtf; i++)
+	{
+		double diff[3] = { u[3 * i] - u[0], u[3 * i + 1] - u[1], u[3 * i + 2] - u[2] };
+		double dist = dot3(diff, diff);
+
+		if (dist > best)
+		{
+			best = dist;
+			b = i;
+		}
+	}
+
+	best = 0.0;
+
+	for (i = 0; i < _n_hrtf && b != a; i++)
+	{
+		double ab[3], ai[3], n[3];
+
+		for (k = 0; k < 3; k++)
+		{
+			ab[k] = u[3 * b + k] - u[3 * a + k];
+			ai[k] = u[3 * i + k] - u[3 * a + k];
+		}
+
+		cross3(ab, ai, n);
+		double area = dot3(n, n);
+
+		if (area > best)
+		{
+			best = area;
+			c = i;
+		}
+	}
+
+	best = 0.0;
+
+	for (i = 0; i < _n_hrtf && c != a; i++)
+	{
+		double ab[3], ac[3], ai[3], n[3];
+
+		for (k = 0; k < 3; k++)
+		{
+			ab[k] = u[3 * b + k] - u[3 * a + k];
+			ac[k] = u[3 * c + k] - u[3 * a + k];
+			ai[k] = u[3 * i + k] - u[3 * a + k];
+		}
+
+		cross3(ab, ac, n);
+		double volume = fabs(dot3(n, ai));
+
+		if (volume > best)
+		{
+			best = volume;
+			d = i;
+		}
+	}
+
+	if (b == a || c == a || d == a || best < hull_eps)
+	{
+		WARNING("The HRTFs are not interpolated (their directions are in one plane)");
+		return;
+	}
+
+	double inside[3];
+
+	for (k = 0; k < 3; k++)
+		inside[k] = (u[3 * a + k] + u[3 * b + k] + u[3 * c + k] + u[3 * d + k]) / 4.0;
+
+	std::vector<hullface_t> faces;
+	faces.push_back(make_face(u, a, b, c, inside));
+	faces.push_back(make_face(u, a, b, d, inside));
+	faces.push_back(make_face(u, a, c, d, inside));
+	faces.push_back(make_face(u, b, c, d, inside));
+
+	std::vector<hullface_t> visible, kept;
+	std::vector<uint> horizon;  // pairs of vertices
+
+	for (i = 0; i < _n_hrtf; i++)
+	{
+		if (i == a || i == b || i == c || i == d)
+			continue;
+
+		const double *p = &u[3 * i];
+		visible.clear();
+		kept.clear();
+
+		for (k = 0; k < faces.size(); k++)
+		{
+			if (dot3(faces[k].n, p) - faces[k].d > hull_eps)
+				visible.push_back(faces[k]);
+			else
+				kept.push_back(faces[k]);
+		}
+
+		if (visible.empty())  // repeated direction
+			continue;
+
+		// the edges of the visible region are not shared by two visible faces
+		horizon.clear();
+
+		for (k = 0; k < visible.size(); k++)
+		{
+			for (uint e = 0; e < 3; e++)
+			{
+				uint v0 = visible[k].v[e];
+				uint v1 = visible[k].v[(e + 1) % 3];
+				bool shared = false;
+
+				for (uint l = 0; l < visible.size() && !shared; l++)
+				{
+					for (uint f = 0; f < 3 && !shared; f++)
+						shared = (visible[l].v[f] == v1 && visible[l].v[(f + 1) % 3] == v0);
+				}
+
+				if (!shared)
+				{
+					horizon.push_back(v0);
+					horizon.push_back(v1);
+				}
+			}
+		}
+
+		faces.swap(kept);
+
+		for (k = 0; k < horizon.size(); k += 2)
+			faces.push_back(make_face(u, horizon[k], horizon[k + 1], i, inside));
+	}
+
+	// The hull also bridges the gaps of the measurements (e.g. below the
+	// lowest elevation or a missing azimuth), and those triangles would mix
+	// HRTFs of opposite sides of the head. The local spacing of a direction
+	// is the median of its edges, an edge longer than max_edge_ratio times
+	// the spacing of one of its vertices is a gap (the directions of its
+	// triangles use the nearest HRTF, see _build_lut()).
+	std::vector< std::vector<double> > edges(_n_hrtf);
+	std::vector<double> spacing(_n_hrtf, 0.0);
+
+	for (k = 0; k < faces.size(); k++)
+	{
+		for (uint e = 0; e < 3; e++)  // each edge is in two faces, once in each direction
+			edges[faces[k].v[e]].push_back(chord(u, faces[k].v[e], faces[k].v[(e + 1) % 3]));
+	}
+
+	for (i = 0; i < _n_hrtf; i++)
+	{
+		std::vector<double> &l = edges[i];
+
+		if (l.empty())
+			continue;
+
+		std::nth_element(l.begin(), l.begin() + l.size() / 2, l.end());
+		spacing[i] = l[l.size() / 2];
+	}
+
+	kept.clear();
+
+	for (k = 0; k < faces.size(); k++)
+	{
+		bool gap = false;
+
+		for (uint e = 0; e < 3 && !gap; e++)
+		{
+			uint v0 = faces[k].v[e];
+			uint v1 = faces[k].v[(e + 1) % 3];
+			gap = (chord(u, v0, v1) > max_edge_ratio * std::min(spacing[v0], spacing[v1]));
+		}
+
+		if (!gap)
+			kept.push_back(faces[k]);
+	}
+
+	_triangles.resize(3 * kept.size());
+	_vertex_triangles.assign(_n_hrtf, std::vector<uint>());
+
+	for (k = 0; k < kept.size(); k++)
+	{
+		for (uint e = 0; e < 3; e++)
+		{
+			_triangles[3 * k + e] = kept[k].v[e];
+			_vertex_triangles[kept[k].v[e]].push_back(k);
+		}
+	}
+
+	DPRINT("%lu HRTF triangles (%lu over gaps)", (unsigned long) kept.size(),
+			(unsigned long) (faces.size() - kept.size()));
+}
+
+// Barycentric weights of a direction (unitary) in a triangle, returns false
+// if it is outside
+bool HrtfCoeffSet::_weights_in_triangle(uint t, const double *u, hrtfweights_t *w) const
+{
+	double v[3][3];
+	uint k, l;
+
+	for (k = 0; k < 3; k++)
+	{
+		const double *p = _points[_triangles[3 * t + k]];
+		double norm = sqrt(dot3(p, p));
+
+		for (l = 0; l < 3; l++)
+			v[k][l] = p[l] / norm;
+	}
+
+	double det = det3(v[0], v[1], v[2]);
+
+	if (det < hull_eps)  // the direction does not cross it
+		return false;
+
+	double weight[3];
+	weight[0] = det3(u, v[1], v[2]) / det;
+	weight[1] = det3(v[0], u, v[2]) / det;
+	weight[2] = det3(v[0], v[1], u) / det;
+
+	if (weight[0] < -hull_eps || weight[1] < -hull_eps || weight[2] < -hull_eps)
+		return false;
+
+	// sorted from the largest one, the small ones are dropped
+	uint order[3] = { 0, 1, 2 };
+
+	for (k = 0; k < 3; k++)
+	{
+		for (l = k + 1; l < 3; l++)
+		{
+			if (weight[order[l]] > weight[order[k]])
+				std::swap(order[k], order[l]);
+		}
+	}
+
+	double sum = 0.0;
+	w->n = 0;
+
+	for (k = 0; k < 3; k++)
+	{
+		if (k == 0 || weight[order[k]] >= min_weight * weight[order[0]])
+		{
+			sum += weight[order[k]];
+			w->n++;
+		}
+	}
+
+	for (k = 0; k < 3; k++)
+	{
+		w->index[k] = _triangles[3 * t + order[k]];
+		w->weight[k] = (k < w->n) ? (float) (weight[order[k]] / sum) : 0.0f;
+	}
+
+	return true;
+}
+
+// The cells of the table are centered in the multiples of HRTF_LUT_STEP, the
+// search error is less than one cell. The triangle of a cell is searched
+// among the one of the previous cell, the ones of the nearest HRTF and then
+// all of them.
+void HrtfCoeffSet::_build_lut()
+{
+	const double step = HRTF_LUT_STEP * M_PI / 180.0;
+	double point[3];
+	uint last = 0;
+
+	_lut_n_az = (uint) floor(360.0 / HRTF_LUT_STEP + 0.5);
+	_lut_n_el = (uint) floor(180.0 / HRTF_LUT_STEP + 0.5) + 1;  // both poles
+	_lut.resize(_lut_n_az * _lut_n_el);
+
+	for (uint j = 0; j < _lut_n_el; j++)
+	{
+		double el = -M_PI / 2.0 + j * step;
+
+		for (uint i = 0; i < _lut_n_az; i++)
+		{
+			double az = -M_PI + i * step;
+			point[X] = cos(el) * cos(az);
+			point[Y] = cos(el) * sin(az);
+			point[Z] = sin(el);
+
+			hrtfweights_t &w = _lut[j * _lut_n_az + i];
+			uint nearest = _search_kd_tree(point);
+			bool found = false;
+
+			if (!_triangles.empty())
+			{
+				found = _weights_in_triangle(last, point, &w);
+
+				const std::vector<uint> &around = _vertex_triangles[nearest];
+
+				for (uint k = 0; k < around.size() && !found; k++)
+				{
+					if (_weights_in_triangle(around[k], point, &w))
+					{
+						last = around[k];
+						found = true;
+					}
+				}
+
+				for (uint t = 0; t < _triangles.size() / 3 && !found; t++)
+				{
+					if (_weights_in_triangle(t, point, &w))
+					{
+						last = t;
+						found = true;
+					}
+				}
+			}
+
+			if (!found)  // nearest HRTF
+			{
+				w.index[0] = w.index[1] = w.index[2] = nearest;
+				w.weight[0] = 1.0f;
+				w.weight[1] = w.weight[2] = 0.0f;
+				w.n = 1;
+			}
+		}
+	}
+}
+
 void HrtfCoeffSet::_allocate_memory()
 {
 	uint i, j;
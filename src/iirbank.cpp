@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#include <cassert>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "avrsexception.hpp"
+#include "iirbank.hpp"
+
+namespace avrs
+{
+
+namespace
+{
+
+// Vectors aligned to their size, n can be zero
+template <typename T>
+T *alloc_aligned(unsigned int n)
+{
+	void *p = NULL;
+
+	if (posix_memalign(&p, sizeof(T), (n > 0 ? n : 1) * sizeof(T)) != 0)
+		throw AvrsException("Error allocating IirBank");
+
+	memset(p, 0, (n > 0 ? n : 1) * sizeof(T));
+	return static_cast<T*> (p);
+}
+
+}  // namespace
+
+IirBank::IirBank(unsigned int length, unsigned int samples)
+{
+	_b = NULL;
+	_a = NULL;
+	_z = NULL;
+	_length = 0;
+	_samples = samples;
+
+	_input = alloc_aligned<lanes_t>(_samples);
+	_output = alloc_aligned<lanes_t>(_samples);
+	_allocate(length);
+}
+
+IirBank::~IirBank()
+{
+	free(_b);
+	free(_a);
+	free(_z);
+	free(_input);
+	free(_output);
+}
+
+// Room for filters of the given length, the lanes keep their coefficients
+// (padded with zeros) and state
+void IirBank::_allocate(unsigned int length)
+{
+	lanes_t *b = alloc_aligned<lanes_t>(length);
+	lanes_t *a = alloc_aligned<lanes_t>(length);
+	lanes_t *z = alloc_aligned<lanes_t>(length);
+
+	if (_length > 0)
+	{
+		memcpy(b, _b, _length * sizeof(lanes_t));
+		memcpy(a, _a, _length * sizeof(lanes_t));
+		memcpy(z, _z, _length * sizeof(lanes_t));
+	}
+
+	free(_b);
+	free(_a);
+	free(_z);
+
+	_b = b;
+	_a = a;
+	_z = z;
+	_length = length;
+}
+
+void IirBank::set_lane(unsigned int lane, const double *b, unsigned int n_b, const double *a, unsigned int n_a)
+{
+	assert(lane < LANES);
+	assert(n_b > 0 && n_a > 0);
+	assert(a[0] != 0.0);
+
+	unsigned int length = std::max(n_b, n_a);
+
+	if (length > _length)  // only the first time (or a longer filter)
+		_allocate(length);
+
+	// normalized by a[0], the shorter one is padded with zeros
+	for (unsigned int i = 0; i < _length; i++)
+	{
+		reinterpret_cast<float*> (&_b[i])[lane] = (i < n_b) ? (float) (b[i] / a[0]) : 0.0f;
+		reinterpret_cast<float*> (&_a[i])[lane] = (i < n_a) ? (float) (a[i] / a[0]) : 0.0f;
+	}
+
+	clear_lane(lane);
+}
+
+void IirBank::set_lane(unsigned int lane, const std::vector<double> &b, const std::vector<double> &a)
+{
+	set_lane(lane, &b[0], b.size(), &a[0], a.size());
+}
+
+void IirBank::clear_lane(unsigned int lane)
+{
+	assert(lane < LANES);
+
+	for (unsigned int i = 0; i < _length; i++)
+		reinterpret_cast<float*> (&_z[i])[lane] = 0.0f;
+}
+
+void IirBank::filter(unsigned int n)
+{
+	assert(n <= _samples);
+
+	if (_length == 0)  // no coefficients yet
+	{
+		memset(_output, 0, n * sizeof(lanes_t));
+		return;
+	}
+
+	const unsigned int order = _length - 1;
+	const lanes_t *b = _b;
+	const lanes_t *a = _a;
+	lanes_t *z = _z;
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		lanes_t x = _input[i];
+		lanes_t y = b[0] * x + z[0];
+
+		for (unsigned int k = 0; k + 1 < order; k++)
+			z[k] = b[k + 1] * x - a[k + 1] * y + z[k + 1];
+
+		if (order > 0)
+			z[order - 1] = b[order] * x - a[order] * y;
+
+		_output[i] = y;
+	}
+}
+
+}  // namespace avrs
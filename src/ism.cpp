@@ -16,55 +16,175 @@
  *
  */
 
+#include <limits>
+#include <queue>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <boost/format.hpp>
 
+#include "utils/math.hpp"
+#include "utils/timercpu.hpp"
+#include "utils/timerwall.hpp"
 #include "ism.hpp"
 
 namespace avrs
 {
 
-Ism::Ism(configuration_t::ptr_t config, const Room::ptr_t &r)
+// Paths of coincident VSs followed by one audibility check after its own path
+// (see _check_audibility_2()), their combinations grow exponentially with the
+// order in shoebox-like rooms
+const unsigned int max_alias_checks = 64;
+
+Ism::Ism(configuration_t::ptr_t config, const Room::ptr_t &r, const SoundSource::ptr_t &source)
 {
 	assert(r.get() != 0);
+	assert(source.get() != 0);
 
 	_config = config;
 	_room = r;
+	_source = source;
 	_count_vs = 0;
+	_count_pruned = 0;
+	_count_masked = 0;
+	_count_merged = 0;
+	_count_expanded = 0;
+	_count_pending = 0;
+	_horizon_ms = -1.0f;
+	_elapsed_ms = 0.0f;
 	_time_ref_ms = 0.0f;
+	_truncated = false;
+	_has_tree = false;
+	_discard_nodes = false;
+	_from_cache = false;
+	_pos_listener = vec3(0.0f, 0.0f, 0.0f);
+	_lists[0].dist_source_listener = 0.0f;
+	_lists[1].dist_source_listener = 0.0f;
+	_lists[0].generation = 0;
+	_lists[1].generation = 0;
+	_front = 0;
+	_readers[0] = 0;
+	_readers[1] = 0;
+	_pos_source_tree = vec3(0.0f, 0.0f, 0.0f);
+	_pos_listener_tree = vec3(0.0f, 0.0f, 0.0f);
+	_source_zone = -1;
+	_times.propagate_ms = 0.0f;
+	_times.flatten_ms = 0.0f;
+	_times.publish_ms = 0.0f;
 }
 
 Ism::~Ism()
 {
 	_aud.clear();
+	_map_vs.clear();
 	tree_vs.clear();
 }
 
 void Ism::calculate(bool discard_nodes)
+{
+	TimerCpu t;
+	_discard_nodes = discard_nodes;
+
+	t.start();
+	_calculate(discard_nodes, _config->listener->get_position_v());
+	t.stop();
+	_times.propagate_ms = t.elapsed_time(millisecond);
+
+	t.start();
+	_flatten();
+	_index_dynamic();
+	t.stop();
+	_times.flatten_ms = t.elapsed_time(millisecond);
+
+	t.start();
+	_publish();
+	t.stop();
+	_times.publish_ms = t.elapsed_time(millisecond);
+}
+
+void Ism::_calculate(bool discard_nodes, const vec3_t &pos_listener)
 {
 	_count_vs = 0;
+	_count_pruned = 0;
+	_count_masked = 0;
+	_count_merged = 0;
+	_count_expanded = 0;
+	_count_pending = 0;
+	_horizon_ms = -1.0f;
+	_elapsed_ms = 0.0f;
+	_map_vs.clear();
+	_set_listener(pos_listener);
+	_pos_tree = pos_listener;
+	_pos_source_tree = to_vec3(_source->pos);
+	_pos_listener_tree = pos_listener;
+	_source_zone = _room->find_zone(to_vec3(_source->pos));
 
 	// create VS from "real" source (order 0)
 	VirtualSource::ptr_t vs(new VirtualSource);
 	vs->id = ++_count_vs; // 1 = "real source"
 	vs->audible = true;
-	vs->pos_R = _config->sound_source->pos;
-	_dist_source_listener = arma::norm(vs->pos_R - _config->listener->get_position(), 2);
+	vs->pos_R = to_vec3(_source->pos);
 	vs->dist_listener = _dist_source_listener;
-	vs->pos_L = vs->pos_R - _config->listener->get_position();
-	_time_ref_ms = (vs->dist_listener / _config->speed_of_sound) * 1000.0f;
+	vs->pos_L = vs->pos_R - _pos_listener;
 	vs->time_abs_ms = _time_ref_ms;
 	vs->time_rel_ms = 0.0f;
+	vs->gain = 1.0f;
+	vs->order = 0;
+	vs->signature = 0;
+	vs->merged = false;
+	vs->dynamic = false;
+	vs->surface_index = 0;
 
 	_calc_vs_orientation(vs);
 
-	// append to top of tree_vs
 	tree_vs.clear();
-	root_tree_vs = tree_vs.insert(tree_vs.begin(), vs);
 	_aud.clear();
+	_reflections.clear();
+	_paths.clear();
+	_truncated = false;
+	_has_tree = (_config->ism_mode == ISM_MODE_TREE && !discard_nodes);
+	_from_cache = false;
+
+	if (_config->ism_lattice && _room->is_shoebox())
+	{
+		// all VSs are audible, only the compact list is kept
+		_reflections.push_back(_make_reflection(vs, 0));
+		_has_tree = false;
+		_propagate_lattice();
+		return;
+	}
+
+	if (_config->ism_mode != ISM_MODE_TREE)
+	{
+		// the direct sound is the first reflection (empty path)
+		_reflections.push_back(_make_reflection(vs, 0));
+
+		if (1 <= _config->max_order)
+		{
+			if (_config->ism_mode == ISM_MODE_BEST_FIRST)
+				_propagate_best_first(vs);
+			else
+				_propagate_stream(vs);
+		}
+
+		return;
+	}
+
+	// append to top of tree_vs
+	root_tree_vs = tree_vs.insert(tree_vs.begin(), vs);
 	_aud.push_back(vs);
 
 	if (1 <= _config->max_order)
 		_propagate(vs, root_tree_vs, 1, discard_nodes);  // propagate first order... and then run recursively
+
+	if (_count_merged > 0)
+		_recheck_merged();
+
+	_export_reflections();
 }
 
 // check only audibility
@@ -131,12 +251,15 @@ void Ism::update_vs_orientations(const orientationangles_t &listener_orientation
 
 unsigned long Ism::get_count_vs()
 {
-	return (unsigned long) (tree_vs.size() - 1);
+	return _count_vs - 1;  // VSs generated (not all of them are kept)
 }
 
 unsigned long Ism::get_count_visible_vs()
 {
-	return (unsigned long) (_aud.size() - 1);
+	const reflectionlist_t &list = acquire_reflections();
+	unsigned long count = list.reflections.size() - 1;
+	release_reflections(list);
+	return count;
 }
 
 unsigned long Ism::get_bytes_vs()
@@ -149,6 +272,46 @@ unsigned long Ism::get_bytes_visible_vs()
 	return ((unsigned long) _aud.size()) * sizeof(VirtualSource);
 }
 
+unsigned long Ism::get_bytes_reflections()
+{
+	const reflectionlist_t &list = acquire_reflections();
+	unsigned long bytes = ((unsigned long) list.reflections.size()) * sizeof(reflection_t)
+			+ ((unsigned long) list.paths.size()) * sizeof(unsigned int);
+	release_reflections(list);
+	return bytes;
+}
+
+unsigned long Ism::get_count_pruned_vs()
+{
+	return _count_pruned;
+}
+
+unsigned long Ism::get_count_masked_vs()
+{
+	return _count_masked;
+}
+
+unsigned long Ism::get_count_merged_vs()
+{
+	return _count_merged;
+}
+
+unsigned long Ism::get_count_expanded_vs()
+{
+	return _count_expanded;
+}
+
+unsigned long Ism::get_count_pending_vs()
+{
+	return _count_pending;
+}
+
+// Relative time of the first candidate not expanded (-1 if there is none)
+float Ism::get_horizon_ms()
+{
+	return _horizon_ms;
+}
+
 void Ism::print_list()
 {
 	_sort_aud();
@@ -189,89 +352,1154 @@ void Ism::print_summary()
 {
 	std::cout << "ISM Order:\t" << _config->max_order << std::endl;
 	std::cout << "ISM Distance:\t"  << _config->max_distance << std::endl;
+	if (_from_cache)
+		std::cout << "Loaded from cache" << std::endl;
+	else if (_config->ism_lattice && _room->is_shoebox())
+		std::cout << "Shoebox room, lattice of VSs" << std::endl;
+
 	std::cout << "Total VSs:\t" << get_count_vs() << std::endl;
 	std::cout << "Total MB:\t" << boost::format("%.3f\n") % (get_bytes_vs() / (1024.0 * 1024.0));
 	std::cout << "Audible VSs:\t" << get_count_visible_vs() << std::endl;
+	std::cout << "Audible MB:\t" << boost::format("%.3f\n") % (get_bytes_reflections() / (1024.0 * 1024.0));
+
+	if (_config->ism_mode == ISM_MODE_BEST_FIRST)
+	{
+		std::cout << "Expanded VSs:\t" << get_count_expanded_vs() << std::endl;
+		std::cout << "Pending VSs:\t" << get_count_pending_vs() << std::endl;
+		std::cout << "Elapsed ms:\t" << boost::format("%.3f\n") % _elapsed_ms;
+
+		if (_truncated)
+			std::cout << "Budget reached, next candidate at " << boost::format("%.3f ms\n") % get_horizon_ms();
+	}
+	else if (_truncated)
+	{
+		std::cout << "Memory budget exceeded, list of audible VSs is incomplete" << std::endl;
+	}
+
+	if (_config->ism_pruning)
+		std::cout << "Pruned VSs:\t" << get_count_pruned_vs() << " (subtrees)" << std::endl;
+
+	if (_config->ism_masking)
+		std::cout << "Masked VSs:\t" << get_count_masked_vs() << std::endl;
+	if (_config->ism_dedup)
+		std::cout << "Merged VSs:\t" << get_count_merged_vs() << std::endl;
+
 	std::cout << std::endl;
 }
 
 float Ism::dist_source_listener()
 {
-	return _dist_source_listener;
+	const reflectionlist_t &list = acquire_reflections();
+	float dist = list.dist_source_listener;
+	release_reflections(list);
+	return dist;
+}
+
+// File name of the cache for the current scene (the key is in the name)
+std::string Ism::cache_filename()
+{
+	return (boost::format("%s/ism_%016llx.cache") % _config->ism_cache_dir
+			% (unsigned long long) _scene_key()).str();
+}
+
+// Loads the compact list of audible VSs. Returns false if the file does not
+// exist or does not match the current scene, in which case the ISM must be
+// calculated.
+bool Ism::load_cache(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(cacheheader_t))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	const cacheheader_t *header = (const cacheheader_t *) data;
+	const size_t size = sizeof(cacheheader_t)
+			+ header->n_reflections * sizeof(cachereflection_t)
+			+ header->n_paths * sizeof(uint32_t);
+
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != CACHE_VERSION
+			|| header->key != _scene_key()
+			|| (size_t) st.st_size != size)
+	{
+		WARNING("ISM cache %s is invalid or out of date", filename.c_str());
+		munmap(data, st.st_size);
+		return false;
+	}
+
+	const cachereflection_t *records = (const cachereflection_t *) (header + 1);
+	const uint32_t *paths = (const uint32_t *) (records + header->n_reflections);
+
+	tree_vs.clear();
+	_aud.clear();
+	_map_vs.clear();
+	_reflections.resize(header->n_reflections);
+	_paths.assign(paths, paths + header->n_paths);
+
+	for (uint32_t i = 0; i < header->n_reflections; i++)
+	{
+		reflection_t &r = _reflections[i];
+		r.pos_R = vec3(records[i].pos_R[X], records[i].pos_R[Y], records[i].pos_R[Z]);
+		r.dist_listener = records[i].dist_listener;
+		r.time_rel_ms = records[i].time_rel_ms;
+		r.gain = records[i].gain;
+		r.order = (unsigned short) records[i].order;
+		r.path = records[i].path;
+	}
+
+	_count_vs = header->count_vs;
+	_dist_source_listener = header->dist_source_listener;
+	_time_ref_ms = header->time_ref_ms;
+	_truncated = (header->truncated != 0);
+	_has_tree = false;
+	_from_cache = true;
+	_pos_listener = _config->listener->get_position_v();
+	_flat = flatvs_t();
+
+	munmap(data, st.st_size);
+	_publish();
+	return true;
+}
+
+// Saves the compact list of audible VSs, the file is written with a temporary
+// name and then renamed (a reader never sees a partial file)
+void Ism::save_cache(const std::string &filename)
+{
+	std::string tmp_filename = filename + ".tmp";
+	FILE *file = fopen(tmp_filename.c_str(), "wb");
+
+	if (!file)
+	{
+		WARNING("Cannot write ISM cache %s", filename.c_str());
+		return;
+	}
+
+	cacheheader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.key = _scene_key();
+	const reflectionlist_t &list = acquire_reflections();
+	const std::vector<reflection_t> &reflections = list.reflections;
+	const std::vector<unsigned int> &paths = list.paths;
+	header.n_reflections = reflections.size();
+	header.n_paths = paths.size();
+	header.count_vs = _count_vs;
+	header.dist_source_listener = list.dist_source_listener;
+	header.time_ref_ms = _time_ref_ms;
+	header.truncated = _truncated ? 1 : 0;
+
+	bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+	for (unsigned long i = 0; ok && i < reflections.size(); i++)
+	{
+		const reflection_t &r = reflections[i];
+		cachereflection_t record;
+		record.pos_R[X] = r.pos_R(X);
+		record.pos_R[Y] = r.pos_R(Y);
+		record.pos_R[Z] = r.pos_R(Z);
+		record.dist_listener = r.dist_listener;
+		record.time_rel_ms = r.time_rel_ms;
+		record.gain = r.gain;
+		record.order = r.order;
+		record.path = r.path;
+		ok = (fwrite(&record, sizeof(record), 1, file) == 1);
+	}
+
+	for (unsigned long i = 0; ok && i < paths.size(); i++)
+	{
+		uint32_t index = paths[i];
+		ok = (fwrite(&index, sizeof(index), 1, file) == 1);
+	}
+
+	release_reflections(list);
+	ok = (fclose(file) == 0) && ok;
+
+	if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0)
+	{
+		WARNING("Cannot write ISM cache %s", filename.c_str());
+		remove(tmp_filename.c_str());
+	}
+}
+
+bool Ism::has_tree() const
+{
+	return _has_tree;
+}
+
+bool Ism::is_from_cache() const
+{
+	return _from_cache;
+}
+
+// Updates the list of audible VSs for a new listener position, without
+// generating the VSs again. The VSs of the tree are checked again (the VSs
+// that were beyond max_distance or below the level floor are not there, so
+// beyond LISTENER_POSITION_MARGIN they are calculated again, as they are
+// without a tree). It runs in a background thread and the result is
+// published when it is complete.
+void Ism::revalidate(const vec3_t &pos_listener)
+{
+	_set_listener(pos_listener);
+	_begin_list();
+
+	if (_config->ism_lattice && _room->is_shoebox())
+	{
+		// the lattice is cheaper than any update
+		_count_vs = 1;
+		_count_pruned = 0;
+		_count_masked = 0;
+		_propagate_lattice();
+	}
+	else if (_flat.size() > 0 && dist(pos_listener, _pos_listener_tree) <= _config->listener_margin)
+	{
+		_emit_flat();
+	}
+	else
+	{
+		// no tree (stream or best-first mode, discarded nodes or a list from
+		// the cache): the audibility at the new position can only be known
+		// by calculating the VSs again. Neither beyond the margin: the tree
+		// lacks the VSs culled at the old position (by the max distance or
+		// the level floor).
+		_calculate(_discard_nodes, pos_listener);
+		_flatten();
+		_index_dynamic();
+	}
+
+	_publish();
+}
+
+// Updates the VSs after the dynamic surface i was moved, added or removed
+// (see Room). Only the subtrees whose path touches the surface are
+// regenerated, the rest of tree_vs is kept. It runs in a background thread
+// and the result is published when it is complete.
+void Ism::update_surface(unsigned int i)
+{
+	vec3_t pos_current = _pos_listener;
+
+	if (!_has_tree)
+	{
+		// without a tree (or its index) everything must be calculated again
+		_calculate(true, pos_current);
+		_flatten();
+		_publish();
+		return;
+	}
+
+	_dynamic_nodes.resize(_room->n_surfaces());
+
+	// the tree is updated with the listener position used to generate it
+	_set_listener(_pos_tree);
+
+	// remove the subtrees (the nested ones are removed with the outer one)
+	const std::vector<tree_vs_t::iterator> &nodes = _dynamic_nodes[i];
+	std::vector<tree_vs_t::iterator> roots;
+	unsigned long k;
+
+	for (k = 0; k < nodes.size(); k++)
+	{
+		bool nested = false;
+
+		for (VirtualSource::ptr_t vs = (*nodes[k])->parent_ptr; vs.get() != NULL && !nested; vs = vs->parent_ptr)
+			nested = (vs->surface_ptr.get() != NULL && vs->surface_index == i);
+
+		if (!nested)
+			roots.push_back(nodes[k]);
+	}
+
+	for (k = 0; k < roots.size(); k++)
+		tree_vs.erase(roots[k]);
+
+	// reflect every VS on the surface again (it is not reached from the
+	// removed subtrees, and the new ones are propagated to the max order)
+	if (_room->get_surface(i)->is_active() && 1 <= _config->max_order)
+	{
+		std::vector<tree_vs_t::iterator> parents;
+
+		for (tree_vs_t::pre_order_iterator it = tree_vs.begin(); it != tree_vs.end(); ++it)
+		{
+			if (static_cast<short>((*it)->order + 1) <= _config->max_order && !(*it)->merged
+					&& _room->is_candidate(_zone(*it), i))
+				parents.push_back(it);
+		}
+
+		for (k = 0; k < parents.size(); k++)
+			_propagate_surface(*parents[k], parents[k], i, (*parents[k])->order + 1, false);
+	}
+
+	// audible VSs
+	_aud.clear();
+
+	for (tree_vs_t::pre_order_iterator it = tree_vs.begin(); it != tree_vs.end(); ++it)
+	{
+		if ((*it)->audible)
+			_aud.push_back(*it);
+	}
+
+	_flatten();
+	_index_dynamic();
+
+	// with occlusion, the surface can also block or unblock paths that are
+	// not reflected on it, so the audibility of all the VSs is checked again
+	// (the BVH of the room was already rebuilt)
+	bool occlusion = (_config->ism_occlusion && !_room->is_convex());
+
+	if (norm2(pos_current - _pos_tree) == 0.0f && !occlusion)
+	{
+		_reflections.clear();
+		_paths.clear();
+		_export_reflections();
+		_publish();
+	}
+	else
+	{
+		revalidate(pos_current);  // the listener has moved since then, or occlusion
+	}
+}
+
+// Updates the VSs for a new source position. The position of a VS is an
+// affine function of the source position (the reflections along its path),
+// so the positions, the validity and the audibility of all the VSs are
+// calculated again over the arrays, without generating the tree. Without
+// the transforms (ISM_MOVING_SOURCE disabled or no tree) the ISM is
+// calculated again.
+//
+// The tree only has the VSs generated at the source position of the last
+// calculation: the invalid ones, those beyond the max distance and the
+// pruned ones are missing, and the merged VSs only coincided there. So the
+// ISM is calculated again when the source goes farther than the margin.
+void Ism::move_source(const vec3_t &pos_source)
+{
+	_source->pos = to_point3(pos_source);
+
+	// the surfaces reached from another zone are not in the tree
+	if (_flat.size() == 0 || _flat.m[0].empty() || _room->find_zone(pos_source) != _source_zone
+			|| dist(pos_source, _pos_source_tree) > _config->source_margin)
+	{
+		_calculate(!_has_tree, _pos_listener);
+		_flatten();
+		_index_dynamic();
+		_publish();
+		return;
+	}
+
+	const long n = (long) _flat.size();
+	long k;
+
+	// positions (plain loop over arrays, it is vectorized)
+	const float *m[9];
+
+	for (k = 0; k < 9; k++)
+		m[k] = &_flat.m[k][0];
+
+	const float *tx = &_flat.t[X][0];
+	const float *ty = &_flat.t[Y][0];
+	const float *tz = &_flat.t[Z][0];
+	float *x = &_flat.x[0];
+	float *y = &_flat.y[0];
+	float *z = &_flat.z[0];
+	const float sx = pos_source.x;
+	const float sy = pos_source.y;
+	const float sz = pos_source.z;
+
+	for (k = 0; k < n; k++)
+	{
+		x[k] = m[0][k] * sx + m[1][k] * sy + m[2][k] * sz + tx[k];
+		y[k] = m[3][k] * sx + m[4][k] * sy + m[5][k] * sz + ty[k];
+		z[k] = m[6][k] * sx + m[7][k] * sy + m[8][k] * sz + tz[k];
+	}
+
+	_validate_flat();
+	_set_listener(_pos_listener);
+	_begin_list();
+	_emit_flat();
+
+	// the tree follows the source (for update_surface())
+	tree_vs_t::pre_order_iterator it;
+
+	for (it = tree_vs.begin(), k = 0; it != tree_vs.end(); ++it, k++)
+	{
+		const VirtualSource::ptr_t &vs = *it;
+		vs->pos_R = vec3(x[k], y[k], z[k]);
+		vs->pos_L = vs->pos_R - _pos_listener;
+		vs->dist_listener = _flat.dist_listener[k];
+		vs->time_abs_ms = (vs->dist_listener / _config->speed_of_sound) * 1000.0f;
+		vs->time_rel_ms = vs->time_abs_ms - _time_ref_ms;
+		vs->audible = (k == 0 || _flat.audible[k]);
+	}
+
+	_pos_tree = _pos_listener;
+	_publish();
+}
+
+// Returns the published list, which is not modified until
+// release_reflections() is called. It never blocks.
+const Ism::reflectionlist_t &Ism::acquire_reflections()
+{
+	int i;
+
+	while (true)
+	{
+		i = _front;
+		__sync_fetch_and_add(&_readers[i], 1);  // full barrier
+
+		if (i == _front)
+			break;
+
+		// a new list was published meanwhile, the writer can reuse this one
+		__sync_fetch_and_sub(&_readers[i], 1);
+	}
+
+	return _lists[i];
+}
+
+void Ism::release_reflections(const reflectionlist_t &list)
+{
+	int i = (int) (&list - _lists);
+	assert(i == 0 || i == 1);
+
+	// full barrier, the list is not read after this
+	__sync_fetch_and_sub(&_readers[i], 1);
+}
+
+void Ism::_set_listener(const vec3_t &pos_listener)
+{
+	_pos_listener = pos_listener;
+	_dist_source_listener = dist(to_vec3(_source->pos), pos_listener);
+	_time_ref_ms = (_dist_source_listener / _config->speed_of_sound) * 1000.0f;
+}
+
+// Clears the working list and appends the direct sound (the first reflection)
+void Ism::_begin_list()
+{
+	_reflections.clear();
+	_paths.clear();
+
+	reflection_t direct;
+	direct.pos_R = to_vec3(_source->pos);
+	direct.dist_listener = _dist_source_listener;
+	direct.time_rel_ms = 0.0f;
+	direct.gain = 1.0f;
+	direct.order = 0;
+	direct.path = 0;
+	_reflections.push_back(direct);
+}
+
+// Index of the nodes of each dynamic surface, for update_surface()
+void Ism::_index_dynamic()
+{
+	_dynamic_nodes.clear();
+
+	if (!_has_tree || !_room->has_dynamic_surfaces())
+		return;
+
+	_dynamic_nodes.resize(_room->n_surfaces());
+
+	for (tree_vs_t::pre_order_iterator it = tree_vs.begin(); it != tree_vs.end(); ++it)
+	{
+		const VirtualSource::ptr_t &vs = *it;
+
+		if (vs->surface_ptr.get() != NULL && vs->surface_ptr->is_dynamic())
+			_dynamic_nodes[vs->surface_index].push_back(it);
+	}
+}
+
+// Moves the working list to the back list and makes it the front one. If the
+// reader still uses the back list (an old front one), waits for it.
+void Ism::_publish()
+{
+	const int back = 1 - _front;
+
+	// the direct sound can be blocked by a surface (e.g. a dynamic one), it
+	// is kept as the reference of the times but it is silent
+	for (unsigned long i = 0; i < _reflections.size(); i++)
+	{
+		if (_reflections[i].order == 0)
+		{
+			_reflections[i].gain = _is_occluded(to_vec3(_source->pos), _pos_listener) ? 0.0f : 1.0f;
+			break;
+		}
+	}
+
+	_sort_reflections();
+
+	// the readers that took the back list before the last publication (an
+	// atomic read, so it is not hoisted out of the loop)
+	while (__sync_fetch_and_add(&_readers[back], 0) > 0)
+		usleep(100);
+
+	reflectionlist_t &list = _lists[back];
+	list.reflections.swap(_reflections);
+	list.paths.swap(_paths);
+	list.surfaces.resize(_room->n_surfaces());
+
+	for (unsigned int i = 0; i < list.surfaces.size(); i++)
+		list.surfaces[i] = _room->get_surface(i);
+
+	list.dist_source_listener = _dist_source_listener;
+	list.generation = _lists[_front].generation + 1;
+	__sync_synchronize();
+	_front = back;
+}
+
+// Sorts the working list by arrival time and copies the paths in the same
+// order, so the renderer reads both arrays sequentially
+void Ism::_sort_reflections()
+{
+	std::stable_sort(_reflections.begin(), _reflections.end(), comparereflectiontime_t());
+
+	std::vector<unsigned int> paths;
+	paths.reserve(_paths.size());
+
+	for (unsigned long i = 0; i < _reflections.size(); i++)
+	{
+		reflection_t &r = _reflections[i];
+		std::vector<unsigned int>::const_iterator first = _paths.begin() + r.path;
+
+		r.path = paths.size();
+		paths.insert(paths.end(), first, first + r.order);
+	}
+
+	_paths.swap(paths);
 }
 
-// Private functions
+// Appends the audible VSs of the array copy to the working list, for the
+// current listener position
+void Ism::_emit_flat()
+{
+	const long n = (long) _flat.size();
+	const float max_distance = _config->max_distance;
+	long k;
+
+	// distances (plain loop over arrays, it is vectorized)
+	float *x = &_flat.x[0];
+	float *y = &_flat.y[0];
+	float *z = &_flat.z[0];
+	float *d = &_flat.dist_listener[0];
+
+	for (k = 0; k < n; k++)
+	{
+		float dx = x[k] - _pos_listener.x;
+		float dy = y[k] - _pos_listener.y;
+		float dz = z[k] - _pos_listener.z;
+		d[k] = sqrtf(dx * dx + dy * dy + dz * dz);
+	}
+
+	_count_masked = 0;
+
+	// audibility (each VS is independent)
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (k = 1; k < n; k++)
+	{
+		bool audible = (_flat.valid[k] && !_flat.merged[k] && _flat.dist_listener[k] <= max_distance);
+
+		if (audible && _config->ism_pruning
+				&& _relative_level_db(_flat.gain[k], _flat.dist_listener[k]) < _config->min_level_db)
+			audible = false;
+
+		_flat.audible[k] = (audible && _flat_check(k, _pos_listener));
+	}
+
+	for (k = 1; k < n; k++)
+	{
+		if (!_flat.audible[k])
+			continue;
+
+		reflection_t r;
+		r.pos_R = vec3(x[k], y[k], z[k]);
+		r.dist_listener = d[k];
+		r.time_rel_ms = (d[k] / _config->speed_of_sound) * 1000.0f - _time_ref_ms;
+		r.gain = _flat.gain[k];
+		r.order = _flat.order[k];
+		r.path = _paths.size();
+
+		if (_is_masked(_relative_level_db(r.gain, r.dist_listener), r.time_rel_ms))
+		{
+			_flat.audible[k] = 0;
+			_count_masked++;
+			continue;
+		}
+
+		_reflections.push_back(r);
+
+		// path of surfaces from the source
+		_paths.resize(_paths.size() + r.order);
+		unsigned long j = _paths.size();
+
+		for (int v = k; _flat.parent[v] >= 0; v = _flat.parent[v])
+			_paths[--j] = _flat.surface_index[v];
+	}
+}
+
+// Validity test of the array copy along each path (a parent is always before
+// its children), the tree keeps the VSs that become invalid when the source
+// is moved
+void Ism::_validate_flat()
+{
+	const long n = (long) _flat.size();
+	_flat.valid[0] = 1;
+
+	for (long k = 1; k < n; k++)
+	{
+		const int p = _flat.parent[k];
+		const Surface *s = _flat.surface[k];
+		vec3_t pos_parent = vec3(_flat.x[p], _flat.y[p], _flat.z[p]);
+		float dist_vs_s = s->get_dist_origin() - dot(pos_parent, s->get_normal_v());
+		_flat.valid[k] = (_flat.valid[p] && dist_vs_s > 0.0f);
+	}
+}
+
+// Copies the tree to arrays, for revalidate() and move_source()
+void Ism::_flatten()
+{
+	_flat = flatvs_t();
+
+	if (!_has_tree)
+		return;
+
+	typedef boost::unordered_map<const VirtualSource *, int> index_map_t;
+	index_map_t index;
+	tree_vs_t::pre_order_iterator it;
+	int k = 0;
+
+	for (it = tree_vs.begin(); it != tree_vs.end(); ++it, k++)
+		index[(*it).get()] = k;
+
+	const unsigned long n = k;
+	_flat.x.resize(n);
+	_flat.y.resize(n);
+	_flat.z.resize(n);
+	_flat.gain.resize(n);
+	_flat.order.resize(n);
+	_flat.parent.resize(n);
+	_flat.next_alias.resize(n);
+	_flat.merged.resize(n);
+	_flat.surface.resize(n);
+	_flat.surface_index.resize(n);
+	_flat.dist_listener.resize(n);
+	_flat.audible.resize(n, 0);
+	_flat.valid.resize(n);
+
+	for (it = tree_vs.begin(), k = 0; it != tree_vs.end(); ++it, k++)
+	{
+		const VirtualSource::ptr_t &vs = *it;
+		_flat.x[k] = vs->pos_R.x;
+		_flat.y[k] = vs->pos_R.y;
+		_flat.z[k] = vs->pos_R.z;
+		_flat.gain[k] = vs->gain;
+		_flat.order[k] = vs->order;
+		_flat.parent[k] = vs->parent_ptr.get() ? index[vs->parent_ptr.get()] : -1;
+		_flat.next_alias[k] = vs->next_alias.get() ? index[vs->next_alias.get()] : -1;
+		_flat.merged[k] = vs->merged;
+		_flat.surface[k] = vs->surface_ptr.get();
+		_flat.surface_index[k] = vs->surface_index;
+	}
+
+	_validate_flat();
+
+	if (!_config->ism_moving_source)
+		return;
+
+	// reflection transforms, pos_R = M pos_source + t (M is row-major). The
+	// reflection on a plane n . p = d is p' = H p + 2 d n, with H = I - 2 n n'
+	for (k = 0; k < 9; k++)
+		_flat.m[k].resize(n);
+
+	for (k = 0; k < 3; k++)
+		_flat.t[k].resize(n);
+
+	for (k = 0; k < 9; k++)
+		_flat.m[k][0] = (k % 4 == 0) ? 1.0f : 0.0f;  // identity for the real source
+
+	_flat.t[X][0] = _flat.t[Y][0] = _flat.t[Z][0] = 0.0f;
+
+	for (unsigned long i = 1; i < n; i++)
+	{
+		const int p = _flat.parent[i];
+		const vec3_t &normal = _flat.surface[i]->get_normal_v();
+		const float d = _flat.surface[i]->get_dist_origin();
+		unsigned int r, c;
+
+		for (c = 0; c < 3; c++)
+		{
+			float n_m = normal.x * _flat.m[c][p] + normal.y * _flat.m[3 + c][p] + normal.z * _flat.m[6 + c][p];
+
+			for (r = 0; r < 3; r++)
+				_flat.m[3 * r + c][i] = _flat.m[3 * r + c][p] - 2.0f * normal(r) * n_m;
+		}
+
+		vec3_t t_p = vec3(_flat.t[X][p], _flat.t[Y][p], _flat.t[Z][p]);
+		vec3_t t = t_p + (2.0f * (d - dot(normal, t_p))) * normal;
+		_flat.t[X][i] = t.x;
+		_flat.t[Y][i] = t.y;
+		_flat.t[Z][i] = t.z;
+	}
+}
 
 // recursive function (depth-first traversal, pre-order)
 void Ism::_propagate(VirtualSource::ptr_t vs_parent, const tree_vs_t::iterator node_parent,
 		const unsigned int order, const bool discard_nodes)
 {
-	// for each surface
-	for (unsigned int i = 0; i < _room->n_surfaces(); i++)
+	// for each surface that can be reached from the zone of the VS
+	const std::vector<unsigned int> &candidates = _room->get_candidates(_zone(vs_parent));
+
+	for (unsigned int k = 0; k < candidates.size(); k++)
+		_propagate_surface(vs_parent, node_parent, candidates[k], order, discard_nodes);
+
+	// the whole progeny is already propagated (audible VSs are kept by _aud)
+	if (discard_nodes)
+		tree_vs.erase_children(node_parent); // release memory
+}
+
+// Reflection of vs_parent on the surface i and its whole progeny
+void Ism::_propagate_surface(VirtualSource::ptr_t vs_parent, const tree_vs_t::iterator node_parent,
+		const unsigned int i, const unsigned int order, const bool discard_nodes)
+{
+	VirtualSource::ptr_t vs_progeny = _reflect(vs_parent, i, order);
+
+	if (vs_progeny.get() == NULL)  // invalid, too far or too weak
+		return;
+
+	// append the progeny VS to the tree_vs (because is not discarded)
+	tree_vs_t::iterator node_progeny = tree_vs.append_child(node_parent, vs_progeny);
+
+	// coincidence test (if it fails, is merged and its subtree is not propagated)
+	if (_config->ism_dedup && !discard_nodes && _merge_coincident(node_progeny))
+		return;
+
+	if (_test_audibility(vs_progeny))
+		_aud.push_back(vs_progeny); // add progeny VS to the vector that contains visible VSs
+
+	// next order
+	if (static_cast<short>(order + 1) <= _config->max_order)
+		_propagate(vs_progeny, node_progeny, order + 1, discard_nodes); // propagate the next order
+}
+
+// Depth-first traversal with an explicit stack (one frame per order), the VSs
+// are released when their subtree is done and only the audible ones are kept
+// (as reflections in the compact list)
+void Ism::_propagate_stream(VirtualSource::ptr_t vs_root)
+{
+	std::vector<frame_t> stack;
+	stack.reserve(_config->max_order + 1);  // never grows
+
+	frame_t frame;
+	frame.vs = vs_root;
+	frame.candidates = &_room->get_candidates(_zone(vs_root));
+	frame.next_surface = 0;
+	stack.push_back(frame);
+
+	unsigned long budget_bytes = (unsigned long) (_config->memory_budget_mb * 1024.0f * 1024.0f);
+
+	while (!stack.empty())
 	{
-		Surface::ptr_t s = _room->get_surface(i);
+		frame_t &top = stack.back();
 
-		// do the reflection
-		// (normal to the surface, already calculated)
+		// the subtree of the VS on top is done
+		if (top.next_surface >= top.candidates->size() || _truncated)
+		{
+			stack.pop_back();  // release the VS
+			continue;
+		}
+
+		unsigned int order = stack.size();
+		VirtualSource::ptr_t vs_parent = top.vs;
+		VirtualSource::ptr_t vs_progeny = _reflect(vs_parent, (*top.candidates)[top.next_surface++], order);
+
+		if (vs_progeny.get() == NULL)  // invalid, too far or too weak
+			continue;
+
+		if (_test_audibility(vs_progeny))
+		{
+			if (budget_bytes > 0 && _reflections.size() * sizeof(reflection_t)
+					+ (_paths.size() + order) * sizeof(unsigned int) + sizeof(reflection_t) > budget_bytes)
+			{
+				WARNING("ISM memory budget exceeded, %lu reflections are kept", (unsigned long) _reflections.size());
+				_truncated = true;
+				continue;
+			}
+
+			// path of surfaces from the source (the frames below the top)
+			reflection_t r = _make_reflection(vs_progeny, _paths.size());
 
-		// distance from virtual source (VS) to surface
-		float dist_vs_s = s->get_dist_origin() - arma::dot(vs_parent->pos_R, s->get_normal());
+			for (unsigned int k = 1; k < stack.size(); k++)
+				_paths.push_back(stack[k].vs->surface_index);
+
+			_paths.push_back(vs_progeny->surface_index);
+			_reflections.push_back(r);
+		}
 
-		// validity test (if VS fails, is discarded)
-		if (dist_vs_s > 0.0f)
+		// next order
+		if (static_cast<short>(order + 1) <= _config->max_order)
 		{
-			// progeny VS position (in Room coordinate system)
-			arma::frowvec3 pos_R = vs_parent->pos_R + 2 * dist_vs_s * s->get_normal();
-			// distance from VS to listener
-			float dist_listener = arma::norm(pos_R - _config->listener->get_position(), 2);
+			frame.vs = vs_progeny;
+			frame.candidates = &_room->get_candidates(_zone(vs_progeny));
+			frame.next_surface = 0;
+			stack.push_back(frame);
+		}
+	}
+}
 
-			// proximity test (if it fails, is discarded)
-			if (dist_listener <= _config->max_distance)
+// Image sources of a shoebox room as an integer lattice (Allen & Berkley).
+// Along each axis, the image n (with parity p) is at (1 - 2p) s + 2 n L and
+// is reflected |n - p| times on the lower wall and |n| times on the upper
+// wall. All of them are valid and audible, so there is no tree and no
+// audibility test.
+void Ism::_propagate_lattice()
+{
+	const roombox_t &box = _room->get_box();
+	const int max_order = (int) _config->max_order;
+	const float max_distance = _config->max_distance;
+	vec3_t pos_source = to_vec3(_source->pos);
+	vec3_t pos_listener = _pos_listener;
+	std::vector<latticeimage_t> images[3];
+	unsigned int k;
+
+	// images along each axis, sorted by order (z is sorted again below)
+	for (k = 0; k < 3; k++)
+	{
+		float length = box.hi[k] - box.lo[k];
+		float s = pos_source(k) - box.lo[k];  // relative to the lower wall
+		float gain_lo = _room->get_surface(box.lo_surface[k])->get_reflection_gain();
+		float gain_hi = _room->get_surface(box.hi_surface[k])->get_reflection_gain();
+
+		for (int order = 0; order <= max_order; order++)
+		{
+			for (int n = -max_order; n <= max_order; n++)
 			{
-				// create the new progeny VS
-				VirtualSource::ptr_t vs_progeny(new VirtualSource);
+				for (int p = 0; p <= 1; p++)
+				{
+					int count_lo = abs(n - p);
+					int count_hi = abs(n);
+
+					if (count_lo + count_hi != order)
+						continue;
+
+					latticeimage_t image;
+					image.coord = (1 - 2 * p) * s + 2 * n * length + box.lo[k];
+					image.delta = image.coord - pos_listener(k);
+
+					if (fabs(image.delta) > max_distance)
+						continue;
+
+					image.count_lo = count_lo;
+					image.count_hi = count_hi;
+					image.order = order;
+					image.gain = pow(gain_lo, count_lo) * pow(gain_hi, count_hi);
+					images[k].push_back(image);
+				}
+			}
+		}
+	}
 
-				// update values for valid VS
-				vs_progeny->pos_R = pos_R;
-				vs_progeny->dist_listener = dist_listener;
-				vs_progeny->time_abs_ms = (vs_progeny->dist_listener / _config->speed_of_sound) * 1000.0f;;
-				vs_progeny->time_rel_ms = vs_progeny->time_abs_ms - _time_ref_ms;
-				vs_progeny->order = order;
-				vs_progeny->surface_ptr = s;
-				vs_progeny->id = ++_count_vs;
+	// images along z sorted by their distance to the listener, the ones
+	// inside the distance budget left by each (x, y) pair are a contiguous
+	// range, so the cost does not grow with the whole lattice
+	std::sort(images[Z].begin(), images[Z].end(), comparelatticedelta_t());
 
-				// calculate the position referenced to listener of progeny VS
-				vs_progeny->pos_L = vs_progeny->pos_R - _config->listener->get_position();
+	const unsigned int n_z = images[Z].size();
+	std::vector<float> delta_z(n_z);
 
-				// calculate the orientation of VS
-				_calc_vs_orientation(vs_progeny);
+	for (k = 0; k < n_z; k++)
+		delta_z[k] = images[Z][k].delta;
 
-				// append the progeny VS to the tree_vs (because is not discarded)
-				tree_vs_t::iterator node_progeny = tree_vs.append_child(node_parent, vs_progeny);
+	const float max_distance2 = max_distance * max_distance;
 
-				// first audibility test
-				bool aud_test_1 = _check_audibility_1(vs_progeny); // audibility 1
-				bool aud_test_2 = true;
+	for (unsigned int ix = 0; ix < images[X].size(); ix++)
+	{
+		const latticeimage_t &img_x = images[X][ix];
+
+		for (unsigned int iy = 0; iy < images[Y].size(); iy++)
+		{
+			const latticeimage_t &img_y = images[Y][iy];
+			const int order_xy = img_x.order + img_y.order;
+
+			if (order_xy > max_order)
+				break;  // sorted by order
 
-				// second audibility test
-				// order greater than 1, first visibility test must be passed
-				if (order > 1 && aud_test_1)
-					aud_test_2 = _check_audibility_2(vs_progeny, node_progeny); // audibility 2
+			const float delta2_xy = img_x.delta * img_x.delta + img_y.delta * img_y.delta;
 
-				vs_progeny->audible = (aud_test_1 && aud_test_2); // reduction of truth table
+			if (delta2_xy > max_distance2)
+				continue;
 
-				if (vs_progeny->audible)
-					_aud.push_back(vs_progeny); // add progeny VS to the vector that contains visible VSs
+			const float reach_z = sqrt(max_distance2 - delta2_xy);
+			unsigned int iz_begin = std::lower_bound(delta_z.begin(), delta_z.end(), -reach_z) - delta_z.begin();
+			unsigned int iz_end = std::upper_bound(delta_z.begin(), delta_z.end(), reach_z) - delta_z.begin();
 
-				// next order
-				if (static_cast<short>(order + 1) <= _config->max_order)
-					_propagate(vs_progeny, node_progeny, order + 1, discard_nodes); // propagate the next order
+			for (unsigned int iz = iz_begin; iz < iz_end; iz++)
+			{
+				const latticeimage_t &img_z = images[Z][iz];
+				const int order = order_xy + img_z.order;
+				const float dist2 = delta2_xy + delta_z[iz] * delta_z[iz];
+
+				// the real source (order 0) is already in the list
+				if (order > max_order || order == 0 || dist2 > max_distance2)
+					continue;
+
+				_count_vs++;
+
+				reflection_t r;
+				r.pos_R = vec3(img_x.coord, img_y.coord, img_z.coord);
+				r.dist_listener = sqrt(dist2);
+				r.time_rel_ms = (r.dist_listener / _config->speed_of_sound) * 1000.0f - _time_ref_ms;
+				r.order = order;
+				r.gain = img_x.gain * img_y.gain * img_z.gain;
+				r.path = _paths.size();
+
+				float level_db = _relative_level_db(r.gain, r.dist_listener);
+
+				if (_config->ism_pruning && level_db < _config->min_level_db)
+				{
+					_count_pruned++;
+					continue;
+				}
+
+				if (_is_masked(level_db, r.time_rel_ms))
+				{
+					_count_masked++;
+					continue;
+				}
+
+				// the order of the reflections does not change the filtering
+				_reflections.push_back(r);
+				const latticeimage_t *img[3] = { &img_x, &img_y, &img_z };
+
+				for (unsigned int axis = 0; axis < 3; axis++)
+				{
+					_paths.insert(_paths.end(), img[axis]->count_lo, box.lo_surface[axis]);
+					_paths.insert(_paths.end(), img[axis]->count_hi, box.hi_surface[axis]);
+				}
 			}
 		}
+	}
+}
 
-		if (discard_nodes)
-			tree_vs.erase_children(node_parent); // release memory
+// Creates the progeny VS of vs_parent through the surface i. Returns a null
+// pointer if the VS is invalid, beyond max_distance or (in convex rooms)
+// below the level floor.
+VirtualSource::ptr_t Ism::_reflect(const VirtualSource::ptr_t &vs_parent,
+		const unsigned int i, const unsigned int order)
+{
+	VirtualSource::ptr_t vs_progeny;
+	Surface::ptr_t s = _room->get_surface(i);
+
+	// a removed surface does not reflect
+	if (!s->is_active())
+		return vs_progeny;
+
+	// do the reflection
+	// (normal to the surface, already calculated)
+
+	// distance from virtual source (VS) to surface
+	float dist_vs_s = s->get_dist_origin() - dot(vs_parent->pos_R, s->get_normal_v());
+
+	// validity test (if VS fails, is discarded)
+	if (dist_vs_s <= 0.0f)
+		return vs_progeny;
+
+	// progeny VS position (in Room coordinate system)
+	vec3_t pos_R = vs_parent->pos_R + (2 * dist_vs_s) * s->get_normal_v();
+	// distance from VS to listener
+	float dist_listener = dist(pos_R, _pos_listener);
+
+	// proximity test (if it fails, is discarded)
+	if (dist_listener > _config->max_distance)
+		return vs_progeny;
+
+	// cumulative gain of the reflection path
+	float gain = vs_parent->gain * s->get_reflection_gain();
+
+	// energy test (if it fails in a convex room, the whole subtree is
+	// discarded): with passive materials the level never grows with the
+	// order, and in convex rooms neither does the distance, so the
+	// descendants of a VS below the floor are below it too. In the other
+	// rooms a descendant can be closer, the VS is propagated and
+	// _test_audibility() rejects it.
+	if (_config->ism_pruning && _room->is_convex()
+			&& _relative_level_db(gain, dist_listener) < _config->min_level_db)
+	{
+		_count_pruned++;
+		return vs_progeny;
+	}
+
+	// create the new progeny VS
+	vs_progeny.reset(new VirtualSource);
+
+	// update values for valid VS
+	vs_progeny->pos_R = pos_R;
+	vs_progeny->dist_listener = dist_listener;
+	vs_progeny->time_abs_ms = (vs_progeny->dist_listener / _config->speed_of_sound) * 1000.0f;;
+	vs_progeny->time_rel_ms = vs_progeny->time_abs_ms - _time_ref_ms;
+	vs_progeny->order = order;
+	vs_progeny->gain = gain;
+	vs_progeny->surface_ptr = s;
+	vs_progeny->surface_index = i;
+	vs_progeny->id = ++_count_vs;
+	vs_progeny->parent_ptr = vs_parent;
+	vs_progeny->merged = false;
+	vs_progeny->dynamic = (vs_parent->dynamic || s->is_dynamic());
+	vs_progeny->signature = vs_parent->signature + _surface_signature(s);
+
+	// calculate the position referenced to listener of progeny VS
+	vs_progeny->pos_L = vs_progeny->pos_R - _pos_listener;
+
+	// calculate the orientation of VS
+	_calc_vs_orientation(vs_progeny);
+
+	return vs_progeny;
+}
+
+// Zone where the VS is reflected (the zone of the source for the real source)
+int Ism::_zone(const VirtualSource::ptr_t &vs) const
+{
+	if (vs->surface_ptr.get() == NULL)
+		return _source_zone;
+
+	return vs->surface_ptr->get_zone();
+}
+
+// Audibility and masking tests of a new VS
+bool Ism::_test_audibility(const VirtualSource::ptr_t &vs)
+{
+	// below the level floor (it is only propagated in non-convex rooms, see
+	// _reflect())
+	if (_config->ism_pruning && _relative_level_db(vs->gain, vs->dist_listener) < _config->min_level_db)
+	{
+		vs->audible = false;
+		return false;
+	}
+
+	// first audibility test
+	bool aud_test_1 = _check_audibility_1(vs); // audibility 1
+	bool aud_test_2 = true;
+
+	// second audibility test
+	// first visibility test must be passed (for order 1 only the segment to the
+	// source is checked)
+	if (aud_test_1)
+	{
+		unsigned int alias_checks = 0;
+		aud_test_2 = _check_audibility_2(vs->parent_ptr, vs->intersection_point, alias_checks); // audibility 2
+	}
+
+	vs->audible = (aud_test_1 && aud_test_2); // reduction of truth table
+
+	// masking test (it is not propagated, later VSs can be out of the window)
+	if (vs->audible && _is_masked(_relative_level_db(vs->gain, vs->dist_listener), vs->time_rel_ms))
+	{
+		vs->audible = false;
+		_count_masked++;
 	}
+
+	return vs->audible;
+}
+
+reflection_t Ism::_make_reflection(const VirtualSource::ptr_t &vs, unsigned long path)
+{
+	reflection_t r;
+	r.pos_R = vs->pos_R;
+	r.dist_listener = vs->dist_listener;
+	r.time_rel_ms = vs->time_rel_ms;
+	r.gain = vs->gain;
+	r.order = vs->order;
+	r.path = path;
+	return r;
+}
+
+// Compact list of the audible VSs found in the tree
+void Ism::_export_reflections()
+{
+	for (aud_it_t it = _aud.begin(); it != _aud.end(); it++)
+		_emit_reflection(*it);
+}
+
+// Appends a VS to the compact list, its path is taken from the ancestors
+void Ism::_emit_reflection(const VirtualSource::ptr_t &vs)
+{
+	_reflections.push_back(_make_reflection(vs, _paths.size()));
+
+	// path of surfaces from the source
+	_paths.resize(_paths.size() + vs->order);
+	unsigned long k = _paths.size();
+
+	for (VirtualSource::ptr_t v = vs; v->parent_ptr.get() != NULL; v = v->parent_ptr)
+		_paths[--k] = v->surface_index;
+}
+
+// Best-first traversal, the candidates are taken in order of arrival time (or
+// level), so when a budget is reached only the least important ones are lost
+void Ism::_propagate_best_first(VirtualSource::ptr_t vs_root)
+{
+	std::priority_queue<VirtualSource::ptr_t, std::vector<VirtualSource::ptr_t>, comparevspriority_t>
+			candidates(comparevspriority_t(_config->ism_priority));
+	candidates.push(vs_root);
+
+	// wall-clock time, the CPU time adds up the threads of the other sources
+	TimerWall t;
+	t.start();
+
+	while (!candidates.empty())
+	{
+		// check the budgets (the timer is read once every few candidates)
+		if (_config->max_vs > 0 && _count_vs >= _config->max_vs)
+		{
+			_truncated = true;
+			break;
+		}
+
+		if (_config->time_budget_ms > 0.0f && (_count_expanded % 16) == 0)
+		{
+			t.stop();
+
+			if (t.elapsed_time(millisecond) >= _config->time_budget_ms)
+			{
+				_truncated = true;
+				break;
+			}
+		}
+
+		VirtualSource::ptr_t vs_parent = candidates.top();
+		candidates.pop();
+		_count_expanded++;
+
+		// the real source is already in the list
+		if (vs_parent->order > 0 && _test_audibility(vs_parent))
+			_emit_reflection(vs_parent);
+
+		// next order
+		if (static_cast<short>(vs_parent->order + 1) > _config->max_order)
+			continue;
+
+		const std::vector<unsigned int> &surfaces = _room->get_candidates(_zone(vs_parent));
+
+		for (unsigned int k = 0; k < surfaces.size(); k++)
+		{
+			VirtualSource::ptr_t vs_progeny = _reflect(vs_parent, surfaces[k], vs_parent->order + 1);
+
+			if (vs_progeny.get() != NULL)  // not invalid, too far or too weak
+				candidates.push(vs_progeny);
+		}
+	}
+
+	t.stop();
+	_elapsed_ms = t.elapsed_time(millisecond);
+	_count_pending = candidates.size();
+	_horizon_ms = candidates.empty() ? -1.0f : candidates.top()->time_rel_ms;
 }
 
 bool Ism::_check_audibility_1(const VirtualSource::ptr_t &vs)
@@ -280,71 +1508,250 @@ bool Ism::_check_audibility_1(const VirtualSource::ptr_t &vs)
 	// see: http://softsurfer.com/Archive/algorithm_0104/algorithm_0104B.htm
 
 	Surface::ptr_t s = vs->surface_ptr;
-	arma::frowvec4 plane_coeff = s->get_plane_coeff();
+	const plane_t &plane = s->get_plane();
+	const vec3_t &pos_listener = _pos_listener;
 	// n . (P1 - P0) where n is the normal of the plane
-	float denom = plane_coeff(0) * vs->pos_L(X)
-			+ plane_coeff(1) * vs->pos_L(Y)
-			+ plane_coeff(2) * vs->pos_L(Z);
+	float denom = dot(plane.n, vs->pos_L);
 
 	// check if line and plane are parallel (value near to zero)
 	if (fabs(denom) <= PRECISION)
 		return false;
 
 	// calculate the parameter for the parametric equation of the line
-	float t = -(plane_coeff(0) * (_config->listener->get_position())(X)
-			+ plane_coeff(1) * (_config->listener->get_position())(Y)
-			+ plane_coeff(2) * (_config->listener->get_position())(Z) + plane_coeff(3)) / denom;
-	vs->intersection_point = _config->listener->get_position() + vs->pos_L * t;  // calculate the intersection point
+	float t = -eval(plane, pos_listener) / denom;
+	vs->intersection_point = pos_listener + vs->pos_L * t;  // calculate the intersection point
 
-	// finally, check if the intersection point is inside of surface
-	return s->is_point_inside(vs->intersection_point);
+	// finally, check if the intersection point is inside of surface (and
+	// that nothing is in the way)
+	return s->is_point_inside(vs->intersection_point) && !_is_occluded(pos_listener, vs->intersection_point);
 }
 
-bool Ism::_check_audibility_2(const VirtualSource::ptr_t &vs, const tree_vs_t::iterator node)
+// Checks the path from a "virtual listener" position back to the real source.
+// A VS merged with coincident VSs can be reached through any of their paths,
+// up to max_alias_checks of them for the whole check (the own path of each
+// VS is always followed).
+bool Ism::_check_audibility_2(const VirtualSource::ptr_t &vs_parent, const vec3_t &pos_vl,
+		unsigned int &alias_checks)
 {
-	// intersection point is our virtual listener position
-	arma::frowvec3 pos_vl = vs->intersection_point; // already calculated in visibility test 1 (position of "virtual listener")
-	// get node of VS parent
-	tree_vs_t::iterator node_parent = tree_vs.parent(node);
+	if (vs_parent->parent_ptr.get() == NULL)  // the real source is reached
+		return !_is_occluded(pos_vl, vs_parent->pos_R);
 
-	while (node_parent != root_tree_vs) // while the parent node is not the root node
+	for (VirtualSource::ptr_t vs = vs_parent; vs.get() != NULL; vs = vs->next_alias)
 	{
-		VirtualSource::ptr_t vs_parent = *node_parent;
-		assert(vs_parent != NULL);
-		Surface::ptr_t s = vs_parent->surface_ptr;  // or _r->get_surface(vs_parent->surface_index);
+		if (vs != vs_parent && ++alias_checks > max_alias_checks)
+			break;
+
+		Surface::ptr_t s = vs->surface_ptr;  // or _r->get_surface(vs->surface_index);
 
 		// check for visibility
-		arma::frowvec3 xyz_vs = vs_parent->pos_R - pos_vl;  // VS position referenced to virtual listener
-		arma::frowvec4 plane_coeff = s->get_plane_coeff();
+		vec3_t xyz_vs = vs->pos_R - pos_vl;  // VS position referenced to virtual listener
+		const plane_t &plane = s->get_plane();
 		// dot product
-		float denom = plane_coeff(0) * xyz_vs(X)
-				+ plane_coeff(1) * xyz_vs(Y)
-				+ plane_coeff(2) * xyz_vs(Z);
+		float denom = dot(plane.n, xyz_vs);
 
 		if (fabs(denom) <= PRECISION)
-			return false;
+			continue;
+
+		float t = -eval(plane, pos_vl) / denom;
+		vec3_t inter_point = pos_vl + xyz_vs * t;
+
+		// the intersection point is the "new" virtual listener position
+		if (s->is_point_inside(inter_point) && !_is_occluded(pos_vl, inter_point)
+				&& _check_audibility_2(vs->parent_ptr, inter_point, alias_checks))
+			return true;
+	}
+
+	return false;
+}
+
+// A segment of a path is blocked by another surface
+bool Ism::_is_occluded(const vec3_t &p0, const vec3_t &p1) const
+{
+	return _config->ism_occlusion && _room->is_occluded(p0, p1);
+}
+
+// Both audibility tests, through the own path of the VS or the path of any
+// coincident VS merged into it
+bool Ism::_check_audibility(const VirtualSource::ptr_t &vs)
+{
+	unsigned int alias_checks = 0;
+
+	for (VirtualSource::ptr_t v = vs; v.get() != NULL; v = v->next_alias)
+	{
+		if (v != vs && ++alias_checks > max_alias_checks)
+			break;
+
+		if (_check_audibility_1(v) && _check_audibility_2(v->parent_ptr, v->intersection_point, alias_checks))
+			return true;
+	}
+
+	return false;
+}
+
+// Both audibility tests of the VS k of the array copy, as
+// _check_audibility() (the VSs merged into it are followed too)
+bool Ism::_flat_check(int k, const vec3_t &pos_listener)
+{
+	unsigned int alias_checks = 0;
 
-		float t = -(plane_coeff(0) * pos_vl(X)
-				+ plane_coeff(1) * pos_vl(Y)
-				+ plane_coeff(2) * pos_vl(Z)
-				+ plane_coeff(3)) / denom;
-		arma::frowvec3 inter_point = pos_vl + xyz_vs * t;
+	for (int v = k; v >= 0; v = _flat.next_alias[v])
+	{
+		if (v != k && ++alias_checks > max_alias_checks)
+			break;
+
+		const Surface *s = _flat.surface[v];
+		const plane_t &plane = s->get_plane();
+		vec3_t pos_L = vec3(_flat.x[v], _flat.y[v], _flat.z[v]) - pos_listener;
+		float denom = dot(plane.n, pos_L);
+
+		if (fabs(denom) <= PRECISION)
+			continue;
 
-		if (!(s->is_point_inside(inter_point)))
-			return false;
+		float t = -eval(plane, pos_listener) / denom;
+		vec3_t inter_point = pos_listener + pos_L * t;
 
-		pos_vl = inter_point; // the "new" virtual listener position
-		node_parent = tree_vs.parent(node_parent); // get node of VS parent
+		if (s->is_point_inside(inter_point) && !_is_occluded(pos_listener, inter_point)
+				&& _flat_check_2(_flat.parent[v], inter_point, alias_checks))
+			return true;
 	}
 
+	return false;
+}
+
+// As _check_audibility_2(), for the array copy
+bool Ism::_flat_check_2(int i_parent, const vec3_t &pos_vl, unsigned int &alias_checks)
+{
+	if (_flat.parent[i_parent] < 0)  // the real source is reached
+		return !_is_occluded(pos_vl, vec3(_flat.x[i_parent], _flat.y[i_parent], _flat.z[i_parent]));
+
+	for (int v = i_parent; v >= 0; v = _flat.next_alias[v])
+	{
+		if (v != i_parent && ++alias_checks > max_alias_checks)
+			break;
+
+		const Surface *s = _flat.surface[v];
+		vec3_t xyz_vs = vec3(_flat.x[v], _flat.y[v], _flat.z[v]) - pos_vl;
+		const plane_t &plane = s->get_plane();
+		float denom = dot(plane.n, xyz_vs);
+
+		if (fabs(denom) <= PRECISION)
+			continue;
+
+		float t = -eval(plane, pos_vl) / denom;
+		vec3_t inter_point = pos_vl + xyz_vs * t;
+
+		if (s->is_point_inside(inter_point) && !_is_occluded(pos_vl, inter_point)
+				&& _flat_check_2(_flat.parent[v], inter_point, alias_checks))
+			return true;
+	}
+
+	return false;
+}
+
+// Hashing of VSs to find coincident ones. Reflection sequences with the same
+// surfaces (in any order) that end at the same position have the same progeny
+// and the same material filtering, so only one of them must be propagated.
+bool Ism::_merge_coincident(const tree_vs_t::iterator node)
+{
+	VirtualSource::ptr_t vs = *node;
+
+	// the subtrees of dynamic surfaces are regenerated, so they are kept apart
+	if (vs->dynamic)
+		return false;
+
+	vskey_t key;
+	key.x = (long) floor(vs->pos_R(X) / _config->dedup_tolerance + 0.5f);
+	key.y = (long) floor(vs->pos_R(Y) / _config->dedup_tolerance + 0.5f);
+	key.z = (long) floor(vs->pos_R(Z) / _config->dedup_tolerance + 0.5f);
+	key.order = vs->order;
+	key.signature = vs->signature;
+
+	std::pair<vs_map_t::iterator, bool> ins = _map_vs.insert(std::make_pair(key, node));
+
+	if (ins.second)  // first VS at this position
+		return false;
+
+	// merge as alias of the first VS (keeps its own node, but not its subtree)
+	tree_vs_t::iterator node_first = ins.first->second;
+	VirtualSource::ptr_t vs_first = *node_first;
+	vs->audible = false;
+	vs->merged = true;
+	vs->next_alias = vs_first->next_alias;
+	vs_first->next_alias = vs;
+	_count_merged++;
+
+	// the new path can make audible the first VS or any of its progeny, they
+	// are checked again once the tree is complete (see _recheck_merged())
 	return true;
 }
 
+// Audibility of the VSs through the paths merged into them or into their
+// ancestors. The subtrees of the VSs with aliases are checked after the whole
+// propagation, in one pass, so a VS is not checked again for each merge.
+void Ism::_recheck_merged()
+{
+	int depth_merged = -1;  // depth of the VS with aliases whose subtree is visited
+
+	for (tree_vs_t::pre_order_iterator it = tree_vs.begin(); it != tree_vs.end(); ++it)
+	{
+		VirtualSource::ptr_t vs = *it;
+		int depth = tree_vs.depth(it);
+
+		if (depth_merged >= 0 && depth <= depth_merged)  // out of the subtree
+			depth_merged = -1;
+
+		if (depth_merged < 0 && vs->next_alias.get() != NULL)
+			depth_merged = depth;
+
+		if (depth_merged < 0 || vs->audible || vs->merged)
+			continue;
+
+		if (_is_masked(_relative_level_db(vs->gain, vs->dist_listener), vs->time_rel_ms))
+			continue;
+
+		if (_check_audibility(vs))
+		{
+			vs->audible = true;
+			_aud.push_back(vs);
+		}
+	}
+}
+
+// Scrambles the id of a surface, the signature of a path is the sum of the
+// values of its surfaces (the same for any order of the reflections)
+uint64_t Ism::_surface_signature(const Surface::ptr_t &s)
+{
+	uint64_t z = (uint64_t) s->get_id() + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Level of a VS relative to the direct sound (in dB), by using the cumulative
+// reflection gain and the 1/r attenuation
+float Ism::_relative_level_db(float gain, float dist_listener)
+{
+	if (gain <= 0.0f)
+		return -std::numeric_limits<float>::infinity();
+
+	return avrs::math::linear2dB((gain * _dist_source_listener) / dist_listener);
+}
+
+// Simple forward masking by the direct sound: a VS arriving inside the masking
+// window is inaudible if its level is under the threshold
+bool Ism::_is_masked(float level_db, float time_rel_ms)
+{
+	if (!_config->ism_masking)
+		return false;
+
+	return (time_rel_ms < _config->masking_time_ms && level_db < _config->masking_threshold_db);
+}
+
 // Coordinates respect to listener (L coordinate system)
 void Ism::_calc_vs_orientation(const VirtualSource::ptr_t &vs)
 {
 	// azimuth calculus
-	vs->pos_L = vs->pos_R - _config->listener->get_position();
+	vs->pos_L = vs->pos_R - _pos_listener;
 	vs->orientation_0.az =
 			-((atan2(vs->pos_L(Y), vs->pos_L(X)) * avrs::math::PIdiv180_inverse) - 90.0f); // in degrees
 
@@ -371,6 +1778,65 @@ void Ism::_calc_vs_orientation(const VirtualSource::ptr_t &vs)
 //			-((atan2(r, vs->ref_listener_pos(Z)) * mathtools::PIdiv180_inverse) - 90.0f); // in degrees
 }
 
+// FNV-1a hash of everything that changes the list of audible VSs
+uint64_t Ism::_scene_key()
+{
+	uint64_t h = 0xcbf29ce484222325ULL;  // offset basis
+
+	// geometry (contents of the DXF file)
+	std::ifstream file(_config->dxf_file.c_str(), std::ios::binary);
+	char buffer[4096];
+
+	while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+		h = _hash_bytes(h, buffer, file.gcount());
+
+	// materials
+	for (unsigned int i = 0; i < _config->b_coeff.size(); i++)
+		h = _hash_bytes(h, &_config->b_coeff[i][0], _config->b_coeff[i].size() * sizeof(double));
+
+	for (unsigned int i = 0; i < _config->a_coeff.size(); i++)
+		h = _hash_bytes(h, &_config->a_coeff[i][0], _config->a_coeff[i].size() * sizeof(double));
+
+	// dynamic surfaces (they are not merged)
+	if (!_config->dynamic_surfaces.empty())
+		h = _hash_bytes(h, &_config->dynamic_surfaces[0],
+				_config->dynamic_surfaces.size() * sizeof(unsigned int));
+
+	// source and listener
+	point3_t pos_source = _source->pos;
+	point3_t pos_listener = _config->listener->get_position();
+	float values[] = {
+			pos_source(X), pos_source(Y), pos_source(Z),
+			pos_listener(X), pos_listener(Y), pos_listener(Z),
+			_config->speed_of_sound, _config->max_distance, (float) _config->max_order,
+			_config->ism_pruning ? _config->min_level_db : 1.0f,
+			_config->ism_masking ? _config->masking_threshold_db : 0.0f,
+			_config->ism_masking ? _config->masking_time_ms : 0.0f,
+			_config->ism_dedup ? _config->dedup_tolerance : 0.0f,
+			(float) _config->ism_mode, _config->memory_budget_mb, (float) _config->ism_priority,
+			_config->time_budget_ms, (float) _config->max_vs,
+			(_config->ism_lattice && _room->is_shoebox()) ? 1.0f : 0.0f,
+			_config->merge_surfaces ? 1.0f : 0.0f,
+			_config->zones ? (float) _config->portal_depth : -1.0f,
+			_config->ism_occlusion ? 1.0f : 0.0f };
+	h = _hash_bytes(h, values, sizeof(values));
+
+	return h;
+}
+
+uint64_t Ism::_hash_bytes(uint64_t h, const void *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;  // FNV prime
+	}
+
+	return h;
+}
+
 void Ism::_sort_aud()
 {
 	std::sort(_aud.begin(), _aud.end(), comparevsdistance_t()); // sort by distance to the listener
@@ -45,6 +45,7 @@ void Listener::set_initial_POV(const orientationangles_t &o, const point3_t &p)
 	 // Initial position
     _pos0 = p;
     _pos = _pos0;
+    _pos_v = to_vec3(_pos);
 }
 
 }  // namespace avrs
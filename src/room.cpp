@@ -16,6 +16,12 @@
  *
  */
 
+#include <algorithm>
+#include <iostream>
+#include <cfloat>
+#include <map>
+#include <boost/make_shared.hpp>
+
 #include "avrsexception.hpp"
 #include "room.hpp"
 
@@ -28,9 +34,29 @@ Room::Room(configuration_t::ptr_t config)
 	_volume = _config->volume;
 	_area = 0.0f;
 	_new_surface = true;
+	_convex = false;
+	_shoebox = false;
+	_dynamic = false;
+	_next_id = 1;
 	load_dxf();
 }
 
+// Room from surfaces generated by the program (e.g. synthetic rooms of the
+// benchmarks), the materials are taken from the configuration as well
+Room::Room(configuration_t::ptr_t config, const std::vector<Surface::ptr_t> &surfaces)
+{
+	_config = config;
+	_volume = _config->volume;
+	_area = 0.0f;
+	_new_surface = true;
+	_convex = false;
+	_shoebox = false;
+	_dynamic = false;
+	_next_id = 1;
+	_surfaces = surfaces;
+	_init_surfaces(std::vector<std::string>(surfaces.size()));  // no layers
+}
+
 Room::~Room()
 {
 	;
@@ -46,9 +72,55 @@ void Room::load_dxf()
 		throw AvrsException("Error loading DXF file");
 
 	_surfaces = reader->get_surfaces();
+	_init_surfaces(reader->get_layers());
+}
+
+// Materials, dynamic surfaces, zones and merging, in the order of the DXF file
+void Room::_init_surfaces(const std::vector<std::string> &layers)
+{
+	_assign_materials();
+
+	// dynamic surfaces (they are not merged), the DXF order is also the order
+	// of the ids
+	for (unsigned int i = 0; i < _config->dynamic_surfaces.size(); i++)
+	{
+		unsigned int index = _config->dynamic_surfaces[i];
+
+		if (index >= _surfaces.size())
+			throw AvrsException("Error in configuration file: ROOM_DYNAMIC_SURFACES is out of range");
+
+		_surfaces[index]->set_dynamic(true);
+		_dynamic = true;
+	}
+
+	if (_config->zones)
+		_init_zones(layers);
+
+	if (_config->merge_surfaces)
+	{
+		unsigned int n_surfaces = _surfaces.size();
+		_merge_coplanar();
+		std::cout << "Coplanar surfaces merged: " << n_surfaces << " -> " << _surfaces.size() << std::endl;
+	}
+
+	_index_surfaces();
 	_update_data();
 }
 
+// Index of the surfaces by id, after the portals were removed and the
+// surfaces merged (a merged surface keeps the smallest id)
+void Room::_index_surfaces()
+{
+	_ids.clear();
+
+	for (unsigned int i = 0; i < _surfaces.size(); i++)
+	{
+		unsigned int id = _surfaces[i]->get_id();
+		_ids[id] = i;
+		_next_id = std::max(_next_id, id + 1);
+	}
+}
+
 float Room::total_area() const
 {
 	return _area;
@@ -64,10 +136,60 @@ unsigned int Room::n_surfaces() const
 	return (unsigned int) _surfaces.size();
 }
 
-void Room::add_surface(Surface::ptr_t s)
+// Index of the surface with the given id, or -1 if there is none (e.g. it was
+// merged into another one)
+int Room::find_surface(unsigned int id) const
+{
+	std::map<unsigned int, unsigned int>::const_iterator it = _ids.find(id);
+	return (it != _ids.end()) ? (int) it->second : -1;
+}
+
+// Id for a surface that will be added (it is not used by any other one)
+unsigned int Room::new_surface_id()
+{
+	return _next_id++;
+}
+
+// The new surface is dynamic, it is added at the end so the indexes of the
+// others do not change
+void Room::add_surface(Surface::ptr_t s, unsigned int id)
 {
+	if (_ids.find(id) != _ids.end())
+		throw AvrsException("The id of the new surface is already used");
+
+	s->set_id(id);
+	s->set_dynamic(true);
 	_surfaces.push_back(s);
+	_ids[id] = _surfaces.size() - 1;
+	_next_id = std::max(_next_id, id + 1);
+	_dynamic = true;
+	_new_surface = true;
+	_update_data();
+}
+
+void Room::move_surface(unsigned int id, const vec3_t &offset)
+{
+	int i = find_surface(id);
+
+	if (i < 0 || !_surfaces[i]->is_dynamic())
+		throw AvrsException("Only dynamic surfaces can be moved");
+
+	_surfaces[i]->translate(offset);
+	_new_surface = true;
+	_update_data();
+}
+
+// The surface is kept as inactive (it does not reflect)
+void Room::remove_surface(unsigned int id)
+{
+	int i = find_surface(id);
+
+	if (i < 0 || !_surfaces[i]->is_dynamic())
+		throw AvrsException("Only dynamic surfaces can be removed");
+
+	_surfaces[i]->set_active(false);
 	_new_surface = true;
+	_update_data();
 }
 
 Surface::ptr_t Room::get_surface(int i)
@@ -75,29 +197,474 @@ Surface::ptr_t Room::get_surface(int i)
 	return _surfaces[i];
 }
 
+// Zone whose bounding box contains the point (the smallest one if they overlap),
+// or -1 if there is none
+int Room::find_zone(const vec3_t &point) const
+{
+	const float tolerance = 1E-3f;  // in meters
+	int zone = -1;
+	float min_volume = FLT_MAX;
+
+	for (unsigned int z = 0; z < _zones.size(); z++)
+	{
+		const zone_t &zn = _zones[z];
+		bool inside = true;
+
+		for (unsigned int k = 0; k < 3 && inside; k++)
+			inside = (point(k) >= zn.lo[k] - tolerance && point(k) <= zn.hi[k] + tolerance);
+
+		if (!inside)
+			continue;
+
+		float volume = (zn.hi[X] - zn.lo[X]) * (zn.hi[Y] - zn.lo[Y]) * (zn.hi[Z] - zn.lo[Z]);
+
+		if (volume < min_volume)
+		{
+			min_volume = volume;
+			zone = (int) z;
+		}
+	}
+
+	return zone;
+}
+
 // Private functions
 
-// Update room area and filter coefficients for each surface
+// Update room area and shape
 void Room::_update_data()
 {
 	if (_new_surface)
 	{
 		_update_area();
+		_update_shape();
+		_update_zones();
+
+		// a path cannot be blocked inside a convex room
+		if (_convex)
+			_bvh.reset();
+		else
+			_bvh = Bvh::create(_surfaces);
 
-		#pragma omp parallel for
-		for (unsigned int i = 0; i < _surfaces.size(); i++)
+		_new_surface = false;
+	}
+}
+
+// Candidate surfaces of each zone: the ones of the zones that can be reached
+// crossing up to portal_depth portals, and the ones that are not in a zone
+void Room::_update_zones()
+{
+	const unsigned int n = _surfaces.size();
+	const unsigned int n_zones = _zones.size();
+	unsigned int i, z, k;
+
+	_all_surfaces.resize(n);
+
+	for (i = 0; i < n; i++)
+		_all_surfaces[i] = i;
+
+	for (z = 0; z < n_zones; z++)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			_zones[z].lo[k] = FLT_MAX;
+			_zones[z].hi[k] = -FLT_MAX;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		int zone = _surfaces[i]->get_zone();
+
+		if (zone < 0)
+			continue;
+
+		const arma::fmat &vert = _surfaces[i]->get_vertices();
+
+		for (unsigned int v = 0; v < vert.n_rows; v++)
+		{
+			for (k = 0; k < 3; k++)
+			{
+				_zones[zone].lo[k] = std::min(_zones[zone].lo[k], vert(v, k));
+				_zones[zone].hi[k] = std::max(_zones[zone].hi[k], vert(v, k));
+			}
+		}
+	}
+
+	for (z = 0; z < n_zones; z++)
+	{
+		// breadth-first search through the portals
+		std::vector<int> hops(n_zones, -1);
+		std::vector<unsigned int> frontier(1, z);
+		hops[z] = 0;
+
+		for (unsigned int depth = 1; depth <= _config->portal_depth && !frontier.empty(); depth++)
 		{
-			Surface::ptr_t s = _surfaces[i];
+			std::vector<unsigned int> next;
+
+			for (unsigned int f = 0; f < frontier.size(); f++)
+			{
+				const std::vector<unsigned int> &adjacent = _zones[frontier[f]].adjacent;
 
-			if (_config->b_coeff.size() > 0)
-				s->set_b_filter_coeff(_config->b_coeff[i]);
+				for (unsigned int a = 0; a < adjacent.size(); a++)
+				{
+					if (hops[adjacent[a]] < 0)
+					{
+						hops[adjacent[a]] = depth;
+						next.push_back(adjacent[a]);
+					}
+				}
+			}
 
-			if (_config->a_coeff.size() > 0)
-				s->set_a_filter_coeff(_config->a_coeff[i]);
+			frontier.swap(next);
 		}
 
-		_new_surface = false;
+		zone_t &zn = _zones[z];
+		zn.candidates.clear();
+		zn.mask.assign(n, 0);
+
+		for (i = 0; i < n; i++)
+		{
+			int zone = _surfaces[i]->get_zone();
+
+			if (zone < 0 || hops[zone] >= 0)
+			{
+				zn.candidates.push_back(i);
+				zn.mask[i] = 1;
+			}
+		}
+	}
+}
+
+// Assigns the surfaces to the zones of their layers and removes the portals
+// (they are openings, not reflecting surfaces)
+void Room::_init_zones(const std::vector<std::string> &layers)
+{
+	const std::string zone_prefix(ZONE_LAYER_PREFIX);
+	const std::string portal_prefix(PORTAL_LAYER_PREFIX);
+	std::vector<Surface::ptr_t> surfaces;
+	std::vector<std::string> portals;
+	unsigned int i;
+
+	for (i = 0; i < _surfaces.size(); i++)
+	{
+		const std::string &layer = layers[i];
+
+		if (layer.compare(0, portal_prefix.size(), portal_prefix) == 0)
+		{
+			portals.push_back(layer.substr(portal_prefix.size()));
+			continue;
+		}
+
+		if (layer.compare(0, zone_prefix.size(), zone_prefix) == 0)
+		{
+			std::string name = layer.substr(zone_prefix.size());
+			int zone = _zone_index(name);
+
+			if (zone < 0)
+			{
+				zone_t zn;
+				zn.name = name;
+				_zones.push_back(zn);
+				zone = _zones.size() - 1;
+			}
+
+			_surfaces[i]->set_zone(zone);
+		}
+
+		surfaces.push_back(_surfaces[i]);
+	}
+
+	_surfaces = surfaces;
+
+	// the names of the zones can have underscores, try each split of <name1>_<name2>
+	for (i = 0; i < portals.size(); i++)
+	{
+		const std::string &name = portals[i];
+		bool connected = false;
+
+		for (size_t p = name.find('_'); p != std::string::npos && !connected; p = name.find('_', p + 1))
+		{
+			int a = _zone_index(name.substr(0, p));
+			int b = _zone_index(name.substr(p + 1));
+
+			if (a < 0 || b < 0 || a == b)
+				continue;
+
+			std::vector<unsigned int> &adj_a = _zones[a].adjacent;
+			std::vector<unsigned int> &adj_b = _zones[b].adjacent;
+
+			if (std::find(adj_a.begin(), adj_a.end(), (unsigned int) b) == adj_a.end())
+			{
+				adj_a.push_back(b);
+				adj_b.push_back(a);
+			}
+
+			connected = true;
+		}
+
+		if (!connected)
+			WARNING("Portal %s%s does not connect two zones", PORTAL_LAYER_PREFIX, name.c_str());
 	}
+
+	std::cout << "Zones: " << _zones.size() << ", portals: " << portals.size() << std::endl;
+}
+
+int Room::_zone_index(const std::string &name) const
+{
+	for (unsigned int z = 0; z < _zones.size(); z++)
+	{
+		if (_zones[z].name == name)
+			return (int) z;
+	}
+
+	return -1;
+}
+
+// Material filter coefficients for each surface (in the order of the DXF file)
+void Room::_assign_materials()
+{
+	#pragma omp parallel for
+	for (unsigned int i = 0; i < _surfaces.size(); i++)
+	{
+		Surface::ptr_t s = _surfaces[i];
+
+		if (_config->b_coeff.size() > 0)
+			s->set_b_filter_coeff(_config->b_coeff[i]);
+
+		if (_config->a_coeff.size() > 0)
+			s->set_a_filter_coeff(_config->a_coeff[i]);
+	}
+}
+
+// Merges adjacent coplanar surfaces with the same material while their union
+// is still a convex polygon (e.g. walls modeled as tiles), the cost of the ISM
+// grows as n_surfaces^order. The adjacent surfaces are found through a map of
+// their edges, and a merged surface goes back to the worklist to try the
+// neighbours of its new edges.
+void Room::_merge_coplanar()
+{
+	const float cell = 1E-3f;  // vertices closer than this are the same
+	typedef std::map<edgekey_t, std::vector<unsigned int> > edge_map_t;
+	edge_map_t edges;
+	std::vector<Surface::ptr_t> work = _surfaces;  // null when merged into another one
+	std::vector<unsigned int> pending;
+	unsigned int i, k;
+
+	for (i = 0; i < work.size(); i++)
+	{
+		if (work[i]->is_dynamic())
+			continue;
+
+		pending.push_back(i);
+
+		for (k = 0; k < work[i]->get_vertices().n_rows; k++)
+			edges[_edge_key(work[i], k, cell)].push_back(i);
+	}
+
+	while (!pending.empty())
+	{
+		i = pending.back();
+		pending.pop_back();
+
+		if (work[i].get() == NULL)
+			continue;
+
+		bool merged = false;
+		const unsigned int n_v = work[i]->get_vertices().n_rows;
+
+		for (k = 0; k < n_v && !merged; k++)
+		{
+			edge_map_t::const_iterator it = edges.find(_edge_key(work[i], k, cell));
+
+			if (it == edges.end())
+				continue;
+
+			for (unsigned int l = 0; l < it->second.size() && !merged; l++)
+			{
+				unsigned int j = it->second[l];
+
+				if (j == i || work[j].get() == NULL)
+					continue;
+
+				Surface::ptr_t s = _merge_surfaces(work[i], work[j]);
+
+				if (s.get() == NULL)
+					continue;
+
+				// the old edges of i are left in the map, _merge_surfaces()
+				// rejects them if they are not shared anymore
+				work[i] = s;
+				work[j].reset();
+				merged = true;
+			}
+		}
+
+		if (merged)
+		{
+			for (k = 0; k < work[i]->get_vertices().n_rows; k++)
+				edges[_edge_key(work[i], k, cell)].push_back(i);
+
+			pending.push_back(i);
+		}
+	}
+
+	// the surfaces keep the order of the file
+	_surfaces.clear();
+
+	for (i = 0; i < work.size(); i++)
+	{
+		if (work[i].get() != NULL)
+			_surfaces.push_back(work[i]);
+	}
+}
+
+// Key of the edge k of a surface (from vertex k to k + 1), the same for both
+// directions, with the vertices rounded to cells
+Room::edgekey_t Room::_edge_key(const Surface::ptr_t &s, unsigned int k, float cell)
+{
+	const arma::fmat &v = s->get_vertices();
+	long a[3], b[3];
+
+	for (unsigned int c = 0; c < 3; c++)
+	{
+		a[c] = (long) floor(v(k, c) / cell + 0.5f);
+		b[c] = (long) floor(v((k + 1) % v.n_rows, c) / cell + 0.5f);
+	}
+
+	edgekey_t key;
+
+	if (std::lexicographical_compare(a, a + 3, b, b + 3))
+	{
+		std::copy(a, a + 3, key.v);
+		std::copy(b, b + 3, key.v + 3);
+	}
+	else
+	{
+		std::copy(b, b + 3, key.v);
+		std::copy(a, a + 3, key.v + 3);
+	}
+
+	return key;
+}
+
+// Returns the union of two surfaces, or a null pointer if they cannot be merged
+Surface::ptr_t Room::_merge_surfaces(const Surface::ptr_t &s1, const Surface::ptr_t &s2)
+{
+	const float tolerance = 1E-4f;
+	Surface::ptr_t s;
+
+	// same zone
+	if (s1->get_zone() != s2->get_zone())
+		return s;
+
+	// same material
+	if (s1->get_b_filter_coeff() != s2->get_b_filter_coeff() ||
+			s1->get_a_filter_coeff() != s2->get_a_filter_coeff())
+		return s;
+
+	// coplanar
+	point3_t n1 = s1->get_normal();
+	point3_t n2 = s2->get_normal();
+	const arma::fmat &v1 = s1->get_vertices();
+	const arma::fmat &v2 = s2->get_vertices();
+	point3_t p1 = v1.row(0);
+	point3_t p2 = v2.row(0);
+
+	if (fabs(fabs(arma::dot(n1, n2)) - 1.0f) > tolerance || fabs(arma::dot(n1, p2 - p1)) > tolerance)
+		return s;
+
+	// shared edge (in opposite direction if the vertices have the same winding)
+	const unsigned int n_v1 = v1.n_rows;
+	const unsigned int n_v2 = v2.n_rows;
+
+	for (unsigned int a = 0; a < n_v1; a++)
+	{
+		point3_t a0 = v1.row(a);
+		point3_t a1 = v1.row((a + 1) % n_v1);
+
+		if (arma::norm(a1 - a0, 2) <= tolerance)
+			continue;  // degenerate edge (triangle)
+
+		for (unsigned int b = 0; b < n_v2; b++)
+		{
+			point3_t b0 = v2.row(b);
+			point3_t b1 = v2.row((b + 1) % n_v2);
+			bool opposite = (arma::norm(b0 - a1, 2) <= tolerance && arma::norm(b1 - a0, 2) <= tolerance);
+			bool same = (arma::norm(b0 - a0, 2) <= tolerance && arma::norm(b1 - a1, 2) <= tolerance);
+
+			if (!opposite && !same)
+				continue;
+
+			// boundary of the union: s1 from the end of the edge around to its
+			// start, then the vertices of s2 that are not in the edge
+			std::vector<point3_t> poly;
+
+			for (unsigned int k = 1; k <= n_v1; k++)
+				poly.push_back(v1.row((a + k) % n_v1));
+
+			for (unsigned int k = 1; k + 1 < n_v2; k++)
+			{
+				if (opposite)
+					poly.push_back(v2.row((b + 1 + k) % n_v2));
+				else
+					poly.push_back(v2.row((b + n_v2 - k) % n_v2));
+			}
+
+			// remove repeated and collinear vertices
+			bool removed = true;
+
+			while (removed && poly.size() > 3)
+			{
+				removed = false;
+
+				for (unsigned int k = 0; k < poly.size(); k++)
+				{
+					point3_t prev = poly[(k + poly.size() - 1) % poly.size()];
+					point3_t next = poly[(k + 1) % poly.size()];
+
+					if (arma::norm(arma::cross(poly[k] - prev, next - poly[k]), 2) <= tolerance)
+					{
+						poly.erase(poly.begin() + k);
+						removed = true;
+						break;
+					}
+				}
+			}
+
+			// the union must be convex (all the turns in the direction of the normal)
+			for (unsigned int k = 0; k < poly.size(); k++)
+			{
+				point3_t e0 = poly[(k + 1) % poly.size()] - poly[k];
+				point3_t e1 = poly[(k + 2) % poly.size()] - poly[(k + 1) % poly.size()];
+
+				if (arma::dot(arma::cross(e0, e1), n1) * arma::dot(arma::cross(poly[1] - poly[0], poly[2] - poly[1]), n1) < 0.0f)
+					return s;
+			}
+
+			const unsigned int n_vert = poly.size();
+			std::vector<double> x(n_vert), y(n_vert), z(n_vert);
+
+			for (unsigned int k = 0; k < n_vert; k++)
+			{
+				x[k] = poly[k](X);
+				y[k] = poly[k](Y);
+				z[k] = poly[k](Z);
+			}
+
+			s = boost::make_shared<Surface>(std::min(s1->get_id(), s2->get_id()), &x[0], &y[0], &z[0], (int) n_vert);
+
+			// the union must not overlap or leave holes
+			if (fabs(s->get_area() - (s1->get_area() + s2->get_area())) > tolerance * (s1->get_area() + s2->get_area()))
+				return Surface::ptr_t();
+
+			s->set_b_filter_coeff(s1->get_b_filter_coeff());
+			s->set_a_filter_coeff(s1->get_a_filter_coeff());
+			s->set_zone(s1->get_zone());
+			return s;
+		}
+	}
+
+	return s;
 }
 
 void Room::_update_area()
@@ -107,8 +674,123 @@ void Room::_update_area()
 	for (unsigned int i = 0; i < _surfaces.size(); i++)
 	{
 		Surface::ptr_t s = _surfaces[i];
-		_area += s->get_area(); // sum areas of all surfaces
+
+		if (s->is_active())
+			_area += s->get_area(); // sum areas of all surfaces
+	}
+}
+
+// Detects convex and shoebox rooms (the ISM has fast paths for them)
+void Room::_update_shape()
+{
+	const float tolerance = 1E-3f;  // in meters
+	unsigned int i, j, k;
+
+	// the shape of a room with dynamic surfaces can change
+	_convex = (_surfaces.size() >= 4 && !_dynamic);
+	_shoebox = false;
+
+	// convex: all the vertices are on the same side of each surface
+	for (i = 0; i < _surfaces.size() && _convex; i++)
+	{
+		point3_t n = _surfaces[i]->get_normal();
+		point3_t p0 = _surfaces[i]->get_vertices().row(0);
+		int side = 0;
+
+		for (j = 0; j < _surfaces.size() && _convex; j++)
+		{
+			const arma::fmat &vert = _surfaces[j]->get_vertices();
+
+			for (k = 0; k < vert.n_rows; k++)
+			{
+				point3_t v = vert.row(k);
+				float d = arma::dot(n, v - p0);
+
+				if (fabs(d) <= tolerance)
+					continue;
+
+				if (side == 0)
+					side = (d > 0.0f) ? 1 : -1;
+				else if ((d > 0.0f) != (side > 0))
+				{
+					_convex = false;
+					break;
+				}
+			}
+		}
 	}
+
+	// shoebox: convex with one wall at each side of the bounding box
+	if (!_convex || _surfaces.size() != 6)
+		return;
+
+	int n_lo[3] = { 0, 0, 0 };
+	int n_hi[3] = { 0, 0, 0 };
+	arma::frowvec3 lo = arma::min(_surfaces[0]->get_vertices(), 0);
+	arma::frowvec3 hi = arma::max(_surfaces[0]->get_vertices(), 0);
+
+	for (i = 1; i < _surfaces.size(); i++)
+	{
+		arma::frowvec3 vert_min = arma::min(_surfaces[i]->get_vertices(), 0);
+		arma::frowvec3 vert_max = arma::max(_surfaces[i]->get_vertices(), 0);
+
+		for (k = 0; k < 3; k++)
+		{
+			lo(k) = std::min(lo(k), vert_min(k));
+			hi(k) = std::max(hi(k), vert_max(k));
+		}
+	}
+
+	for (k = 0; k < 3; k++)
+	{
+		_box.lo[k] = lo(k);
+		_box.hi[k] = hi(k);
+	}
+
+	for (i = 0; i < _surfaces.size(); i++)
+	{
+		point3_t n = _surfaces[i]->get_normal();
+		unsigned int axis = 0;
+
+		for (k = 1; k < 3; k++)
+		{
+			if (fabs(n(k)) > fabs(n(axis)))
+				axis = k;
+		}
+
+		if (fabs(fabs(n(axis)) - 1.0f) > tolerance)
+			return;  // not axis-aligned
+
+		float coord = _surfaces[i]->get_vertices()(0, axis);
+		float side_a = hi((axis + 1) % 3) - lo((axis + 1) % 3);
+		float side_b = hi((axis + 2) % 3) - lo((axis + 2) % 3);
+
+		if (fabs(_surfaces[i]->get_area() - side_a * side_b) > tolerance * (side_a + side_b))
+			return;  // the wall does not cover the side of the box
+
+		if (fabs(coord - lo(axis)) <= tolerance)
+		{
+			_box.lo_surface[axis] = i;
+			n_lo[axis]++;
+		}
+		else if (fabs(coord - hi(axis)) <= tolerance)
+		{
+			_box.hi_surface[axis] = i;
+			n_hi[axis]++;
+		}
+		else
+		{
+			return;
+		}
+	}
+
+	for (k = 0; k < 3; k++)
+	{
+		if (n_lo[k] != 1 || n_hi[k] != 1)
+			return;
+	}
+
+	_shoebox = true;
 }
 
 }  // namespace avrs
@@ -48,6 +48,9 @@ bool SoundSource::_init()
 	stk::FileWvIn in_wv(1000000, 1024);
 	bool retval = true;
 
+	if (_filename.empty())
+		return true;  // point source without directivity (no IR)
+
 	try {
 		in_wv.openFile(_filename, false, true);
 
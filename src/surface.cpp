@@ -17,8 +17,11 @@
  */
 
 #include "surface.hpp"
+#include "utils/math.hpp"
 
 #include <cassert>
+#include <cfloat>
+#include <algorithm>
 
 namespace avrs
 {
@@ -26,10 +29,13 @@ namespace avrs
 Surface::Surface(unsigned int id, const float *x_vert, const float *y_vert,
 		const float *z_vert, int n_vert)
 {
-	assert(n_vert == 4);  // restricted to 4 vertices
+	assert(n_vert >= 3);  // any simple polygon
 
 	_id = id;
-	_vert.set_size(4, 3);
+	_dynamic = false;
+	_active = true;
+	_zone = -1;
+	_vert.set_size(n_vert, 3);
 
 	for (arma::u32 i = 0; i < (arma::u32) n_vert; i++)
 	{
@@ -44,10 +50,13 @@ Surface::Surface(unsigned int id, const float *x_vert, const float *y_vert,
 Surface::Surface(unsigned int id, const double *x_vert, const double *y_vert,
 		const double *z_vert, int n_vert)
 {
-	assert(n_vert == 4);  // restricted to 4 vertices for now
+	assert(n_vert >= 3);  // any simple polygon
 
 	_id = id;
-	_vert.set_size(4, 3);
+	_dynamic = false;
+	_active = true;
+	_zone = -1;
+	_vert.set_size(n_vert, 3);
 
 	for (arma::u32 i = 0; i < (arma::u32) n_vert; i++)
 	{
@@ -64,6 +73,19 @@ Surface::~Surface()
 	;
 }
 
+// Moves the surface, the material is kept
+void Surface::translate(const avrs::vec3_t &offset)
+{
+	for (arma::u32 i = 0; i < _vert.n_rows; i++)
+	{
+		_vert(i,X) += offset.x;
+		_vert(i,Y) += offset.y;
+		_vert(i,Z) += offset.z;
+	}
+
+	_init();
+}
+
 #ifdef BORISH
 
 /**
@@ -71,8 +93,9 @@ Surface::~Surface()
  * "Extension of the image model to arbitrary polyhedra".
  * Jeffrey Borish, J. Acoust. Soc. Am. 75, 1827 (1984), DOI:10.1121/1.390983
  */
-bool Surface::is_point_inside(arma::frowvec3 point)
+bool Surface::is_point_inside(const avrs::vec3_t &point_v) const
 {
+	point3_t point = to_point3(point_v);
 	static arma::frowvec3 dir_cos;
 	static arma::frowvec3 dir_cos_ref;
 	static arma::frowvec3 v1;
@@ -80,7 +103,7 @@ bool Surface::is_point_inside(arma::frowvec3 point)
 	static arma::frowvec3 c;
 
 	// test for first vertex
-	v1 = _vert.row(3) - point;
+	v1 = _vert.row(_vert.n_rows - 1) - point;
 	v2 = _vert.row(0) - point;
 	c = cross(v1, v2);
 
@@ -113,75 +136,206 @@ bool Surface::is_point_inside(arma::frowvec3 point)
 
 #else
 
-bool Surface::is_point_inside(arma::frowvec3 point)
+// Bounding box reject, then the edge functions of each convex piece (the
+// loop over the edges has no branches)
+bool Surface::is_point_inside(const avrs::vec3_t &point) const
 {
-	// projection to 2D
-	arma::frowvec2 p = _project_to_2d(point);
-	float testx = p(X);
-	float testy = p(Y);
-	int nvert = _vert_proj.n_rows;
-	float *vertx = _vert_proj.colptr(X);
-	float *verty = _vert_proj.colptr(Y);
+	const float u = point(_axis_u);
+	const float v = point(_axis_v);
+
+	if (u < _bbox[0] || u > _bbox[1] || v < _bbox[2] || v > _bbox[3] || _edges.empty())
+		return false;
+
+	const float *e = &_edges[0];
+	const float *e_end = e + _edges.size();
+
+	for (; e < e_end; e += 3 * _group_size)
+	{
+		int inside = 1;
 
-	return (_pnpoly(nvert, vertx, verty, testx, testy) % 2);
+		for (unsigned int k = 0; k < 3 * _group_size; k += 3)
+			inside &= (e[k] * u + e[k + 1] * v + e[k + 2] >= -PRECISION);
+
+		if (inside)
+			return true;
+	}
+
+	return false;
 }
 
+#endif
+
 // Private functions
 
 void Surface::_init()
 {
-#ifndef BORISH
-	// calculate range of coordinates
-	arma::frowvec3 vert_max = max(_vert);
-	arma::frowvec3 vert_min = min(_vert);
-	arma::frowvec3 vert_range = vert_max - vert_min;  // range
-	vert_range.min(_coord_to_remove);  // smallest range
-
-	_vert_proj.set_size(4, 2);
-
-	for (arma::u32 i = 0; i < (arma::u32) _vert_proj.n_rows; i++)
+	// remove repeated vertices (e.g. triangles stored as quads)
+	for (arma::u32 i = 0; i < _vert.n_rows && _vert.n_rows > 3; )
 	{
-		arma::frowvec2 r = _project_to_2d(_vert.row(i));
-		_vert_proj.row(i) = r;
+		arma::u32 next = (i + 1) % _vert.n_rows;
+
+		if (arma::norm(_vert.row(i) - _vert.row(next), 2) <= PRECISION)
+			_vert.shed_row(next);
+		else
+			i++;
 	}
-#endif
 
 	_calc_center();
 	_calc_plane_coeff();
 	_calc_normal();
 	_calc_dist_origin();
 	_calc_area();
+	_calc_reflection_gain();
+
+	// copies for the ISM
+	_normal_v = to_vec3(_normal);
+	float len = norm(to_vec3(_plane_coeff.subvec(0,2)));
+	_plane.n = vec3(_plane_coeff(0) / len, _plane_coeff(1) / len, _plane_coeff(2) / len);
+	_plane.d = _plane_coeff(3) / len;
+
+#ifndef BORISH
+	_calc_edges();
+#endif
 }
 
-arma::frowvec2 Surface::_project_to_2d(arma::frowvec3 p)
+#ifndef BORISH
+
+// Projects the polygon along the dominant axis of its normal and stores the
+// edge functions: one piece if it is convex, otherwise the triangles of an
+// ear-clipping triangulation
+void Surface::_calc_edges()
 {
-	unsigned int j = 0;
-	arma::frowvec2 projection;
+	unsigned int axis = 0;
 
-	for (unsigned int i = 0; i < 3; i++)
+	for (unsigned int k = 1; k < 3; k++)
 	{
-		if (i == _coord_to_remove)
-			continue;
+		if (fabs(_normal(k)) > fabs(_normal(axis)))
+			axis = k;
+	}
+
+	_axis_u = (axis + 1) % 3;
+	_axis_v = (axis + 2) % 3;
+
+	const unsigned int n = _vert.n_rows;
+	std::vector<float> u(n), v(n);
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		u[i] = _vert(i, _axis_u);
+		v[i] = _vert(i, _axis_v);
+	}
 
-		projection(j++) = p(i);
+	_bbox[0] = *std::min_element(u.begin(), u.end()) - PRECISION;
+	_bbox[1] = *std::max_element(u.begin(), u.end()) + PRECISION;
+	_bbox[2] = *std::min_element(v.begin(), v.end()) - PRECISION;
+	_bbox[3] = *std::max_element(v.begin(), v.end()) + PRECISION;
+
+	// orientation of the projected polygon (sign of the area)
+	float area2 = 0.0f;
+
+	for (unsigned int i = 0, j = n - 1; i < n; j = i++)
+		area2 += u[j] * v[i] - u[i] * v[j];
+
+	const float orientation = (area2 >= 0.0f) ? 1.0f : -1.0f;
+
+	// convex if all the turns have the same sign
+	bool convex = true;
+
+	for (unsigned int i = 0; i < n && convex; i++)
+	{
+		unsigned int j = (i + 1) % n;
+		unsigned int k = (i + 2) % n;
+		float turn = (u[j] - u[i]) * (v[k] - v[j]) - (v[j] - v[i]) * (u[k] - u[j]);
+		convex = (turn * orientation >= -PRECISION);
 	}
 
-	return projection;
+	_edges.clear();
+
+	if (convex)
+	{
+		_group_size = n;
+
+		for (unsigned int i = 0; i < n; i++)
+			_add_edge(u[i], v[i], u[(i + 1) % n], v[(i + 1) % n], orientation);
+
+		return;
+	}
+
+	// ear clipping
+	_group_size = 3;
+	std::vector<unsigned int> idx(n);
+
+	for (unsigned int i = 0; i < n; i++)
+		idx[i] = i;
+
+	while (idx.size() > 3)
+	{
+		bool clipped = false;
+
+		for (unsigned int i = 0; i < idx.size() && !clipped; i++)
+		{
+			unsigned int a = idx[(i + idx.size() - 1) % idx.size()];
+			unsigned int b = idx[i];
+			unsigned int c = idx[(i + 1) % idx.size()];
+			float turn = (u[b] - u[a]) * (v[c] - v[b]) - (v[b] - v[a]) * (u[c] - u[b]);
+
+			if (turn * orientation <= PRECISION)
+				continue;  // reflex vertex
+
+			// no other vertex inside the ear
+			bool ear = true;
+
+			for (unsigned int k = 0; k < idx.size() && ear; k++)
+			{
+				unsigned int p = idx[k];
+
+				if (p == a || p == b || p == c)
+					continue;
+
+				float e0 = ((u[b] - u[a]) * (v[p] - v[a]) - (v[b] - v[a]) * (u[p] - u[a])) * orientation;
+				float e1 = ((u[c] - u[b]) * (v[p] - v[b]) - (v[c] - v[b]) * (u[p] - u[b])) * orientation;
+				float e2 = ((u[a] - u[c]) * (v[p] - v[c]) - (v[a] - v[c]) * (u[p] - u[c])) * orientation;
+				ear = !(e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f);
+			}
+
+			if (!ear)
+				continue;
+
+			_add_edge(u[a], v[a], u[b], v[b], orientation);
+			_add_edge(u[b], v[b], u[c], v[c], orientation);
+			_add_edge(u[c], v[c], u[a], v[a], orientation);
+			idx.erase(idx.begin() + i);
+			clipped = true;
+		}
+
+		if (!clipped)
+			break;  // not a simple polygon, keep the triangles found
+	}
+
+	if (idx.size() == 3)
+	{
+		_add_edge(u[idx[0]], v[idx[0]], u[idx[1]], v[idx[1]], orientation);
+		_add_edge(u[idx[1]], v[idx[1]], u[idx[2]], v[idx[2]], orientation);
+		_add_edge(u[idx[2]], v[idx[2]], u[idx[0]], v[idx[0]], orientation);
+	}
 }
 
-// http://www.ecse.rpi.edu/~wrf/Research/Short_Notes/pnpoly.html
-int Surface::_pnpoly(int nvert, float *vertx, float *verty, float testx, float testy)
+// Edge function normalized to a distance, positive at the inner side
+void Surface::_add_edge(float u0, float v0, float u1, float v1, float orientation)
 {
-  int i, j, c = 0;
+	float a = -(v1 - v0) * orientation;
+	float b = (u1 - u0) * orientation;
+	float len = sqrt(a * a + b * b);
 
-  for (i = 0, j = nvert-1; i < nvert; j = i++)
-  {
-    if ( ((verty[i] > testy) != (verty[j] > testy)) &&
-	     (testx < (vertx[j] - vertx[i]) * (testy - verty[i]) / (verty[j] - verty[i]) + vertx[i]) )
-       c = !c;
-  }
+	if (len > 0.0f)
+	{
+		a /= len;
+		b /= len;
+	}
 
-  return c;
+	_edges.push_back(a);
+	_edges.push_back(b);
+	_edges.push_back(-(a * u0 + b * v0));
 }
 
 #endif
@@ -193,22 +347,18 @@ void Surface::_calc_center()
 	_center = ((xyz_max - xyz_min) / 2) + xyz_min;  // (x, y, z) center
 }
 
+// Newell's method, valid for any planar polygon
 void Surface::_calc_plane_coeff()
 {
-	arma::fmat A, B, C;
+	float a = 0.0f, b = 0.0f, c = 0.0f;
 
-	A << _vert(1,1) - _vert(0,1) << _vert(1,2) - _vert(0,2) << arma::endr
-	  << _vert(2,1) - _vert(0,1) << _vert(2,2) - _vert(0,2) << arma::endr;
-
-	B << _vert(1,2) - _vert(0,2) << _vert(1,0) - _vert(0,0) << arma::endr
-	  << _vert(2,2) - _vert(0,2) << _vert(2,0) - _vert(0,0) << arma::endr;
-
-	C << _vert(1,0) - _vert(0,0) << _vert(1,1) - _vert(0,1) << arma::endr
-	  << _vert(2,0) - _vert(0,0) << _vert(2,1) - _vert(0,1) << arma::endr;
+	for (arma::u32 i = 0, j = _vert.n_rows - 1; i < _vert.n_rows; j = i++)
+	{
+		a += (_vert(j,Y) - _vert(i,Y)) * (_vert(j,Z) + _vert(i,Z));
+		b += (_vert(j,Z) - _vert(i,Z)) * (_vert(j,X) + _vert(i,X));
+		c += (_vert(j,X) - _vert(i,X)) * (_vert(j,Y) + _vert(i,Y));
+	}
 
-	float a = det(A);
-	float b = det(B);
-	float c = det(C);
 	float d = -1.0f * (a * _vert(0,0) + b * _vert(0,1) + c * _vert(0,2));
 
 	_plane_coeff << a << b << c << d << arma::endr;
@@ -233,9 +383,78 @@ void Surface::_calc_dist_origin()
 
 void Surface::_calc_area()
 {
-	avrs::point3_t ac = _vert.row(0) - _vert.row(2);  // ac vector
-	avrs::point3_t bd = _vert.row(1) - _vert.row(3);  // bd vector
-	_area = 0.5f * norm(cross(ac, bd), 2);
+	// the norm of the Newell normal is twice the area
+	_area = 0.5f * norm(_plane_coeff.subvec(0,2), 2);
+}
+
+// Upper bound of the broadband reflection gain, i.e. the peak of |B(w) / A(w)|
+// over [0, pi]. It is used by the ISM to estimate the energy left on a
+// reflection path, so it must never underestimate the filter response. The
+// response is sampled densely, and between two points the magnitudes can not
+// change more than the derivative bounds sum(i |b_i|) and sum(i |a_i|), so
+// the peak of a narrow resonance between the points is also covered.
+void Surface::_calc_reflection_gain()
+{
+	const unsigned int n_freq = 1024;  // frequency points in [0, pi]
+	const double half_step = avrs::math::PI / (2.0 * n_freq);  // max distance to a point
+	_reflection_gain = 1.0f;  // no material filter, no absorption
+
+	if (_b_filter_coeff.empty())
+		return;
+
+	unsigned int i;
+	double slope_b = 0.0, slope_a = 0.0;
+
+	for (i = 0; i < _b_filter_coeff.size(); i++)
+		slope_b += i * fabs(_b_filter_coeff[i]);
+
+	for (i = 0; i < _a_filter_coeff.size(); i++)
+		slope_a += i * fabs(_a_filter_coeff[i]);
+
+	double peak = 0.0;
+
+	for (unsigned int k = 0; k <= n_freq; k++)
+	{
+		double w = (avrs::math::PI * k) / n_freq;
+		double b_re = 0.0, b_im = 0.0;
+		double a_re = 0.0, a_im = 0.0;
+
+		for (i = 0; i < _b_filter_coeff.size(); i++)
+		{
+			b_re += _b_filter_coeff[i] * cos(w * i);
+			b_im -= _b_filter_coeff[i] * sin(w * i);
+		}
+
+		if (_a_filter_coeff.empty())
+		{
+			a_re = 1.0;
+		}
+		else
+		{
+			for (i = 0; i < _a_filter_coeff.size(); i++)
+			{
+				a_re += _a_filter_coeff[i] * cos(w * i);
+				a_im -= _a_filter_coeff[i] * sin(w * i);
+			}
+		}
+
+		// bounds of both magnitudes around this point
+		double b_max = sqrt(b_re * b_re + b_im * b_im) + slope_b * half_step;
+		double a_min = sqrt(a_re * a_re + a_im * a_im) - slope_a * half_step;
+
+		if (a_min <= PRECISION)
+		{
+			// a pole (almost) on the unit circle, the gain is not bounded and
+			// the paths through this surface are never pruned
+			WARNING("The material filter of a surface has a pole on the unit circle");
+			_reflection_gain = FLT_MAX;
+			return;
+		}
+
+		peak = std::max(peak, b_max / a_min);
+	}
+
+	_reflection_gain = (float) peak;
 }
 
 }  // namespace avrs
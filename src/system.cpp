@@ -42,6 +42,7 @@ System::System(std::string config_filename, bool show_config)
 {
 	_config_manager.load_configuration(config_filename);
 	_config_sim = _config_manager.get_configuration();
+	_new_filters = FILTERS_NONE;
 
 	if (show_config)
 		_config_manager.show_configuration();
@@ -63,14 +64,18 @@ System::ptr_t System::get_instance(std::string config_filename, bool show_config
 
 void System::_init()
 {
-	_in = InputWaveLoop::create(_config_sim->anechoic_file);
-	assert(_in.get() != NULL);
+	for (unsigned int k = 0; k < _config_sim->n_sources; k++)
+	{
+		_in.push_back(InputWaveLoop::create(_config_sim->anechoic_files[k]));
+		assert(_in[k].get() != NULL);
+
+		_conv_l.push_back(Convolver::create(BUFFER_SAMPLES));
+		_conv_r.push_back(Convolver::create(BUFFER_SAMPLES));
+	}
+
 	_out = Player::create(avrs::math::dB2linear(_config_sim->master_gain_db));
 	assert(_out.get() != NULL);
 
-	_conv_l = Convolver::create(BUFFER_SAMPLES);
-	_conv_r = Convolver::create(BUFFER_SAMPLES);
-
 	uint read_interval_ms = 10;  // ms (100 Hz)
 
 #ifdef WIIMOTE_TRACKER
@@ -133,6 +138,7 @@ bool System::run()
 	}
 
 	_is_running = true;
+	pthread_create(&_render_thread_id, NULL, System::_render_wrapper, this); // render the BIRs
 	pthread_create(&_thread_id, NULL, System::_rt_wrapper, this); // run simulation (in another thread)
 
 	printf(">> ");
@@ -160,6 +166,7 @@ bool System::run()
 	}
 
 	pthread_join(_thread_id, NULL); // wait until run thread finish...
+	pthread_join(_render_thread_id, NULL);
 	rt_task_delete(wait_task);
 	printf("Quit\n");
 
@@ -171,6 +178,78 @@ void *System::_rt_wrapper(void *arg)
 	return reinterpret_cast<System *> (arg)->_rt_thread(NULL);
 }
 
+void *System::_render_wrapper(void *arg)
+{
+	return reinterpret_cast<System *> (arg)->_render_thread(NULL);
+}
+
+// Render task, it publishes the spectra of the new BIRs for the HRT task
+void *System::_render_thread(void *arg)
+{
+	RT_TASK *render_task;
+	unsigned int k;
+
+	rt_allow_nonroot_hrt();
+	mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	// create RENDER task (lower priority than SYS and TRACKER tasks, never hard real-time)
+	render_task = rt_task_init_schmod(nam2num("TSKREN"), 3, 0, 0, SCHED_FIFO, 0xFF);
+
+	if (!render_task)
+	{
+		ERROR("Cannot init RENDER task");
+		end_system(-1);
+		return arg;
+	}
+
+	const unsigned int n_sources = _in.size();
+	bool pending = false;  // new BIRs not published yet
+	rt_task_make_periodic(render_task, rt_get_time() + 50 * _sampling_interval, _sampling_interval);
+
+	while (!g_end_system)
+	{
+		// update the position
+		if (!_ve->update_listener_orientation())
+			end_system(-1);
+
+		if (!_ve->update_source_position())
+			end_system(-1);
+
+		// renderize BIR
+		_ve->renderize();
+
+		// the spectra are written in the buffers of the convolvers here, so
+		// the HRT task only swaps them
+		if (_ve->is_new_BIR())
+			pending = true;
+
+		// not while the HRT task takes the last ones (then in the next period)
+		if (pending && (__sync_bool_compare_and_swap(&_new_filters, FILTERS_NONE, FILTERS_WRITING)
+				|| __sync_bool_compare_and_swap(&_new_filters, FILTERS_READY, FILTERS_WRITING)))
+		{
+			for (k = 0; k < n_sources; k++)
+			{
+				binauraldata_t &partitions = _ve->get_BIR_partitions(k);
+				_conv_l[k]->filter_buffer() = partitions.left;
+				_conv_l[k]->publish_filter();
+				_conv_r[k]->filter_buffer() = partitions.right;
+				_conv_r[k]->publish_filter();
+			}
+
+			pending = false;
+			__sync_synchronize();
+			_new_filters = FILTERS_READY;
+		}
+
+		// if the rendering took more than one period, it returns immediately
+		rt_task_wait_period();
+	}
+
+	rt_task_delete(render_task);
+
+	return arg;
+}
+
 // HRT Task
 void *System::_rt_thread(void *arg)
 {
@@ -206,14 +285,13 @@ void *System::_rt_thread(void *arg)
 
 	rtf_reset(RTF_OUT_NUM); // clear it out
 
-	_input.resize(BUFFER_SAMPLES);
+	const unsigned int n_sources = _in.size();
+	_input.resize(n_sources, data_t(BUFFER_SAMPLES));
 	int n_bytes = RTF_OUT_BLOCK * sizeof(sample_t);  // both ears
 	sample_t *output_player = (sample_t *) malloc(RTF_OUT_BLOCK * sizeof(sample_t));  // sending by RT-FIFO
-	sample_t *output_l = (sample_t *) malloc(BUFFER_SAMPLES * sizeof(sample_t));
-	sample_t *output_r = (sample_t *) malloc(BUFFER_SAMPLES * sizeof(sample_t));
-
-	for (i = 0; i < BUFFER_SAMPLES; i++)
-		output_l[i] = output_r[i] = 0.0f;
+	sample_t *output_l;
+	sample_t *output_r;
+	unsigned int k;
 
 	_out->start(); // start the output
 	_ve->start_simulation();
@@ -226,40 +304,46 @@ void *System::_rt_thread(void *arg)
 	{
 //		t_loop.start();
 
-		// get input (anechoic signal)
-		for (i = 0; i < BUFFER_SAMPLES; i++)
-			_input[i] = _in->tick();
-
-		// update the position
-		if (!_ve->update_listener_orientation())
-			end_system(-1);
-
-		// renderize BIR
-//		t_render.start();
-		_ve->renderize();
-//		t_render.stop();
-
-		// get the new BIR
-		_bir = _ve->get_BIR();
+		// get inputs (anechoic signals)
+		for (k = 0; k < n_sources; k++)
+		{
+			for (i = 0; i < BUFFER_SAMPLES; i++)
+				_input[k][i] = _in[k]->tick();
+		}
 
-		// update the BIR in the real-time convolver
+		// update the BIRs in the real-time convolvers with the last ones
+		// published by the render task (it never waits for them)
 //		t_conv.start();
 
-		if (_ve->is_new_BIR())
+		if (__sync_bool_compare_and_swap(&_new_filters, FILTERS_READY, FILTERS_TAKING))
 		{
-			_conv_l->set_filter_t(_bir.left);
-			_conv_r->set_filter_t(_bir.right);
+			for (k = 0; k < n_sources; k++)
+			{
+				_conv_l[k]->update_filter();
+				_conv_r[k]->update_filter();
+			}
+
+			__sync_synchronize();
+			_new_filters = FILTERS_NONE;
 		}
 
-		// convolve with anechoic signal
-		output_l = _conv_l->convolve_signal(_input.data());
-		output_r = _conv_r->convolve_signal(_input.data());
+		// convolve each source with its anechoic signal and mix them
+		memset(output_player, 0, RTF_OUT_BLOCK * sizeof(sample_t));
 
-//		t_conv.stop();
+		for (k = 0; k < n_sources; k++)
+		{
+			output_l = _conv_l[k]->convolve_signal(_input[k].data());
+			output_r = _conv_r[k]->convolve_signal(_input[k].data());
+
+			// preparing output for RT-FIFO
+			for (i = 0; i < BUFFER_SAMPLES; i++)
+			{
+				output_player[i] += output_l[i];
+				output_player[BUFFER_SAMPLES + i] += output_r[i];
+			}
+		}
 
-		// preparing output for RT-FIFO
-		memcpy(output_player, output_l, BUFFER_SAMPLES * sizeof(sample_t));
-		memcpy(&output_player[BUFFER_SAMPLES], output_r, BUFFER_SAMPLES * sizeof(sample_t));
+//		t_conv.stop();
 
 		// send to output player
 		val = rtf_put(RTF_OUT_NUM, output_player, n_bytes); // both ears [left right]
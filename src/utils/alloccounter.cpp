@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "utils/alloccounter.hpp"
+
+#ifdef ALLOCATION_COUNTER
+
+namespace // anonymous
+{
+// initial-exec: reading it never allocates (this is a shared library)
+__thread unsigned long g_allocations __attribute__ ((tls_model("initial-exec"))) = 0;
+}
+
+// The allocation functions of the C library are replaced (the symbols of the
+// program are found first), the real ones are the internal entry points of
+// glibc. operator new and the buffers of FFTW go through them.
+extern "C"
+{
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size)
+{
+	g_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	g_allocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	g_allocations++;
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	g_allocations++;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size)
+{
+	// a power of two multiple of sizeof(void *)
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	g_allocations++;
+	*p = __libc_memalign(alignment, size);
+	return (*p != NULL) ? 0 : ENOMEM;
+}
+
+}  // extern "C"
+
+#endif
+
+namespace avrs
+{
+
+namespace alloccounter
+{
+
+unsigned long count()
+{
+#ifdef ALLOCATION_COUNTER
+	return g_allocations;
+#else
+	return 0;
+#endif
+}
+
+}  // namespace alloccounter
+
+}  // namespace avrs
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2013-2014 Fabián C. Tommasini <fabian@tommasini.com.ar>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#include "utils/timerwall.hpp"
+
+namespace avrs
+{
+
+void TimerWall::start()
+{
+	clock_gettime(CLOCK_MONOTONIC, &_t0);
+}
+
+void TimerWall::stop()
+{
+	clock_gettime(CLOCK_MONOTONIC, &_t1);
+	_diff = (_t1.tv_sec - _t0.tv_sec) + (_t1.tv_nsec - _t0.tv_nsec) * 1E-9;
+}
+
+double TimerWall::elapsed_time(timer_unit_t u)
+{
+	switch (u)
+	{
+	case second:
+		return _diff;
+
+	case millisecond:
+		return (_diff / 1E-3);
+
+	case microsecond:
+		return (_diff / 1E-6);
+
+	case nanosecond:
+		return (_diff / 1E-9);
+
+	default:
+		return -1.0;
+	}
+}
+
+}  // namespace avrs
@@ -16,12 +16,16 @@
  *
  */
 
+#include <unistd.h>
+#include <sched.h>
+#include <climits>
 #include <boost/format.hpp>
 #include <boost/make_shared.hpp>
 #include <stk/FileWvOut.h>
 #include <stk/Noise.h>
 
 #include "utils/timerrtai.hpp"
+#include "utils/alloccounter.hpp"
 #include "dxfreader.hpp"
 #include "avrsexception.hpp"
 #include "virtualenvironment.hpp"
@@ -30,6 +34,68 @@
 namespace avrs
 {
 
+namespace // anonymous
+{
+const uint no_hrtf = UINT_MAX;  // the reflection was not rendered
+const unsigned int max_incremental_updates = 1000;  // then the early part is summed again (rounding errors)
+const float hrtf_weight_tolerance = 0.05f;  // change of an interpolation weight that is not rendered again
+
+#ifdef __SSE__
+// typedef needed by SIMD instructions
+typedef float v4sf __attribute__ ((vector_size(16)));
+#endif
+
+// output += input (n samples)
+inline void add_samples(sample_t *output, const sample_t *input, unsigned long n)
+{
+	unsigned long i = 0;
+
+#ifdef __SSE__
+	for (; i + 4 <= n; i += 4)
+	{
+		v4sf sum = __builtin_ia32_addps(__builtin_ia32_loadups(output + i), __builtin_ia32_loadups(input + i));
+		__builtin_ia32_storeups(output + i, sum);
+	}
+#endif
+
+	for (; i < n; i++)
+		output[i] += input[i];
+}
+
+// Weight of a HRTF in an interpolation (zero if it is not used)
+inline float hrtf_weight(const hrtfweights_t &w, uint index)
+{
+	for (uint t = 0; t < w.n; t++)
+	{
+		if (w.index[t] == index)
+			return w.weight[t];
+	}
+
+	return 0.0f;
+}
+
+// The two interpolations have the same HRTFs (in any order) and no weight
+// changed more than the tolerance
+inline bool similar_weights(const hrtfweights_t &a, const hrtfweights_t &b)
+{
+	uint t;
+
+	for (t = 0; t < a.n; t++)
+	{
+		if (fabsf(a.weight[t] - hrtf_weight(b, a.index[t])) > hrtf_weight_tolerance)
+			return false;
+	}
+
+	for (t = 0; t < b.n; t++)
+	{
+		if (fabsf(b.weight[t] - hrtf_weight(a, b.index[t])) > hrtf_weight_tolerance)
+			return false;
+	}
+
+	return true;
+}
+}
+
 VirtualEnvironment::VirtualEnvironment(configuration_t::ptr_t cs, TrackerBase::ptr_t tracker)
 {
 	assert(cs.get() != NULL);
@@ -49,9 +115,34 @@ VirtualEnvironment::VirtualEnvironment(configuration_t::ptr_t cs, TrackerBase::p
 		throw AvrsException("Error creating VirtualEnvironment");
 	}
 
-	// Sound source
-	_sound_source = cs->sound_source;
-	assert(_sound_source.get() != NULL);
+	// Sound sources
+	_sources.resize(cs->sound_sources.size());
+	_mbx_source = NULL;
+
+	for (unsigned int k = 0; k < _sources.size(); k++)
+	{
+		_sources[k].source = cs->sound_sources[k];
+		assert(_sources[k].source.get() != NULL);
+		_sources[k].moved = false;
+		_sources[k].pending = false;
+		_sources[k].pre_hrtf_generation = 0;
+		_sources[k].hrtf_generation = 0;
+		_sources[k].incremental_updates = 0;
+		_sources[k].delay_samples = ULONG_MAX;  // the first render updates all the partitions
+		_sources[k].max_reflections = 0;
+	}
+
+	if (_config->ism_moving_source)
+	{
+		_mbx_source = rttools::get_mbx(MBX_SOURCE_NAME,
+				MBX_SOURCE_BLOCK * _sources.size() * sizeof(sourcedata_t));
+
+		if (!_mbx_source)
+		{
+			ERROR("Cannot init SOURCE mailbox");
+			throw AvrsException("Error creating VirtualEnvironment");
+		}
+	}
 
 	// Listener
 	_listener = cs->listener;
@@ -70,41 +161,117 @@ VirtualEnvironment::VirtualEnvironment(configuration_t::ptr_t cs, TrackerBase::p
 
 	// BIR length
 	_length_bir = _config->bir_length_samples;
+	_n_partitions = (_length_bir + BUFFER_SAMPLES - 1) / BUFFER_SAMPLES;
 	// resize data vectors
-	_render_buffer.left.resize(_length_bir, 0.0f);
-	_render_buffer.right.resize(_length_bir, 0.0f);
+	for (unsigned int k = 0; k < _sources.size(); k++)
+	{
+		_sources[k].render_buffer.left.resize(_length_bir, 0.0f);
+		_sources[k].render_buffer.right.resize(_length_bir, 0.0f);
+		_sources[k].early = binauraldata_t(_length_bir);
+		_sources[k].partitions = binauraldata_t(2 * _n_partitions * BUFFER_SAMPLES);
+	}
+
+	// the same FFT as Convolver::prepare_impulse_response() (halfcomplex data format)
+	_fft_buffer.resize(2 * BUFFER_SAMPLES, 0.0f);
+	_fft_plan = fftwf_plan_r2r_1d(2 * BUFFER_SAMPLES, &_fft_buffer[0], &_fft_buffer[0], FFTW_R2HC, FFTW_ESTIMATE);
+
 	_zeros.resize(_length_bir, 0.0f);
 	_late_buffer.resize(_length_bir, 0.0f);
 	_new_bir = false;
 
 	// create and load HRTF DB
 	_hcdb = HrtfCoeffSet::create(_config->hrtf_file);
-	_delay.setMaximumDelay(BUFFER_SAMPLES);
 
 	// Room
 	_room = boost::make_shared<Room>(cs);
 	std::cout << "Room loaded" << std::endl;
 	std::cout << "Volume: " << _room->volume() << " - Total area: " << _room->total_area() << std::endl;
+	std::cout << "Shape: " << (_room->is_shoebox() ? "shoebox" : (_room->is_convex() ? "convex" : "non-convex")) << std::endl;
 
-	// ISM
-	_ism = boost::make_shared<Ism>(cs, _room);
+	// ISM, one for each source (all of them read the same room)
+	for (unsigned int k = 0; k < _sources.size(); k++)
+		_sources[k].ism = boost::make_shared<Ism>(cs, _room, _sources[k].source);
 
 	TimerRtai t;
 	t.start();
-	_ism->calculate(false);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < (int) _sources.size(); k++)
+	{
+		Ism::ptr_t ism = _sources[k].ism;
+
+		if (_config->ism_cache_dir.empty() || !ism->load_cache(ism->cache_filename()))
+		{
+			ism->calculate(false);
+
+			if (!_config->ism_cache_dir.empty())
+				ism->save_cache(ism->cache_filename());
+		}
+	}
+
 	t.stop();
 	t.print_elapsed_time(millisecond, "ISM");
-	_ism->print_summary();
 
-	_outputs.resize(_ism->get_count_visible_vs());  // output per visible VS
+	for (unsigned int k = 0; k < _sources.size(); k++)
+	{
+		if (_sources.size() > 1)
+			std::cout << "Source " << k + 1 << std::endl;
+
+		_sources[k].ism->print_summary();
+	}
+
+	// buffers of the renderer for the current lists (see _reserve_buffers())
+	for (unsigned int k = 0; k < _sources.size(); k++)
+		_reserve_buffers(_sources[k], _sources[k].ism->get_count_visible_vs());
+
+	_path_stack.resize(_config->max_order + 1);
+	_render_grew = false;
+	_rendered = false;
+
 	_air_absorption = AirAbsorption::create(_config->air_absorption_file);
 
 	// Late reverberation
 	_calc_late_reverberation();
+
+	// Renderer
+	_start_workers();
+
+	// Update of the VSs
+	_update_running = false;
+	_revalidate_pending = false;
+	_revalidate_last_pos = _listener->get_position_v();
+	_source_pending = false;
+	_ism_updated = 0;
+
+	if (_config->position_threshold > 0.0f || _room->has_dynamic_surfaces() || _config->ism_moving_source)
+	{
+		pthread_mutex_init(&_update_mutex, NULL);
+		pthread_cond_init(&_update_cond, NULL);
+		_update_running = true;
+		pthread_create(&_update_thread_id, NULL, VirtualEnvironment::_update_wrapper, this);
+	}
 }
 
 VirtualEnvironment::~VirtualEnvironment()
 {
+	_stop_workers();
+
+	if (_update_running)
+	{
+		pthread_mutex_lock(&_update_mutex);
+		_update_running = false;
+		pthread_cond_signal(&_update_cond);
+		pthread_mutex_unlock(&_update_mutex);
+		pthread_join(_update_thread_id, NULL);
+		pthread_cond_destroy(&_update_cond);
+		pthread_mutex_destroy(&_update_mutex);
+	}
+
+	fftwf_destroy_plan(_fft_plan);
+
+	if (_mbx_source)
+		rttools::del_mbx(MBX_SOURCE_NAME);
+
 	rttools::del_mbx(MBX_TRACKER_NAME);
 }
 
@@ -136,6 +303,10 @@ bool VirtualEnvironment::update_listener_orientation()
 			_tracker_data = tmp_data;  // save the current tracker data
 			_listener->rotate(tmp_data.ori);  // update listener orientation
 			_listener->translate(tmp_data.pos.to_point3());  // update listener position
+
+			if (_config->position_threshold > 0.0f &&
+					dist(_listener->get_position_v(), _revalidate_last_pos) >= _config->position_threshold)
+				_request_revalidation(_listener->get_position_v());
 			//_ism->update_vs_orientations(_listener->get_orientation());  // update VS orientations
 
 //			DPRINT("%+1.3f %+1.3f \t %+1.3f %+1.3f",
@@ -150,117 +321,164 @@ bool VirtualEnvironment::update_listener_orientation()
 	return true;
 }
 
+bool VirtualEnvironment::update_source_position()
+{
+	if (!_mbx_source)
+		return true;  // static sources
+
+	sourcedata_t tmp_data;
+	int val;
+
+	// receive messages from SOURCE mailbox
+	// non-blocking
+	while ((val = rt_mbx_receive_if(_mbx_source, &tmp_data, sizeof(sourcedata_t))) == 0)
+	{
+		if (tmp_data.source >= _sources.size())
+		{
+			ERROR("Invalid source %d", tmp_data.source);
+			continue;
+		}
+
+		sourcestate_t &state = _sources[tmp_data.source];
+
+		// check for new data
+		if (state.data.timestamp != tmp_data.timestamp && tmp_data.timestamp != 0)
+		{
+			state.data = tmp_data;
+			state.moved = true;
+		}
+	}
+
+	if (-EINVAL == val)
+	{
+		ERROR("Mailbox is invalid");
+		return false;
+	}
+
+	// if the update thread is busy, they are sent again in the next cycle
+	for (unsigned int k = 0; k < _sources.size(); k++)
+	{
+		if (_sources[k].moved && _request_source_move(_sources[k]))
+			_sources[k].moved = false;
+	}
+
+	return true;
+}
+
 void VirtualEnvironment::renderize()
 {
-	// check if the listener is moved
-	if (!_listener_is_moved())
+	// check if the listener is moved or the VSs were updated
+	bool ism_updated = __sync_bool_compare_and_swap(&_ism_updated, 1, 0);
+
+	if (!_listener_is_moved() && !ism_updated)
 	{
 		_new_bir = false;
 		return;
 	}
 
-	TimerRtai t;
-	unsigned long i, j;
-	data_t input;
-	data_t image;
-	binauraldata_t output(BUFFER_SAMPLES);
-
-#ifdef APPLY_FDN_REVERBERATION
-	memcpy(&_render_buffer.left[0], &_late_buffer[0], sample_mix_time() * sizeof(sample_t));
-	memcpy(&_render_buffer.right[0], &_late_buffer[0], sample_mix_time() * sizeof(sample_t));
-
-//	memcpy(&_render_buffer.left[0], &_zeros[0], sample_mix_time() * sizeof(sample_t));
-//	memcpy(&_render_buffer.right[0], &_zeros[0], sample_mix_time() * sizeof(sample_t));
-#else
-	memcpy(&_render_buffer.left[0], &_zeros[0], _length_bir * sizeof(sample_t));
-	memcpy(&_render_buffer.right[0], &_zeros[0], _length_bir * sizeof(sample_t));
+#ifdef ALLOCATION_COUNTER
+	unsigned long allocations = alloccounter::count();
 #endif
 
-	// TODO RECORRER SOLO AUDIBLES
-	for (Ism::tree_vs_t::iterator it = _ism->tree_vs.begin(); it != _ism->tree_vs.end(); it++)
-	{
-		VirtualSource::ptr_t vs = *it;
+	// the BIRs are only replaced if some HRTF changed
+	bool new_bir = false;
+	_render_grew = false;
 
-		if (!vs->audible)  	// only for audible VSs
-			continue;
+	for (unsigned int k = 0; k < _sources.size(); k++)
+	{
+		if (_render_source(_sources[k]))
+			new_bir = true;
+	}
 
-#ifdef APPLY_DIRECTIVITY_FILTERING
-//		t.start();
-		// directivity filtering
-		input = _sound_source->get_IR(vs->pos_L);
-		assert(input.size() <= VS_SAMPLES);  // TODO REVISAR LONGITUD DE EARLY REFLECTIONS
-		input.resize(VS_SAMPLES, 0.0f);
-//		t.stop();
-//		DPRINT("Directivity - time %.3f", t.elapsed_time(microsecond));
-#else
-		input.resize(VS_SAMPLES);
+	_new_bir = new_bir;
 
-		//input[0] = 1.0f;  // delta dirac
+#ifdef ALLOCATION_COUNTER
+	allocations = alloccounter::count() - allocations;
 
-		// sinc function
-		std::vector<double> x = math::linspace(-PI, PI, VS_SAMPLES);
+	for (unsigned int k = 1; k < _workers.size(); k++)
+	{
+		allocations += _workers[k]->allocations;
+		_workers[k]->allocations = 0;
+	}
 
-		for (int k = 0; k < VS_SAMPLES; k++)
-		{
-			input[k] = 0.5 * math::sinc(x[k]);
-		}
+	// after the first render, only a list larger than the previous ones can allocate
+	if (_rendered && !_render_grew && allocations > 0)
+		WARNING("%lu heap allocations in renderize()", allocations);
 #endif
 
-#ifdef APPLY_SURFACE_FILTERING
-		// surface filtering
-		input = _surfaces_filter(input, it);
-#endif
+	_rendered = true;
+}
 
-#ifdef APPLY_AIR_FILTERING
-//		t.start();
-		// distance attenuation
-		float attenuation_factor = 1.0f / vs->dist_listener;
+// Renders the BIR of a source, returns false if it did not change
+bool VirtualEnvironment::_render_source(sourcestate_t &state)
+{
+	binauraldata_t &bir = state.render_buffer;
+	const Ism::ptr_t &ism = state.ism;
 
-		for (i = 0; i < input.size(); i++)
-			input[i] *= attenuation_factor;
-//		t.stop();
-//		DPRINT("Distance - time %.3f", t.elapsed_time(microsecond));
-#endif
+	// compact list of audible VSs, sorted by arrival time (it can be replaced
+	// by the update thread, the published one is held while it is used)
+	const Ism::reflectionlist_t &list = ism->acquire_reflections();
 
-#ifdef APPLY_HRTF_FILTERING
-		// HRTF filtering
-		output = _hrtf_iir_filter(input, vs->pos_R);
-#else
-		// Non HRTF filtering
-		memcpy(&output.left[0], &input[0], input.size() * sizeof(sample_t));
-		memcpy(&output.right[0], &input[0], input.size() * sizeof(sample_t));
-#endif
+	if (list.reflections.size() > state.max_reflections)
+	{
+		_reserve_buffers(state, list.reflections.size());
+		_render_grew = true;
+	}
 
-		// Buffer accumulation
-//		t.start();
-		// calculate the sample from reflectogram where starts this reflection
-		unsigned long sample = (unsigned long) round((vs->time_rel_ms * SAMPLE_RATE) / 1000.0f);
+	// a head rotation only needs the HRTF stage
+	if (state.pre_hrtf_generation != list.generation)
+		_update_pre_hrtf(state, list);
 
-		// add filter reflection to reflectogram
-		for (i = sample, j = 0; j < output.size(); i++, j++)
-		{
-			_render_buffer.left[i] += output.left[j];
-			_render_buffer.right[i] += output.right[j];
-		}
+	// samples of the early part that changed
+	unsigned long lo, hi;
+
+	if (!_render_reflections(state, list, lo, hi))
+	{
+		ism->release_reflections(list);
+		return false;
+	}
+
+	float dist_source_listener = list.dist_source_listener;
+	ism->release_reflections(list);
 
-//		t.stop ();
-//		DPRINT("Buffer - time %.3f", t.elapsed_time(microsecond));
+	// delay from source to listener, all the BIR changes if it is another one
+	unsigned long delay =
+			(unsigned long) ceil((dist_source_listener / _config->speed_of_sound) * SAMPLE_RATE);
+
+	if (delay != state.delay_samples)
+	{
+		state.delay_samples = delay;
+		lo = 0;
+		hi = _length_bir;
+	}
+	else
+	{
+		lo = std::min(lo + delay, _length_bir);
+		hi = std::min(hi + delay, _length_bir);
 	}
 
-	// add delay from source to listener
-	unsigned long samples_source_listener =
-			(unsigned long) ceil((_ism->dist_source_listener() / _config->speed_of_sound) * SAMPLE_RATE);
-	Delay delay_l, delay_r;
-	delay_l.setDelay(samples_source_listener);
-	delay_r.setDelay(samples_source_listener);
+	// late reverberation and early part, delayed
+	unsigned long begin = std::max(lo, std::min(delay, hi));
 
-	for (i = 0; i < _length_bir; i++)
+	memset(&bir.left[lo], 0, (begin - lo) * sizeof(sample_t));
+	memset(&bir.right[lo], 0, (begin - lo) * sizeof(sample_t));
+
+	if (begin < hi)
 	{
-		_render_buffer.left[i] = delay_l.tick(_render_buffer.left[i]);
-		_render_buffer.right[i] = delay_r.tick(_render_buffer.right[i]);
+#ifdef APPLY_FDN_REVERBERATION
+		memcpy(&bir.left[begin], &_late_buffer[begin - delay], (hi - begin) * sizeof(sample_t));
+		memcpy(&bir.right[begin], &_late_buffer[begin - delay], (hi - begin) * sizeof(sample_t));
+#else
+		memset(&bir.left[begin], 0, (hi - begin) * sizeof(sample_t));
+		memset(&bir.right[begin], 0, (hi - begin) * sizeof(sample_t));
+#endif
+
+		add_samples(&bir.left[begin], &state.early.left[begin - delay], hi - begin);
+		add_samples(&bir.right[begin], &state.early.right[begin - delay], hi - begin);
 	}
 
-	_new_bir = true;
+	// only the partitions of the changed samples are transformed again
+	_update_partitions(state, lo, hi);
 
 //	// FOR DEBUG!!!
 //	static long flag = 0;
@@ -273,8 +491,8 @@ void VirtualEnvironment::renderize()
 ////
 ////		for (i = 0; i < sample_mix_time(); i++)
 ////		{
-////			out1_l.tick(_render_buffer.left[i]);
-////			out1_r.tick(_render_buffer.right[i]);
+////			out1_l.tick(bir.left[i]);
+////			out1_r.tick(bir.right[i]);
 ////		}
 //
 //		stk::FileWvOut out2_l("bir_l.wav", 1, stk::FileWrite::FILE_WAV, stk::Stk::STK_SINT16);
@@ -282,99 +500,889 @@ void VirtualEnvironment::renderize()
 //
 //		for (i = 0; i < _length_bir; i++)
 //		{
-//			out2_l.tick(0.5*_render_buffer.left[i]);
-//			out2_r.tick(0.5*_render_buffer.right[i]);
+//			out2_l.tick(0.5*bir.left[i]);
+//			out2_r.tick(0.5*bir.right[i]);
 //		}
 //	}
+
+	return true;
 }
 
-data_t VirtualEnvironment::_surfaces_filter(data_t &input, const Ism::tree_vs_t::iterator node)
+// Signal radiated by the source towards a VS (VS_SAMPLES)
+void VirtualEnvironment::_source_signal(const SoundSource::ptr_t &source, const point3_t &vs_pos_L,
+		sample_t *output)
 {
+#ifdef APPLY_DIRECTIVITY_FILTERING
 //	TimerRtai t;
- 	data_t values = input;
- 	Ism::tree_vs_t::iterator root_it = _ism->root_tree_vs;
- 	Ism::tree_vs_t::iterator current_node = node;
+//	t.start();
+	// directivity filtering
+	const data_t &ir = source->get_IR(vs_pos_L);
+	assert(ir.size() <= VS_SAMPLES);  // TODO REVISAR LONGITUD DE EARLY REFLECTIONS
+	unsigned long length = std::min(ir.size(), (size_t) VS_SAMPLES);
+
+	if (length > 0)
+		memcpy(output, &ir[0], length * sizeof(sample_t));
+
+	memset(output + length, 0, (VS_SAMPLES - length) * sizeof(sample_t));
+//	t.stop();
+//	DPRINT("Directivity - time %.3f", t.elapsed_time(microsecond));
+#else
+	//output[0] = 1.0f;  // delta dirac
+
+	// sinc function (as math::linspace(-PI, PI, VS_SAMPLES))
+	double step = (2.0 * PI) / (VS_SAMPLES - 1);
+
+	for (int k = 0; k < VS_SAMPLES - 1; k++)
+		output[k] = 0.5 * math::sinc(-PI + k * step);
+
+	output[VS_SAMPLES - 1] = 0.5 * math::sinc(PI);
+#endif
+}
+
+// Signals of the reflections before the HRTF: directivity of the source,
+// surface filters and distance attenuation. They do not depend on the
+// orientation of the listener, so they are calculated once for each
+// published list. The paths of the reflections form a prefix tree (each
+// node is a VS and its parent is the parent VS), so each surface filter is
+// computed once for all the reflections that share a prefix. The nodes of
+// the same depth do not depend on each other, they are filtered together in
+// the lanes of _surface_bank.
+void VirtualEnvironment::_update_pre_hrtf(sourcestate_t &state, const Ism::reflectionlist_t &list)
+{
+	const unsigned long n = list.reflections.size();
+	unsigned long i, k;
+
+	state.pre_hrtf.resize(n * VS_SAMPLES);
+	state.pre_hrtf_generation = list.generation;
+
+	if (n == 0)
+		return;
+
+	std::vector<unsigned long> &order = _pre_hrtf_order;
+	order.resize(n);
+	unsigned short max_order = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		order[i] = i;
+		max_order = std::max(max_order, list.reflections[i].order);
+	}
+
+	comparepath_t less;
+	less.list = &list;
+	std::sort(order.begin(), order.end(), less);
+
+	// prefix tree (the root is the empty path), in the order of the paths a
+	// reflection can only share nodes with the previous one
+	unsigned long capacity = _path_nodes.capacity() + _node_signals.capacity();
+
+	if (_path_stack.size() < (unsigned long) max_order + 1)
+		_path_stack.resize(max_order + 1);
+
+	_reflection_nodes.resize(n);
+	_path_nodes.clear();
+	pathnode_t root = { 0, 0, 0 };
+	_path_nodes.push_back(root);
+	_path_stack[0] = 0;
+
+	const unsigned int *prev_path = NULL;
+	unsigned short prev_order = 0;
+
+	for (k = 0; k < n; k++)
+	{
+		const reflection_t &r = list.reflections[order[k]];
+		const unsigned int *path = (r.order > 0) ? &list.paths[r.path] : NULL;
+		unsigned short depth = 0;
+
+		// the nodes of the shared prefix are still in _path_stack
+		while (depth < r.order && depth < prev_order && path[depth] == prev_path[depth])
+			depth++;
+
+		for (; depth < r.order; depth++)
+		{
+			pathnode_t node = { _path_stack[depth], path[depth], (unsigned short) (depth + 1) };
+			_path_stack[depth + 1] = _path_nodes.size();
+			_path_nodes.push_back(node);
+		}
+
+		_reflection_nodes[order[k]] = _path_stack[r.order];
+		prev_path = path;
+		prev_order = r.order;
+	}
 
-	while (current_node != root_it)  // while the current node is not the root node
+	_node_signals.resize(_path_nodes.size() * VS_SAMPLES);
+
+	// the directivity of the source does not depend on the direction (see
+	// SoundSource::get_IR()), the empty path (direct sound) is the first one
+	const reflection_t &first = list.reflections[order[0]];
+	_source_signal(state.source, to_point3(first.pos_R - _listener->get_position_v()), &_node_signals[0]);
+
+	// surface filters, depth by depth (the parents are always ready)
+	unsigned long batch[IirBank::LANES];
+
+	for (unsigned short depth = 1; depth <= max_order; depth++)
 	{
-		VirtualSource::ptr_t vs = *current_node;
-		assert(vs.get() != NULL);
-		Surface::ptr_t s = vs->surface_ptr;
-		assert(s.get() != NULL);
+		unsigned int m = 0;
 
-//		t.start();
-		//_set coefficients and clear previous filter state
-		_filter_surfaces.setCoefficients(s->get_b_filter_coeff(), s->get_a_filter_coeff(), true);
+		for (k = 1; k < _path_nodes.size(); k++)
+		{
+			if (_path_nodes[k].depth != depth)
+				continue;
 
-		// filter for the current surface
-		for (uint i = 0; i < input.size(); i++)
-			values[i] = (sample_t) _filter_surfaces.tick(values[i]);
+			batch[m++] = k;
 
-//		t.stop();
-//		DPRINT("surface - time %.3f", t.elapsed_time(microsecond));
+			if (m == IirBank::LANES)
+			{
+				_surface_filter_batch(list, batch, m);
+				m = 0;
+			}
+		}
 
-		current_node = _ism->tree_vs.parent(current_node);  // get the parent
+		if (m > 0)
+			_surface_filter_batch(list, batch, m);
 	}
 
-	return values;
+	// the tree can have more nodes than reflections (see _reserve_buffers())
+	if (_path_nodes.capacity() + _node_signals.capacity() != capacity)
+		_render_grew = true;
+
+	for (k = 0; k < n; k++)
+	{
+		const reflection_t &r = list.reflections[k];
+		const sample_t *signal = &_node_signals[_reflection_nodes[k] * VS_SAMPLES];
+		sample_t *output = &state.pre_hrtf[k * VS_SAMPLES];
+
+		// the gain of the direct sound is zero when it is blocked (see
+		// Ism::_publish()), the surface filters give the gain of the others
+		float gain = (r.order == 0) ? r.gain : 1.0f;
+
+#ifdef APPLY_AIR_FILTERING
+		// distance attenuation
+		float attenuation_factor = gain / r.dist_listener;
+
+		for (i = 0; i < (unsigned long) VS_SAMPLES; i++)
+			output[i] = signal[i] * attenuation_factor;
+#else
+		if (gain == 1.0f)
+		{
+			memcpy(output, signal, VS_SAMPLES * sizeof(sample_t));
+		}
+		else
+		{
+			for (i = 0; i < (unsigned long) VS_SAMPLES; i++)
+				output[i] = signal[i] * gain;
+		}
+#endif
+	}
 }
 
-// IIR filter for single reflection
-binauraldata_t VirtualEnvironment::_hrtf_iir_filter(data_t &input, const point3_t &vs_pos_R)
+// Material filters of n nodes of the prefix tree (n <= IirBank::LANES), from
+// the signals of their parents
+void VirtualEnvironment::_surface_filter_batch(const Ism::reflectionlist_t &list, const unsigned long *nodes,
+		unsigned int n)
 {
-//	TimerRtai t;
-	binauraldata_t output(BUFFER_SAMPLES);
-	stk::StkFrames out_l(input.size(), 1);  // one channel
-	stk::StkFrames out_r(input.size(), 1);  // one channel
+	const unsigned int L = IirBank::LANES;
+	unsigned int lane, j;
+
+#ifdef APPLY_SURFACE_FILTERING
+	float *input = _surface_bank.input();
 
-	point3_t vs_pos_L = (vs_pos_R - _listener->get_position()) * _listener->get_rotation();
-	vs_pos_L = normalise(vs_pos_L);
+	for (lane = 0; lane < L; lane++)
+	{
+		if (lane < n)
+		{
+			const pathnode_t &node = _path_nodes[nodes[lane]];
+			const Surface::ptr_t &s = list.surfaces[node.surface];
+			assert(s.get() != NULL);
 
-//	t.start();
+			const sample_t *parent = &_node_signals[node.parent * VS_SAMPLES];
+			_surface_bank.set_lane(lane, s->get_b_filter_coeff(), s->get_a_filter_coeff());
 
-	// get the best-fit HRTF for both ears
-	_hcdb->get_HRTF_coeff(&_hc, vs_pos_L);
+			for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+				input[j * L + lane] = parent[j];
+		}
+		else  // unused lane
+		{
+			_surface_bank.clear_lane(lane);
 
-//	t.stop();
-//	DPRINT("Kd-tree - time %.3f", t.elapsed_time(microsecond));
+			for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+				input[j * L + lane] = 0.0f;
+		}
+	}
 
-//	t.start();
-	_filter_l.setCoefficients(_hc.b_left, _hc.a_left, true);
-	_filter_r.setCoefficients(_hc.b_right, _hc.a_right, true);
+	_surface_bank.filter(VS_SAMPLES);
+	const float *output = _surface_bank.output();
+
+	for (lane = 0; lane < n; lane++)
+	{
+		sample_t *signal = &_node_signals[nodes[lane] * VS_SAMPLES];
+
+		for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+			signal[j] = output[j * L + lane];
+	}
+#else
+	for (lane = 0; lane < n; lane++)
+	{
+		const pathnode_t &node = _path_nodes[nodes[lane]];
+		memcpy(&_node_signals[nodes[lane] * VS_SAMPLES], &_node_signals[node.parent * VS_SAMPLES],
+				VS_SAMPLES * sizeof(sample_t));
+	}
+#endif
+}
+
+// Renders with the workers the reflections of a list whose HRTF changed
+// since the last render of the source: their old contributions are
+// subtracted from the early part and the new ones are added. All of them
+// are rendered for a new list. Returns false if the early part did not
+// change, otherwise [lo, hi) are the samples that changed.
+bool VirtualEnvironment::_render_reflections(sourcestate_t &state, const Ism::reflectionlist_t &list,
+		unsigned long &lo, unsigned long &hi)
+{
+	const unsigned long n = list.reflections.size();
+	unsigned long i;
+	bool new_list = (state.hrtf_generation != list.generation);
+
+	if (new_list)
+	{
+		state.hrtf.assign(n, no_hrtf);
+		state.contrib_l.assign(n * VS_SAMPLES, 0.0f);
+		state.contrib_r.assign(n * VS_SAMPLES, 0.0f);
+		memset(&state.early.left[0], 0, _length_bir * sizeof(sample_t));
+		memset(&state.early.right[0], 0, _length_bir * sizeof(sample_t));
+		state.hrtf_generation = list.generation;
+		state.incremental_updates = 0;
+	}
+
+	// the directions are looked up here, the workers only filter the dirty ones
+	_render_dirty.clear();
+
+	for (i = 0; i < n; i++)
+	{
+#ifdef APPLY_HRTF_FILTERING
+		point3_t vs_pos_L = (to_point3(list.reflections[i].pos_R) - _listener->get_position()) * _listener->get_rotation();
+		uint hrtf = _hcdb->find_direction(normalise(vs_pos_L));
+
+		// the cells are small, the HRTFs and weights of the rendered one are
+		// kept while the interpolation is almost the same
+		if (hrtf != state.hrtf[i] && state.hrtf[i] != no_hrtf
+				&& similar_weights(_hcdb->get_HRTF_weights(hrtf), _hcdb->get_HRTF_weights(state.hrtf[i])))
+			hrtf = state.hrtf[i];
+#else
+		uint hrtf = 0;  // it does not depend on the direction
+#endif
+
+		if (hrtf != state.hrtf[i])
+		{
+			state.hrtf[i] = hrtf;
+			_render_dirty.push_back(i);
+		}
+	}
+
+	lo = 0;
+	hi = new_list ? _length_bir : 0;
+
+	if (_render_dirty.empty())
+		return new_list;
 
-	// HRTF filtering
-	#pragma omp for
-	for (uint i = 0; i < input.size(); i++)
+	lo = _length_bir;
+
+	_render_state = &state;
+	_render_list = &list;
+
+	if (_render_running)
 	{
-		out_l[i] = _filter_l.tick(input[i]);
-		out_r[i] = _filter_r.tick(input[i]);
+		pthread_mutex_lock(&_render_mutex);
+		_render_pending = _workers.size() - 1;
+		_render_job++;
+		pthread_cond_broadcast(&_render_start_cond);
+		pthread_mutex_unlock(&_render_mutex);
 	}
 
-	_delay.clear();
+	_render_chunk(*_workers[0]);
 
-	// ITD
-	if (_hc.itd > 0)  // left is delayed
+	if (_render_running)
 	{
-		_delay.setDelay(_hc.itd);
-		_delay.tick(out_l);
+		pthread_mutex_lock(&_render_mutex);
+
+		while (_render_pending > 0)
+			pthread_cond_wait(&_render_done_cond, &_render_mutex);
+
+		pthread_mutex_unlock(&_render_mutex);
 	}
-	else if (_hc.itd < 0)  // right is delayed
+
+	// reduction, the buffers are cleared for the next job
+	for (i = 0; i < _workers.size(); i++)
 	{
-		_delay.setDelay((-1) * _hc.itd);  // change the sign
-		_delay.tick(out_r);
+		renderworker_t &w = *_workers[i];
+
+		if (w.lo >= w.hi)
+			continue;
+
+		lo = std::min(lo, w.lo);
+		hi = std::max(hi, w.hi);
+
+		unsigned long length = w.hi - w.lo;
+		add_samples(&state.early.left[w.lo], &w.accum.left[w.lo], length);
+		add_samples(&state.early.right[w.lo], &w.accum.right[w.lo], length);
+		memset(&w.accum.left[w.lo], 0, length * sizeof(sample_t));
+		memset(&w.accum.right[w.lo], 0, length * sizeof(sample_t));
 	}
 
-	#pragma omp for
-	for (uint i = 0; i < out_l.size(); i++)
+	_render_state = NULL;
+	_render_list = NULL;
+
+	if (++state.incremental_updates >= max_incremental_updates)
 	{
-		output.left[i] = (sample_t) out_l[i];
-		output.right[i] = (sample_t) out_r[i];
+		_sum_contributions(state, list);
+		lo = 0;
+		hi = _length_bir;
 	}
 
-//	t.stop();
-//	DPRINT("HRTF - time %.3f", t.elapsed_time(microsecond));
+	if (new_list)
+	{
+		lo = 0;
+		hi = _length_bir;
+	}
 
-	return output;
+	return true;
+}
+
+// Spectra of the partitions of the BIR that contain the samples [lo, hi), in
+// the format of Convolver::prepare_impulse_response()
+void VirtualEnvironment::_update_partitions(sourcestate_t &state, unsigned long lo, unsigned long hi)
+{
+	const unsigned long N = BUFFER_SAMPLES;
+	binauraldata_t &bir = state.render_buffer;
+
+	if (lo >= hi)
+		return;
+
+	for (unsigned long p = lo / N; p < _n_partitions && p * N < hi; p++)
+	{
+		unsigned long length = std::min(N, _length_bir - p * N);
+
+		for (unsigned int ear = 0; ear < 2; ear++)
+		{
+			const data_t &input = (ear == 0) ? bir.left : bir.right;
+			data_t &output = (ear == 0) ? state.partitions.left : state.partitions.right;
+
+			// zero pad
+			std::fill(_fft_buffer.begin(), _fft_buffer.end(), 0.0f);
+			std::copy(input.begin() + p * N, input.begin() + p * N + length, _fft_buffer.begin());
+
+			fftwf_execute(_fft_plan);
+			Convolver::sort_coefficients(&_fft_buffer[0], &output[2 * p * N], 2 * N);
+		}
+	}
+}
+
+// Sums again the early part from the contributions of the reflections, so the
+// rounding errors of the incremental updates do not accumulate
+void VirtualEnvironment::_sum_contributions(sourcestate_t &state, const Ism::reflectionlist_t &list)
+{
+	unsigned long i;
+
+	memset(&state.early.left[0], 0, _length_bir * sizeof(sample_t));
+	memset(&state.early.right[0], 0, _length_bir * sizeof(sample_t));
+
+	for (i = 0; i < list.reflections.size(); i++)
+	{
+		unsigned long sample = (unsigned long) round((list.reflections[i].time_rel_ms * SAMPLE_RATE) / 1000.0f);
+
+		if (sample >= _length_bir)
+			continue;
+
+		unsigned long length = std::min((unsigned long) VS_SAMPLES, _length_bir - sample);
+		add_samples(&state.early.left[sample], &state.contrib_l[i * VS_SAMPLES], length);
+		add_samples(&state.early.right[sample], &state.contrib_r[i * VS_SAMPLES], length);
+	}
+
+	state.incremental_updates = 0;
+}
+
+// Reflections of the current job for a worker. The dirty reflections are
+// sorted by time, so a contiguous chunk writes a short range of the buffer.
+// Their HRTFs are filtered in batches that fill all the lanes of the bank
+// of the worker.
+void VirtualEnvironment::_render_chunk(renderworker_t &w)
+{
+	const unsigned long n = _render_dirty.size();
+	const unsigned long begin = (n * w.index) / _workers.size();
+	const unsigned long end = (n * (w.index + 1)) / _workers.size();
+
+	w.lo = _length_bir;
+	w.hi = 0;
+
+#ifdef APPLY_HRTF_FILTERING
+	unsigned long i = begin;
+	unsigned int t = 0;
+
+	while (i < end)
+		_hrtf_filter_batch(w, i, t, begin, end);
+#else
+	for (unsigned long i = begin; i < end; i++)
+		_add_reflection(w, _render_dirty[i], 0);
+#endif
+}
+
+// HRTF filtering of the next lane pairs of the dirty reflections [begin,
+// end), from the HRTF t of the reflection i (both are advanced). Each
+// reflection takes two lanes (left and right ear) for each HRTF of its
+// triangle, a reflection can continue in the next batch. The outputs are
+// mixed with their weights, the reflection is added when its mix is
+// complete (see _add_reflection()). The IIR coefficients can not be
+// interpolated (the filter could be unstable), but their outputs can.
+void VirtualEnvironment::_hrtf_filter_batch(renderworker_t &w, unsigned long &i, unsigned int &t,
+		unsigned long begin, unsigned long end)
+{
+	const sourcestate_t &state = *_render_state;
+	const unsigned int L = IirBank::LANES;
+	float *input = w.bank.input();
+	unsigned int lane, j, p;
+
+	// the slots of the reflections of a batch are different: it has at most
+	// L / 2 of them, and they are consecutive
+	for (lane = 0; lane < L && i < end; lane += 2)
+	{
+		const unsigned long r = _render_dirty[i];
+		const hrtfweights_t &hw = _hcdb->get_HRTF_weights(state.hrtf[r]);
+		hrtfpair_t &pair = w.pairs[lane / 2];
+		pair.slot = (i - begin) % (L / 2);
+		pair.weight = hw.weight[t];
+		pair.reflection = r;
+
+		if (t == 0)
+		{
+			memset(&w.mix.left[pair.slot * VS_SAMPLES], 0, VS_SAMPLES * sizeof(sample_t));
+			memset(&w.mix.right[pair.slot * VS_SAMPLES], 0, VS_SAMPLES * sizeof(sample_t));
+			w.itd[pair.slot] = 0.0f;
+		}
+
+		_hcdb->get_HRTF_coeff(&w.hc, hw.index[t]);
+		w.bank.set_lane(lane, w.hc.b_left, w.hc.a_left);
+		w.bank.set_lane(lane + 1, w.hc.b_right, w.hc.a_right);
+		w.itd[pair.slot] += hw.weight[t] * w.hc.itd;
+
+		const sample_t *signal = &state.pre_hrtf[r * VS_SAMPLES];
+
+		for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+			input[j * L + lane] = input[j * L + lane + 1] = signal[j];
+
+		// the weights sum 1
+		pair.last = (++t == hw.n);
+
+		if (pair.last)
+		{
+			t = 0;
+			i++;
+		}
+	}
+
+	const unsigned int n_pairs = lane / 2;
+
+	for (; lane < L; lane++)  // unused lanes
+	{
+		w.bank.clear_lane(lane);
+
+		for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+			input[j * L + lane] = 0.0f;
+	}
+
+	w.bank.filter(VS_SAMPLES);
+
+	const float *output = w.bank.output();
+
+	for (p = 0; p < n_pairs; p++)
+	{
+		const hrtfpair_t &pair = w.pairs[p];
+		sample_t *mix_l = &w.mix.left[pair.slot * VS_SAMPLES];
+		sample_t *mix_r = &w.mix.right[pair.slot * VS_SAMPLES];
+
+		for (j = 0; j < (unsigned int) VS_SAMPLES; j++)
+		{
+			mix_l[j] += pair.weight * output[j * L + 2 * p];
+			mix_r[j] += pair.weight * output[j * L + 2 * p + 1];
+		}
+
+		if (pair.last)
+			_add_reflection(w, pair.reflection, pair.slot);
+	}
+}
+
+// Adds a reflection to the buffer of the worker: the difference of its HRTF
+// output (the mix of the slot k) with its previous contribution
+void VirtualEnvironment::_add_reflection(renderworker_t &w, unsigned long r, unsigned long k)
+{
+	sourcestate_t &state = *_render_state;
+	sample_t *contrib_l = &state.contrib_l[r * VS_SAMPLES];
+	sample_t *contrib_r = &state.contrib_r[r * VS_SAMPLES];
+	unsigned long i, j;
+
+	// calculate the sample from reflectogram where starts this reflection
+	unsigned long sample = (unsigned long) round((_render_list->reflections[r].time_rel_ms * SAMPLE_RATE) / 1000.0f);
+
+	if (sample >= _length_bir)
+		return;
+
+	unsigned long length = std::min((unsigned long) VS_SAMPLES, _length_bir - sample);
+
+#ifdef APPLY_HRTF_FILTERING
+	const sample_t *mix_l = &w.mix.left[k * VS_SAMPLES];
+	const sample_t *mix_r = &w.mix.right[k * VS_SAMPLES];
+
+	// ITD (the delayed ear is shifted, the tail beyond VS_SAMPLES is lost)
+	int itd_k = (int) round(w.itd[k]);
+	unsigned long itd = std::min((unsigned long) abs(itd_k), (unsigned long) VS_SAMPLES);
+	unsigned long itd_l = (itd_k > 0) ? itd : 0;
+	unsigned long itd_r = (itd_k < 0) ? itd : 0;
+
+	// replace the contribution in the reflectogram
+	for (i = sample, j = 0; j < length; i++, j++)
+	{
+		sample_t out_l = (j >= itd_l) ? mix_l[j - itd_l] : 0.0f;
+		sample_t out_r = (j >= itd_r) ? mix_r[j - itd_r] : 0.0f;
+
+		w.accum.left[i] += out_l - contrib_l[j];
+		w.accum.right[i] += out_r - contrib_r[j];
+		contrib_l[j] = out_l;
+		contrib_r[j] = out_r;
+	}
+#else
+	// Non HRTF filtering
+	const sample_t *input = &state.pre_hrtf[r * VS_SAMPLES];
+
+	for (i = sample, j = 0; j < length; i++, j++)
+	{
+		w.accum.left[i] += input[j] - contrib_l[j];
+		w.accum.right[i] += input[j] - contrib_r[j];
+		contrib_l[j] = input[j];
+		contrib_r[j] = input[j];
+	}
+#endif
+
+	w.lo = std::min(w.lo, sample);
+	w.hi = std::max(w.hi, sample + length);
+}
+
+// Asks the background thread for a revalidation of the VSs. It never blocks:
+// if the thread holds the lock, the request is tried again in the next cycle.
+void VirtualEnvironment::_request_revalidation(const vec3_t &pos)
+{
+	if (pthread_mutex_trylock(&_update_mutex) != 0)
+		return;
+
+	_revalidate_pos = pos;  // only the last position is kept
+	_revalidate_pending = true;
+	pthread_cond_signal(&_update_cond);
+	pthread_mutex_unlock(&_update_mutex);
+	_revalidate_last_pos = pos;
+}
+
+// As _request_revalidation(), returns false if the request was not sent
+bool VirtualEnvironment::_request_source_move(sourcestate_t &state)
+{
+	if (pthread_mutex_trylock(&_update_mutex) != 0)
+		return false;
+
+	state.pos = to_vec3(state.data.pos.to_point3());  // only the last position is kept
+	state.pending = true;
+	_source_pending = true;
+	pthread_cond_signal(&_update_cond);
+	pthread_mutex_unlock(&_update_mutex);
+	return true;
+}
+
+unsigned int VirtualEnvironment::add_surface(Surface::ptr_t s)
+{
+	assert(s.get() != NULL);
+	surfacechange_t change;
+	change.type = SURFACE_ADD;
+	change.id = 0;  // given when it is queued
+	change.offset = vec3(0.0f, 0.0f, 0.0f);
+	change.surface = s;
+	_request_surface_change(change);
+	return change.id;
+}
+
+void VirtualEnvironment::move_surface(unsigned int id, const vec3_t &offset)
+{
+	surfacechange_t change;
+	change.type = SURFACE_MOVE;
+	change.id = id;
+	change.offset = offset;
+	_request_surface_change(change);
+}
+
+void VirtualEnvironment::remove_surface(unsigned int id)
+{
+	surfacechange_t change;
+	change.type = SURFACE_REMOVE;
+	change.id = id;
+	change.offset = vec3(0.0f, 0.0f, 0.0f);
+	_request_surface_change(change);
+}
+
+// Queues a change of the room (not for the real-time thread, it can block),
+// a new surface gets its id here
+void VirtualEnvironment::_request_surface_change(surfacechange_t &change)
+{
+	if (!_update_running)
+		throw AvrsException("The room has no dynamic surfaces");
+
+	pthread_mutex_lock(&_update_mutex);
+
+	// the room is only changed by the update thread, with the lock held
+	if (change.type == SURFACE_ADD)
+	{
+		change.id = _room->new_surface_id();
+	}
+	else
+	{
+		int index = _room->find_surface(change.id);
+
+		if (index < 0 || !_room->get_surface(index)->is_dynamic())
+		{
+			pthread_mutex_unlock(&_update_mutex);
+			throw AvrsException("Only dynamic surfaces can be moved or removed");
+		}
+	}
+
+	_surface_changes.push_back(change);
+	pthread_cond_signal(&_update_cond);
+	pthread_mutex_unlock(&_update_mutex);
+}
+
+void *VirtualEnvironment::_update_wrapper(void *arg)
+{
+	return reinterpret_cast<VirtualEnvironment*> (arg)->_update_thread();
+}
+
+void *VirtualEnvironment::_update_thread()
+{
+	while (true)
+	{
+		pthread_mutex_lock(&_update_mutex);
+
+		while (_update_running && !_revalidate_pending && !_source_pending && _surface_changes.empty())
+			pthread_cond_wait(&_update_cond, &_update_mutex);
+
+		if (!_update_running)
+		{
+			pthread_mutex_unlock(&_update_mutex);
+			break;
+		}
+
+		// changes of the room
+		std::vector<unsigned int> changed;
+
+		for (unsigned int k = 0; k < _surface_changes.size(); k++)
+		{
+			const surfacechange_t &change = _surface_changes[k];
+
+			switch (change.type)
+			{
+			case SURFACE_ADD:
+				_room->add_surface(change.surface, change.id);
+				break;
+
+			case SURFACE_MOVE:
+				_room->move_surface(change.id, change.offset);
+				break;
+
+			case SURFACE_REMOVE:
+				_room->remove_surface(change.id);
+				break;
+			}
+
+			// the ISMs use the index in the room
+			unsigned int index = (unsigned int) _room->find_surface(change.id);
+
+			if (std::find(changed.begin(), changed.end(), index) == changed.end())
+				changed.push_back(index);
+		}
+
+		_surface_changes.clear();
+
+		bool revalidate = _revalidate_pending;
+		vec3_t pos = _revalidate_pos;
+		std::vector<char> move_source(_sources.size(), 0);
+		std::vector<vec3_t> pos_source(_sources.size());
+
+		for (unsigned int k = 0; k < _sources.size() && _source_pending; k++)
+		{
+			move_source[k] = _sources[k].pending;
+			pos_source[k] = _sources[k].pos;
+			_sources[k].pending = false;
+		}
+
+		_revalidate_pending = false;
+		_source_pending = false;
+		pthread_mutex_unlock(&_update_mutex);
+
+		// the ISMs are independent (they only read the room)
+		#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < (int) _sources.size(); k++)
+		{
+			Ism::ptr_t ism = _sources[k].ism;
+
+			if (revalidate)
+				ism->revalidate(pos);
+
+			if (move_source[k])
+				ism->move_source(pos_source[k]);
+
+			// only the subtrees of the changed surfaces
+			for (unsigned int i = 0; i < changed.size(); i++)
+				ism->update_surface(changed[i]);
+		}
+
+		__sync_lock_test_and_set(&_ism_updated, 1);
+	}
+
+	return NULL;
+}
+
+// Room in the buffers of the renderer for a list of n reflections, so the
+// following renders do not allocate
+void VirtualEnvironment::_reserve_buffers(sourcestate_t &state, unsigned long n)
+{
+	state.pre_hrtf.reserve(n * VS_SAMPLES);
+	state.hrtf.reserve(n);
+	state.contrib_l.reserve(n * VS_SAMPLES);
+	state.contrib_r.reserve(n * VS_SAMPLES);
+	state.max_reflections = std::max(state.max_reflections, n);
+
+	// shared by all the sources
+	_pre_hrtf_order.reserve(n);
+	_reflection_nodes.reserve(n);
+	_path_nodes.reserve(n + 1);
+	_node_signals.reserve((n + 1) * VS_SAMPLES);
+	_render_dirty.reserve(n);
+}
+
+// Creates the workers of the renderer (see renderworker_t)
+void VirtualEnvironment::_start_workers()
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n_cpus < 1)
+		n_cpus = 1;
+
+	unsigned int n_workers = (_config->render_threads > 0) ? _config->render_threads : (unsigned int) n_cpus;
+
+	_render_running = false;
+	_render_job = 0;
+	_render_pending = 0;
+	_render_state = NULL;
+	_render_list = NULL;
+
+	for (unsigned int k = 0; k < n_workers; k++)
+	{
+		boost::shared_ptr<renderworker_t> w = boost::make_shared<renderworker_t>();
+		w->ve = this;
+		w->index = k;
+		w->accum = binauraldata_t(_length_bir);
+		w->mix = binauraldata_t((IirBank::LANES / 2) * VS_SAMPLES);
+		w->lo = _length_bir;
+		w->hi = 0;
+		w->allocations = 0;
+		_workers.push_back(w);
+	}
+
+	if (n_workers > 1)
+	{
+		pthread_mutex_init(&_render_mutex, NULL);
+		pthread_cond_init(&_render_start_cond, NULL);
+		pthread_cond_init(&_render_done_cond, NULL);
+		_render_running = true;
+
+		for (unsigned int k = 1; k < n_workers; k++)
+		{
+			renderworker_t *w = _workers[k].get();
+
+			if (pthread_create(&w->thread_id, NULL, VirtualEnvironment::_render_wrapper, w) != 0)
+			{
+				WARNING("Cannot create render thread %d", k);
+				_workers.resize(k);  // the chunks are split among the created ones
+				break;
+			}
+
+			// the first worker is the caller, the others go to the following cores
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(k % n_cpus, &cpus);
+
+			if (pthread_setaffinity_np(w->thread_id, sizeof(cpu_set_t), &cpus) != 0)
+				WARNING("Cannot pin render thread %d", k);
+		}
+	}
+
+	std::cout << "Render threads: " << _workers.size() << std::endl;
+}
+
+void VirtualEnvironment::_stop_workers()
+{
+	if (!_render_running)
+		return;
+
+	pthread_mutex_lock(&_render_mutex);
+	_render_running = false;
+	pthread_cond_broadcast(&_render_start_cond);
+	pthread_mutex_unlock(&_render_mutex);
+
+	for (unsigned int k = 1; k < _workers.size(); k++)
+		pthread_join(_workers[k]->thread_id, NULL);
+
+	pthread_cond_destroy(&_render_done_cond);
+	pthread_cond_destroy(&_render_start_cond);
+	pthread_mutex_destroy(&_render_mutex);
+}
+
+void *VirtualEnvironment::_render_wrapper(void *arg)
+{
+	renderworker_t *w = reinterpret_cast<renderworker_t*> (arg);
+	return w->ve->_render_thread(*w);
+}
+
+void *VirtualEnvironment::_render_thread(renderworker_t &w)
+{
+	unsigned long job = 0;
+
+	while (true)
+	{
+		pthread_mutex_lock(&_render_mutex);
+
+		while (_render_running && _render_job == job)
+			pthread_cond_wait(&_render_start_cond, &_render_mutex);
+
+		if (!_render_running)
+		{
+			pthread_mutex_unlock(&_render_mutex);
+			break;
+		}
+
+		job = _render_job;
+		pthread_mutex_unlock(&_render_mutex);
+
+#ifdef ALLOCATION_COUNTER
+		unsigned long allocations = alloccounter::count();
+#endif
+
+		_render_chunk(w);
+
+#ifdef ALLOCATION_COUNTER
+		w.allocations += alloccounter::count() - allocations;
+#endif
+
+		pthread_mutex_lock(&_render_mutex);
+
+		if (--_render_pending == 0)
+			pthread_cond_signal(&_render_done_cond);
+
+		pthread_mutex_unlock(&_render_mutex);
+	}
+
+	return NULL;
 }
 
 void VirtualEnvironment::_calc_late_reverberation()
@@ -436,12 +1444,16 @@ void VirtualEnvironment::_calc_late_reverberation()
 		_late_buffer[i] = (sample_t) (output[i] * scaling_factor);
 #endif
 
-	// add late part to render buffer
-	#pragma omp for
-	for (i = 0; i < _length_bir; i++)
+	// add late part to render buffers
+	for (unsigned int k = 0; k < _sources.size(); k++)
 	{
-		_render_buffer.left[i] += _late_buffer[i];
-		_render_buffer.right[i] += _late_buffer[i];
+		binauraldata_t &bir = _sources[k].render_buffer;
+
+		for (i = 0; i < _length_bir; i++)
+		{
+			bir.left[i] += _late_buffer[i];
+			bir.right[i] += _late_buffer[i];
+		}
 	}
 
 //	// FOR DEBUG!!!